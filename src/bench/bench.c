@@ -0,0 +1,476 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Micro-benchmarks of the cryptographic primitives, built on top of the
+ * emulation sources. The SDK main() is replaced through -Wl,--wrap=main.
+ *
+ * Usage: pico_fido_bench [-o out.json] [-b baseline.json] [-r threshold%] [-t ms] [-f filter]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "fido.h"
+#include "ctap.h"
+#include "files.h"
+#include "apdu.h"
+#include "random.h"
+#include "crypto_utils.h"
+#include "credential.h"
+#include "dispatch.h"
+#include "keyboard.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/sha256.h"
+
+extern int kdf(uint8_t protocol, const mbedtls_mpi *z, uint8_t *sharedSecret);
+extern int regenerate();
+extern int calculate_oath(uint8_t truncate,
+                          const uint8_t *key,
+                          size_t key_len,
+                          const uint8_t *chal,
+                          size_t chal_len);
+extern int oath_process_apdu();
+
+#define BENCH_MAX_RESULTS   64
+#define BENCH_MIN_ITERS     10
+
+/* Allocation accounting, through the malloc wrappers in dispatch.c */
+#ifdef DISPATCH_WRAP_ALLOC
+#define allocs      dispatch_heap_allocs
+#define alloc_bytes dispatch_heap_bytes
+#else
+static const uint64_t allocs = 0, alloc_bytes = 0;
+#endif
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+typedef struct bench_result {
+    char name[64];
+    uint64_t iterations;
+    double ns_per_op;
+    double cycles_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+} bench_result_t;
+
+static bench_result_t results[BENCH_MAX_RESULTS];
+static int num_results = 0;
+static uint64_t min_time_ns = 200000000;
+static const char *filter = NULL;
+
+/* Shared fixtures */
+static const uint8_t app_id[CTAP_APPID_SIZE] = { 0xa5 };
+static uint8_t key_handle[KEY_HANDLE_LEN];
+static uint8_t cred_id[MAX_CRED_ID_LENGTH];
+static size_t cred_id_len = 0;
+static uint8_t rp_id_hash[32];
+static uint8_t shared_secret[64];
+static uint8_t plain[64], cipher[IV_SIZE + 64 + IV_SIZE]; // decrypt() reads IV_SIZE past the message
+static mbedtls_ecp_keypair peer;
+static mbedtls_mpi z;
+static uint8_t rdata[4096];
+
+static void bench_run(const char *name, int (*fn)(void *), void *arg) {
+    if (filter && strstr(name, filter) == NULL) {
+        return;
+    }
+    if (num_results == BENCH_MAX_RESULTS) {
+        fprintf(stderr, "Too many benchmarks, skipping %s\n", name);
+        return;
+    }
+    if (fn(arg) != 0) { // Warm-up, also validates the fixture
+        fprintf(stderr, "Benchmark %s failed, skipping\n", name);
+        return;
+    }
+    uint64_t iters = 0, a0 = allocs, b0 = alloc_bytes, t0 = now_ns(), c0 = now_cycles(), t = 0;
+    do {
+        fn(arg);
+        iters++;
+        t = now_ns() - t0;
+    } while (t < min_time_ns || iters < BENCH_MIN_ITERS);
+    uint64_t c = now_cycles() - c0;
+    bench_result_t *r = &results[num_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->iterations = iters;
+    r->ns_per_op = (double) t / iters;
+    r->cycles_per_op = (double) c / iters;
+    r->allocs_per_op = (double) (allocs - a0) / iters;
+    r->bytes_per_op = (double) (alloc_bytes - b0) / iters;
+    fprintf(stderr, "%-32s %10.0f ns/op %12.0f cycles/op %6.1f allocs/op\n", r->name, r->ns_per_op,
+            r->cycles_per_op, r->allocs_per_op);
+}
+
+static int b_derive_key(void *arg) {
+    mbedtls_ecdsa_context ctx;
+    mbedtls_ecdsa_init(&ctx);
+    uint8_t kh[KEY_HANDLE_LEN];
+    int ret = derive_key(app_id, true, kh, MBEDTLS_ECP_DP_SECP256R1, &ctx);
+    mbedtls_ecdsa_free(&ctx);
+    return ret;
+}
+
+static int b_verify_key(void *arg) {
+    return verify_key(app_id, key_handle, NULL);
+}
+
+static int b_fido_load_key(void *arg) {
+    mbedtls_ecdsa_context ctx;
+    mbedtls_ecdsa_init(&ctx);
+    int ret = fido_load_key(FIDO2_CURVE_P256, cred_id, &ctx);
+    mbedtls_ecdsa_free(&ctx);
+    return ret;
+}
+
+static int b_credential_create(void *arg) {
+    CborCharString rpId = { .data = "example.com", .len = 11, .present = true, .nofree = true };
+    CborByteString userId = { .data = (uint8_t *) "\x01\x02\x03\x04", .len = 4, .present = true, .nofree = true };
+    CborCharString userName = { .data = "user", .len = 4, .present = true, .nofree = true };
+    CborCharString userDisplayName = { .data = "User", .len = 4, .present = true, .nofree = true };
+    CredOptions opts = { 0 };
+    CredExtensions extensions = { 0 };
+    uint8_t id[MAX_CRED_ID_LENGTH];
+    size_t id_len = 0;
+    int ret = credential_create(&rpId, &userId, &userName, &userDisplayName, &opts, &extensions,
+                                false, FIDO2_ALG_ES256, FIDO2_CURVE_P256, id, &id_len);
+    if (ret == 0 && arg != NULL) {
+        memcpy(cred_id, id, id_len);
+        cred_id_len = id_len;
+    }
+    return ret;
+}
+
+static int b_credential_verify(void *arg) {
+    return credential_verify(cred_id, cred_id_len, rp_id_hash);
+}
+
+static int b_credential_load(void *arg) {
+    Credential cred = { 0 };
+    int ret = credential_load(cred_id, cred_id_len, rp_id_hash, &cred);
+    credential_free(&cred);
+    return ret;
+}
+
+static int b_credential_derive_hmac_key(void *arg) {
+    uint8_t outk[64];
+    return credential_derive_hmac_key(cred_id, cred_id_len, outk);
+}
+
+static int b_ecdh(void *arg) {
+    return ecdh(*(uint8_t *) arg, &peer.Q, shared_secret);
+}
+
+static int b_kdf(void *arg) {
+    return kdf(*(uint8_t *) arg, &z, shared_secret);
+}
+
+static int b_encrypt(void *arg) {
+    return encrypt(*(uint8_t *) arg, shared_secret, plain, sizeof(plain), cipher);
+}
+
+static int b_decrypt(void *arg) {
+    uint8_t protocol = *(uint8_t *) arg, out[sizeof(cipher)];
+    return decrypt(protocol, shared_secret, cipher, sizeof(plain) + (protocol == 2 ? IV_SIZE : 0), out);
+}
+
+static int b_ecdsa_sign(void *arg) {
+    mbedtls_ecdsa_context *ctx = (mbedtls_ecdsa_context *) arg;
+    uint8_t hash[64] = { 0 }, sig[MBEDTLS_ECDSA_MAX_LEN];
+    size_t olen = 0;
+    return mbedtls_ecdsa_write_signature(ctx, MBEDTLS_MD_SHA256, hash, 32, sig, sizeof(sig), &olen,
+                                         random_gen, NULL);
+}
+
+/* A key that is not stored, so without cached HMAC states, as for OTP HOTP slots */
+static int b_calculate_oath(void *arg) {
+    uint8_t key[2 + 64] = { 0 };
+    key[0] = *(uint8_t *) arg | 0x20; // TOTP
+    key[1] = 6;
+    res_APDU_size = 0;
+    return calculate_oath(0x01, key, sizeof(key), (const uint8_t *) "\x00\x00\x00\x00\x03\x5a\x1b\x2c", 8);
+}
+
+/* Issues an OATH APDU with the response in rdata */
+static uint16_t oath_apdu(uint8_t ins, uint8_t p1, uint8_t p2, const uint8_t *data, size_t len) {
+    static uint8_t header[4], buf[64];
+    header[0] = 0x00;
+    header[1] = ins;
+    header[2] = p1;
+    header[3] = p2;
+    if (len > 0) {
+        memcpy(buf, data, len);
+    }
+    apdu.header = header;
+    apdu.data = buf;
+    apdu.nc = len;
+    apdu.ne = 0;
+    res_APDU = rdata;
+    res_APDU_size = 0;
+    oath_process_apdu();
+    return apdu.sw;
+}
+
+#define BENCH_OATH_CREDS    32
+
+/* Stores BENCH_OATH_CREDS credentials of the given algorithm */
+static int oath_fixture(uint8_t alg) {
+    if (oath_apdu(0x04, 0xde, 0xad, NULL, 0) != 0x9000) {
+        return -1;
+    }
+    for (int i = 0; i < BENCH_OATH_CREDS; i++) {
+        uint8_t data[5 + 4 + 20] = { 0x71, 3, 'b', '0' + i / 10, '0' + i % 10, 0x73, 2 + 20, alg | 0x20, 6 };
+        random_gen(NULL, data + 9, 20);
+        if (oath_apdu(0x01, 0x00, 0x00, data, sizeof(data)) != 0x9000) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Full responses of CALCULATE_ALL over the stored credentials, through the HMAC state cache */
+static int b_calculate_all_oath(void *arg) {
+    static const uint8_t chal[] = { 0x74, 8, 0x00, 0x00, 0x00, 0x00, 0x03, 0x5a, 0x1b, 0x2c };
+    uint16_t sw = oath_apdu(0xa4, 0x00, 0x00, chal, sizeof(chal));
+    while ((sw & 0xff00) == 0x6100) {
+        sw = oath_apdu(0xa5, 0x00, 0x00, NULL, 0);
+    }
+    return sw == 0x9000 ? 0 : -1;
+}
+
+/* Plans and drains a Yubico OTP through the keyboard scheduler with a simulated clock */
+static int b_kbd_emit(void *arg) {
+    static const uint8_t otp[] = "ccccccbcgujhingjrdejhgfnuetrgigvejhhgbkugded\r";
+    kbd_report_t report;
+    kbd_pull = true;
+    kbd_type(otp, sizeof(otp) - 1, true, *(uint8_t *) arg);
+    for (uint32_t ms = 0; kbd_pending(); ms += KBD_POLL_MS) {
+        kbd_next_report(&report, ms);
+    }
+    kbd_pull = false;
+    return 0;
+}
+
+/* Loads "name": ..., "ns_per_op": ... pairs from a file written by this tool. */
+static int load_baseline(const char *path, bench_result_t *base, int max) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char line[512];
+    int n = 0;
+    while (n < max && fgets(line, sizeof(line), fp)) {
+        const char *p = strstr(line, "\"name\": \""), *q = strstr(line, "\"ns_per_op\": ");
+        if (p == NULL || q == NULL) {
+            continue;
+        }
+        if (sscanf(p, "\"name\": \"%63[^\"]\"", base[n].name) == 1 &&
+            sscanf(q, "\"ns_per_op\": %lf", &base[n].ns_per_op) == 1) {
+            n++;
+        }
+    }
+    fclose(fp);
+    return n;
+}
+
+static void write_json(FILE *fp) {
+    fprintf(fp, "{\n  \"benchmarks\": [\n");
+    for (int i = 0; i < num_results; i++) {
+        const bench_result_t *r = &results[i];
+        fprintf(fp,
+                "    { \"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f, \"cycles_per_op\": %.1f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f }%s\n",
+                r->name, (unsigned long long) r->iterations, r->ns_per_op, r->cycles_per_op,
+                r->allocs_per_op, r->bytes_per_op, i + 1 < num_results ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int __wrap_main(int argc, char *argv[]) {
+    const char *output = NULL, *baseline = NULL;
+    double threshold = 10.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            min_time_ns = (uint64_t) atoi(argv[++i]) * 1000000;
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        }
+        else {
+            fprintf(stderr,
+                    "Usage: %s [-o out.json] [-b baseline.json] [-r threshold%%] [-t ms] [-f filter]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    init_fido();
+    res_APDU = rdata;
+    mbedtls_sha256((const uint8_t *) "example.com", 11, rp_id_hash, 0);
+    mbedtls_ecdsa_context kh_ctx;
+    mbedtls_ecdsa_init(&kh_ctx);
+    if (derive_key(app_id, true, key_handle, MBEDTLS_ECP_DP_SECP256R1, &kh_ctx) != 0 ||
+        b_credential_create(cred_id) != 0) {
+        fprintf(stderr, "Cannot initialize fixtures. Is the flash initialized?\n");
+        return 1;
+    }
+    mbedtls_ecdsa_free(&kh_ctx);
+    regenerate();
+    mbedtls_ecp_keypair_init(&peer);
+    mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, &peer, random_gen, NULL);
+    mbedtls_mpi_init(&z);
+    mbedtls_mpi_fill_random(&z, 32, random_gen, NULL);
+    random_gen(NULL, shared_secret, sizeof(shared_secret));
+    random_gen(NULL, plain, sizeof(plain));
+
+    bench_run("derive_key", b_derive_key, NULL);
+    bench_run("verify_key", b_verify_key, NULL);
+    bench_run("fido_load_key", b_fido_load_key, NULL);
+    bench_run("credential_create", b_credential_create, NULL);
+    bench_run("credential_verify", b_credential_verify, NULL);
+    bench_run("credential_load", b_credential_load, NULL);
+    bench_run("credential_derive_hmac_key", b_credential_derive_hmac_key, NULL);
+    static const uint8_t protocols[] = { 1, 2 };
+    static const char *const pnames[][4] = {
+        { "ecdh_p1", "kdf_p1", "encrypt_p1", "decrypt_p1" },
+        { "ecdh_p2", "kdf_p2", "encrypt_p2", "decrypt_p2" },
+    };
+    for (int i = 0; i < sizeof(protocols); i++) {
+        void *arg = (void *) &protocols[i];
+        bench_run(pnames[i][0], b_ecdh, arg);
+        bench_run(pnames[i][1], b_kdf, arg);
+        bench_run(pnames[i][2], b_encrypt, arg);
+        b_encrypt(arg);
+        bench_run(pnames[i][3], b_decrypt, arg);
+    }
+    static const struct {
+        int curve;
+        const char *name;
+    } curves[] = {
+        { FIDO2_CURVE_P256, "ecdsa_sign_p256" },
+        { FIDO2_CURVE_P384, "ecdsa_sign_p384" },
+        { FIDO2_CURVE_P521, "ecdsa_sign_p521" },
+        { FIDO2_CURVE_P256K1, "ecdsa_sign_p256k1" },
+    };
+    for (int i = 0; i < sizeof(curves) / sizeof(curves[0]); i++) {
+        mbedtls_ecdsa_context ctx;
+        mbedtls_ecdsa_init(&ctx);
+        if (fido_load_key(curves[i].curve, cred_id, &ctx) == 0) {
+            bench_run(curves[i].name, b_ecdsa_sign, &ctx);
+        }
+        mbedtls_ecdsa_free(&ctx);
+    }
+    static const struct {
+        uint8_t alg;
+        const char *name;
+    } algs[] = {
+        { 0x01, "calculate_oath_sha1" },
+        { 0x02, "calculate_oath_sha256" },
+        { 0x03, "calculate_oath_sha512" },
+    };
+    for (int i = 0; i < sizeof(algs) / sizeof(algs[0]); i++) {
+        bench_run(algs[i].name, b_calculate_oath, (void *) &algs[i].alg);
+    }
+    static const struct {
+        uint8_t alg;
+        const char *name;
+    } all_algs[] = {
+        { 0x01, "calculate_all_oath_sha1_32" },
+        { 0x02, "calculate_all_oath_sha256_32" },
+    };
+    for (int i = 0; i < sizeof(all_algs) / sizeof(all_algs[0]); i++) {
+        if (filter && strstr(all_algs[i].name, filter) == NULL) {
+            continue;
+        }
+        if (oath_fixture(all_algs[i].alg) != 0) {
+            fprintf(stderr, "Cannot store OATH credentials, skipping %s\n", all_algs[i].name);
+            continue;
+        }
+        bench_run(all_algs[i].name, b_calculate_all_oath, NULL);
+    }
+    oath_apdu(0x04, 0xde, 0xad, NULL, 0);
+    static const struct {
+        uint8_t pacing;
+        const char *name;
+    } pacings[] = {
+        { 0, "kbd_emit_yubico_otp" },
+        { 20, "kbd_emit_yubico_otp_pacing20" },
+    };
+    for (int i = 0; i < sizeof(pacings) / sizeof(pacings[0]); i++) {
+        bench_run(pacings[i].name, b_kbd_emit, (void *) &pacings[i].pacing);
+    }
+
+    if (output) {
+        FILE *fp = fopen(output, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Cannot write %s\n", output);
+            return 1;
+        }
+        write_json(fp);
+        fclose(fp);
+    }
+    else {
+        write_json(stdout);
+    }
+
+    int regressions = 0;
+    if (baseline) {
+        bench_result_t base[BENCH_MAX_RESULTS];
+        int n = load_baseline(baseline, base, BENCH_MAX_RESULTS);
+        if (n < 0) {
+            fprintf(stderr, "Cannot read baseline %s\n", baseline);
+            return 1;
+        }
+        for (int i = 0; i < num_results; i++) {
+            for (int j = 0; j < n; j++) {
+                if (strcmp(results[i].name, base[j].name) == 0 && base[j].ns_per_op > 0) {
+                    double delta = 100.0 * (results[i].ns_per_op - base[j].ns_per_op) / base[j].ns_per_op;
+                    if (delta > threshold) {
+                        fprintf(stderr, "REGRESSION %-32s %+.1f%% (%.0f -> %.0f ns/op)\n",
+                                results[i].name, delta, base[j].ns_per_op, results[i].ns_per_op);
+                        regressions++;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,566 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Self-tests of internals that the CTAP and CCID tests cannot observe, built on top
+ * of the emulation sources like the benchmarks. The SDK main() is replaced through
+ * -Wl,--wrap=main. They run against memory.flash in the working directory, which
+ * they leave formatted.
+ *
+ * Usage: pico_fido_selftest [-f filter]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fido.h"
+#include "hsm.h"
+#include "apdu.h"
+#include "dispatch.h"
+#include "files.h"
+#include "context.h"
+#include "txn.h"
+#include "wear.h"
+#include "idle.h"
+#include "mbedtls/md.h"
+#include "mbedtls/sha256.h"
+
+extern int oath_process_apdu();
+extern uint32_t oath_hmac_hits, oath_hmac_misses;
+extern void oath_index_reset();
+
+#define INS_PUT             0x01
+#define INS_DELETE          0x02
+#define INS_RESET           0x04
+#define INS_PUT_BATCH       0x06
+#define INS_CALCULATE       0xa2
+#define INS_CALC_ALL        0xa4
+#define INS_SEND_REMAINING  0xa5
+
+#define CHECK(c) do { \
+        if (!(c)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+            failures++; \
+        } \
+} while (0)
+
+static int failures = 0;
+static const char *filter = NULL;
+static uint8_t rdata[4096];
+
+static void selftest_run(const char *name, void (*fn)()) {
+    if (filter && strstr(name, filter) == NULL) {
+        return;
+    }
+    int before = failures;
+    fn();
+    fprintf(stderr, "%-32s %s\n", name, failures == before ? "ok" : "FAILED");
+}
+
+static uint16_t oath_apdu(uint8_t ins, uint8_t p1, uint8_t p2, const uint8_t *data, size_t len) {
+    static uint8_t header[4], buf[8192];
+    header[0] = 0x00;
+    header[1] = ins;
+    header[2] = p1;
+    header[3] = p2;
+    if (len > 0) {
+        memcpy(buf, data, len);
+    }
+    apdu.header = header;
+    apdu.data = buf;
+    apdu.nc = len;
+    apdu.ne = 0;
+    res_APDU = rdata;
+    res_APDU_size = 0;
+    oath_process_apdu();
+    return apdu.sw;
+}
+
+// CALCULATE_ALL, following SEND_REMAINING to the end
+static uint16_t oath_calculate_all(const uint8_t *chal, size_t chal_len) {
+    uint8_t data[2 + 64] = { 0x74, (uint8_t) chal_len };
+    memcpy(data + 2, chal, chal_len);
+    uint16_t sw = oath_apdu(INS_CALC_ALL, 0x00, 0x01, data, 2 + chal_len);
+    while ((sw & 0xff00) == 0x6100) {
+        sw = oath_apdu(INS_SEND_REMAINING, 0x00, 0x00, NULL, 0);
+    }
+    return sw;
+}
+
+#define OATH_CREDS          64
+
+static void oath_key(int i, uint8_t *key) {
+    for (int j = 0; j < 20; j++) {
+        key[j] = (uint8_t) (i * 31 + j);
+    }
+}
+
+// A fresh context starts with the PIN token key of the device, as the default one
+static void test_ctx_init() {
+    static fido_ctx_t ctx;
+    fido_ctx_init(&ctx);
+    CHECK(ctx.paut.data != NULL && ctx.paut.data == fido_ctx->paut.data);
+    CHECK(ctx.paut.len == 32 && ctx.paut.in_use == false);
+    CHECK(ctx.ga.counter == 1 && ctx.oath.validated == true);
+}
+
+/*
+ * A second CALCULATE_ALL over the same credentials finds every key state cached,
+ * allocates nothing and computes the same codes as a plain HMAC.
+ */
+static void test_oath_hmac_cache() {
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+    for (int i = 0; i < OATH_CREDS; i++) {
+        uint8_t data[5 + 4 + 20] = { 0x71, 3, 'c', '0' + i / 10, '0' + i % 10, 0x73, 2 + 20, 0x21, 6 };
+        oath_key(i, data + 9);
+        CHECK(oath_apdu(INS_PUT, 0x00, 0x00, data, sizeof(data)) == 0x9000);
+    }
+    uint8_t chal[8] = { 0, 0, 0, 0, 0x03, 0x5a, 0x1b, 0x2c };
+    uint32_t hits = oath_hmac_hits, misses = oath_hmac_misses;
+    CHECK(oath_calculate_all(chal, sizeof(chal)) == 0x9000);
+    CHECK(oath_hmac_misses - misses == OATH_CREDS);
+    CHECK(oath_hmac_hits - hits == 0);
+
+    chal[7]++; // Otherwise the TOTP codes of the first pass are returned
+    hits = oath_hmac_hits;
+    misses = oath_hmac_misses;
+#ifdef DISPATCH_WRAP_ALLOC
+    uint64_t allocs = dispatch_heap_allocs;
+#endif
+    CHECK(oath_calculate_all(chal, sizeof(chal)) == 0x9000);
+    CHECK(oath_hmac_hits - hits == OATH_CREDS);
+    CHECK(oath_hmac_misses - misses == 0);
+#ifdef DISPATCH_WRAP_ALLOC
+    CHECK(dispatch_heap_allocs == allocs);
+#endif
+
+    uint8_t data[5 + 10] = { 0x71, 3, 'c', '4', '2', 0x74, 8 }, key[20], hmac[20];
+    memcpy(data + 7, chal, sizeof(chal));
+    CHECK(oath_apdu(INS_CALCULATE, 0x00, 0x01, data, sizeof(data)) == 0x9000);
+    oath_key(42, key);
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), key, sizeof(key), chal, sizeof(chal), hmac);
+    uint8_t offset = hmac[19] & 0x0f;
+    uint8_t code[4] = { hmac[offset] & 0x7f, hmac[offset + 1], hmac[offset + 2], hmac[offset + 3] };
+    CHECK(res_APDU_size == 7 && res_APDU[1] == 5 && res_APDU[2] == 6 && memcmp(res_APDU + 3, code, 4) == 0);
+    CHECK(oath_hmac_hits - hits == OATH_CREDS + 1);
+
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+}
+
+// Repeating CALCULATE_ALL with the same challenge returns the codes of the first pass for every credential
+static void test_oath_totp_cache() {
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+    for (int i = 0; i < OATH_CREDS; i++) {
+        uint8_t data[5 + 4 + 20] = { 0x71, 3, 't', '0' + i / 10, '0' + i % 10, 0x73, 2 + 20, 0x21, 6 };
+        oath_key(i, data + 9);
+        CHECK(oath_apdu(INS_PUT, 0x00, 0x00, data, sizeof(data)) == 0x9000);
+    }
+    const uint8_t chal[8] = { 0, 0, 0, 0, 0x03, 0x5a, 0x1b, 0x2d };
+    CHECK(oath_calculate_all(chal, sizeof(chal)) == 0x9000);
+    uint32_t hits = oath_hmac_hits, misses = oath_hmac_misses;
+    CHECK(oath_calculate_all(chal, sizeof(chal)) == 0x9000);
+    CHECK(oath_hmac_hits == hits && oath_hmac_misses == misses);
+
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+}
+
+static void selftest_file(uint16_t fid, const uint8_t *data, uint16_t len) {
+    file_t *ef = dyn_file_new(fid);
+    CHECK(ef != NULL && flash_write_data_to_file(ef, data, len) == CCID_OK);
+    low_flash_available();
+}
+
+// HOTP code of a credential of oath_key(i) at counter v, as CALCULATE returns it
+static void oath_hotp(int i, uint8_t v, uint8_t *code) {
+    uint8_t key[20], imf[8] = { 0, 0, 0, 0, 0, 0, 0, v }, hmac[20];
+    oath_key(i, key);
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), key, sizeof(key), imf, sizeof(imf), hmac);
+    uint8_t offset = hmac[19] & 0x0f;
+    code[0] = hmac[offset] & 0x7f;
+    memcpy(code + 1, hmac + offset + 1, 3);
+}
+
+static bool oath_check_hotp(const char *name, int i, uint8_t v) {
+    uint8_t data[2 + 8 + 2] = { 0x71, 2, name[0], name[1], 0x74, 0 }, code[4];
+    if (oath_apdu(INS_CALCULATE, 0x00, 0x01, data, 6) != 0x9000) {
+        return false;
+    }
+    oath_hotp(i, v, code);
+    return res_APDU_size == 7 && memcmp(res_APDU + 3, code, 4) == 0;
+}
+
+/*
+ * Credentials in one file per slot and in the earlier pools of 4 move into the pools with
+ * their HOTP counters. A legacy record that cannot be rebuilt stays, and its slot is not reused.
+ */
+static void test_oath_migrate() {
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+    uint8_t tlv[4 + 4 + 20] = { 0x71, 2, 'l', '0', 0x73, 2 + 20, 0x11, 6 };
+    oath_key(0, tlv + 8);
+    selftest_file(EF_OATH_CRED + 0, tlv, sizeof(tlv));
+    const uint8_t imf[8] = { 0, 0, 0, 0, 0, 0, 0, 5 };
+    selftest_file(EF_OATH_IMF + 0, imf, sizeof(imf));
+    const uint8_t garbage[3] = { 0x71, 0x05, 'x' };
+    selftest_file(EF_OATH_CRED + 1, garbage, sizeof(garbage));
+
+    // Earlier pool 1 (slots 4 to 7) with a HOTP record in slot 5, counter 9
+    uint8_t pool[8 + 11 + 22 + 2] = { 0, 0, 0, 8 }, counters[4 * 8] = { 0 };
+    uint8_t *rec = pool + 8;
+    rec[0] = 2;
+    rec[1] = 22;
+    rec[10] = 3;
+    rec[11] = 0x11;
+    rec[12] = 6;
+    oath_key(5, rec + 13);
+    rec[11 + 22] = 'p';
+    rec[11 + 23] = '5';
+    counters[8 + 7] = 9;
+    selftest_file(EF_OATH_POOL4 + 1, pool, sizeof(pool));
+    selftest_file(EF_OATH_POOL4_IMF + 1, counters, sizeof(counters));
+
+    oath_index_reset();
+    CHECK(oath_check_hotp("l0", 0, 5));
+    CHECK(oath_check_hotp("l0", 0, 6));
+    // Reads do not retry the migration, which would drop the cached key states and reservations
+    uint32_t hits = oath_hmac_hits;
+    CHECK(oath_check_hotp("l0", 0, 7));
+    CHECK(oath_hmac_hits == hits + 1);
+    CHECK(oath_check_hotp("p5", 5, 9));
+    CHECK(dyn_file_search(EF_OATH_CRED + 0) == NULL && dyn_file_search(EF_OATH_IMF + 0) == NULL);
+    CHECK(dyn_file_search(EF_OATH_POOL4 + 1) == NULL && dyn_file_search(EF_OATH_POOL4_IMF + 1) == NULL);
+    CHECK(dyn_file_search(EF_OATH_CRED + 1) != NULL);
+
+    // Slot 1 stays reserved. Had a new credential taken it, the retried migration would drop the record
+    for (int i = 0; i < 2; i++) {
+        uint8_t data[4 + 4 + 20] = { 0x71, 2, 'n', '0' + i, 0x73, 2 + 20, 0x11, 6 };
+        oath_key(i, data + 8);
+        CHECK(oath_apdu(INS_PUT, 0x00, 0x00, data, sizeof(data)) == 0x9000);
+    }
+    oath_index_reset();
+    CHECK(oath_check_hotp("n0", 0, 0));
+    CHECK(oath_check_hotp("n1", 1, 0));
+    CHECK(dyn_file_search(EF_OATH_CRED + 1) != NULL);
+
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+    CHECK(dyn_file_search(EF_OATH_CRED + 1) == NULL);
+}
+
+/*
+ * HOTP codes follow each other while values are reserved in blocks. A power cycle, which
+ * drops the reservations, resumes at the first value not reserved.
+ */
+static void test_oath_hotp_reserve() {
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+    uint8_t data[4 + 4 + 20] = { 0x71, 2, 'h', '0', 0x73, 2 + 20, 0x11, 6 };
+    oath_key(0, data + 8);
+    CHECK(oath_apdu(INS_PUT, 0x00, 0x00, data, sizeof(data)) == 0x9000);
+    for (uint8_t v = 0; v < 10; v++) {
+        CHECK(oath_check_hotp("h0", 0, v));
+    }
+    // 0 was reserved alone, 1 to 8 and then 9 to 16 in blocks
+    oath_index_reset();
+    CHECK(oath_check_hotp("h0", 0, 17));
+    CHECK(oath_check_hotp("h0", 0, 18));
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+}
+
+// Whether CALCULATE of a TOTP credential of oath_key(i) returns the code of a plain HMAC
+static bool oath_check_totp(const uint8_t *name, uint8_t name_len, int i) {
+    uint8_t data[2 + 16 + 2 + 8] = { 0x71, name_len }, key[20], hmac[20];
+    const uint8_t chal[8] = { 0, 0, 0, 0, 0x03, 0x5a, 0x1b, 0x2e };
+    memcpy(data + 2, name, name_len);
+    data[2 + name_len] = 0x74;
+    data[3 + name_len] = sizeof(chal);
+    memcpy(data + 4 + name_len, chal, sizeof(chal));
+    if (oath_apdu(INS_CALCULATE, 0x00, 0x01, data, 4 + name_len + sizeof(chal)) != 0x9000) {
+        return false;
+    }
+    oath_key(i, key);
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), key, sizeof(key), chal, sizeof(chal), hmac);
+    uint8_t offset = hmac[19] & 0x0f;
+    uint8_t code[4] = { hmac[offset] & 0x7f, hmac[offset + 1], hmac[offset + 2], hmac[offset + 3] };
+    return res_APDU_size == 7 && memcmp(res_APDU + 3, code, 4) == 0;
+}
+
+// Appends a batch PUT record of a TOTP credential of oath_key(i)
+static size_t oath_batch_add(uint8_t *p, const uint8_t *name, uint8_t name_len, int i) {
+    uint8_t *q = p;
+    *q++ = 0x7d;
+    *q++ = 2 + name_len + 4 + 20;
+    *q++ = 0x71;
+    *q++ = name_len;
+    memcpy(q, name, name_len);
+    q += name_len;
+    *q++ = 0x73;
+    *q++ = 2 + 20;
+    *q++ = 0x21;
+    *q++ = 6;
+    oath_key(i, q);
+    return q + 20 - p;
+}
+
+#define OATH_BATCH          120
+#define OATH_BATCH_FIT      60
+
+/*
+ * A batch whose pools take more than the transaction staging buffer is refused and
+ * stores nothing. One that fits is stored whole, keeping the credentials of the
+ * pools it goes into.
+ */
+static void test_oath_put_batch() {
+    static uint8_t data[OATH_BATCH * 32];
+    uint8_t name[4];
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+    for (int i = 0; i < 3; i++) {
+        uint8_t put[4 + 4 + 20] = { 0x71, 2, 's', '0' + i, 0x73, 2 + 20, 0x21, 6 };
+        oath_key(200 + i, put + 8);
+        CHECK(oath_apdu(INS_PUT, 0x00, 0x00, put, sizeof(put)) == 0x9000);
+    }
+    const uint8_t del[4] = { 0x71, 2, 's', '1' };
+    CHECK(oath_apdu(INS_DELETE, 0x00, 0x00, del, sizeof(del)) == 0x9000);
+
+    size_t len = 0;
+    for (int i = 0; i < OATH_BATCH; i++) {
+        name[0] = 'b';
+        name[1] = '0' + i / 100;
+        name[2] = '0' + i / 10 % 10;
+        name[3] = '0' + i % 10;
+        len += oath_batch_add(data + len, name, sizeof(name), i);
+    }
+    CHECK(len > TXN_MAX_SIZE);
+    CHECK(oath_apdu(INS_PUT_BATCH, 0x00, 0x00, data, len) == 0x6700);
+    CHECK(oath_check_totp((const uint8_t *) "b000", 4, 0) == false);
+
+    len = 0;
+    for (int i = 0; i < OATH_BATCH_FIT; i++) {
+        name[1] = '0' + i / 100;
+        name[2] = '0' + i / 10 % 10;
+        name[3] = '0' + i % 10;
+        len += oath_batch_add(data + len, name, sizeof(name), i);
+    }
+    CHECK(oath_apdu(INS_PUT_BATCH, 0x00, 0x00, data, len) == 0x9000);
+    for (int i = 0; i < OATH_BATCH_FIT; i++) {
+        name[1] = '0' + i / 100;
+        name[2] = '0' + i / 10 % 10;
+        name[3] = '0' + i % 10;
+        CHECK(oath_check_totp(name, sizeof(name), i));
+    }
+    CHECK(oath_check_totp((const uint8_t *) "s0", 2, 200));
+    CHECK(oath_check_totp((const uint8_t *) "s2", 2, 202));
+
+    // Into the same pools again: one credential replaced, one added
+    len = oath_batch_add(data, (const uint8_t *) "b005", 4, 300);
+    len += oath_batch_add(data + len, (const uint8_t *) "c0", 2, 301);
+    CHECK(oath_apdu(INS_PUT_BATCH, 0x00, 0x00, data, len) == 0x9000);
+    CHECK(oath_check_totp((const uint8_t *) "b005", 4, 300));
+    CHECK(oath_check_totp((const uint8_t *) "c0", 2, 301));
+    CHECK(oath_check_totp((const uint8_t *) "b004", 4, 4));
+    CHECK(oath_check_totp((const uint8_t *) "s2", 2, 202));
+
+    CHECK(oath_apdu(INS_RESET, 0xde, 0xad, NULL, 0) == 0x9000);
+}
+
+#define TXN_FID_A           0x7f00
+#define TXN_FID_B           0x7f01
+#define TXN_FID_FILL        0x7000  // Files filling the dynamic file table
+
+static bool txn_file_is(uint16_t fid, const uint8_t *data, size_t len) {
+    file_t *ef = dyn_file_search(fid);
+    return file_has_data(ef) && file_get_size(ef) == len && memcmp(file_get_data(ef), data, len) == 0;
+}
+
+// Journal of a write of A and a delete of B, as a commit stores it
+static void txn_journal_build(uint8_t *j, size_t *len) {
+    const uint8_t rec[] = { TXN_FID_A >> 8, TXN_FID_A & 0xff, 0, 3, 'n', 'e', 'w',
+                            TXN_FID_B >> 8, TXN_FID_B & 0xff, 0xff, 0xff };
+    uint8_t digest[32];
+    memcpy(j, rec, sizeof(rec));
+    mbedtls_sha256(rec, sizeof(rec), digest, 0);
+    memcpy(j + sizeof(rec), digest, TXN_DIGEST_SIZE);
+    *len = sizeof(rec) + TXN_DIGEST_SIZE;
+}
+
+static void txn_cleanup() {
+    txn_delete(dyn_file_search(TXN_FID_A));
+    txn_delete(dyn_file_search(TXN_FID_B));
+    CHECK(dyn_file_search(EF_TXN) == NULL);
+}
+
+// A complete journal left at boot is replayed, and dropped by the next write
+static void test_txn_replay() {
+    uint8_t j[32];
+    size_t len = 0;
+    selftest_file(TXN_FID_A, (const uint8_t *) "old", 3);
+    selftest_file(TXN_FID_B, (const uint8_t *) "old", 3);
+    txn_journal_build(j, &len);
+    selftest_file(EF_TXN, j, len);
+    txn_recover();
+    CHECK(txn_file_is(TXN_FID_A, (const uint8_t *) "new", 3));
+    CHECK(dyn_file_search(TXN_FID_B) == NULL);
+    CHECK(txn_write_fid(TXN_FID_B, (const uint8_t *) "b", 1) == CCID_OK);
+    CHECK(dyn_file_search(EF_TXN) == NULL);
+    txn_cleanup();
+}
+
+/*
+ * Idle work waits for a quiet period with no transaction open. It then drops a journal
+ * replayed at boot and saves the pending wear counters, a step at a time, until none is left.
+ */
+static void test_idle() {
+    uint8_t j[32];
+    size_t len = 0;
+    selftest_file(TXN_FID_A, (const uint8_t *) "old", 3);
+    selftest_file(TXN_FID_B, (const uint8_t *) "old", 3);
+    txn_journal_build(j, &len);
+    selftest_file(EF_TXN, j, len);
+    txn_recover();
+
+    uint64_t t0 = dispatch_time_us();
+    idle_activity(t0);
+    CHECK(idle_run(t0 + IDLE_QUIET_US - 1) == true);
+    CHECK(dyn_file_search(EF_TXN) != NULL);
+    txn_begin();
+    CHECK(idle_run(t0 + IDLE_QUIET_US) == true);
+    CHECK(dyn_file_search(EF_TXN) != NULL);
+    txn_abort();
+    for (int i = 0; i < 8 && idle_run(t0 + IDLE_QUIET_US) == true; i++) {
+        ;
+    }
+    CHECK(idle_run(t0 + IDLE_QUIET_US) == false);
+    CHECK(dyn_file_search(EF_TXN) == NULL);
+    file_t *ef = dyn_file_search(EF_WEAR);
+    CHECK(file_has_data(ef) && file_get_size(ef) == WEAR_CLASSES * sizeof(wear_stats_t) &&
+          memcmp(file_get_data(ef), wear_stats(0), file_get_size(ef)) == 0);
+    txn_cleanup();
+}
+
+// A journal whose digest does not match was cut short before its commit applied anything
+static void test_txn_torn() {
+    uint8_t j[32];
+    size_t len = 0;
+    selftest_file(TXN_FID_A, (const uint8_t *) "old", 3);
+    selftest_file(TXN_FID_B, (const uint8_t *) "old", 3);
+    txn_journal_build(j, &len);
+    j[len - 1] ^= 0x01;
+    selftest_file(EF_TXN, j, len);
+    txn_recover();
+    CHECK(dyn_file_search(EF_TXN) == NULL);
+    CHECK(txn_file_is(TXN_FID_A, (const uint8_t *) "old", 3));
+    CHECK(txn_file_is(TXN_FID_B, (const uint8_t *) "old", 3));
+    // Nor is it applied later
+    CHECK(txn_write_fid(TXN_FID_A, (const uint8_t *) "a", 1) == CCID_OK);
+    CHECK(txn_file_is(TXN_FID_B, (const uint8_t *) "old", 3));
+    txn_cleanup();
+}
+
+/*
+ * credential_store() opens a transaction inside the one of makeCredential and aborts
+ * it when no RP slot is left. The outer one stays open, so its later writes are still
+ * staged, and its commit fails: nothing staged by either reaches flash. The inner
+ * commit of a successful store leaves the writes to the outer one.
+ */
+static void test_txn_nested() {
+    txn_begin();
+    txn_begin();
+    txn_write_fid(TXN_FID_B, (const uint8_t *) "b", 1);
+    txn_abort();
+    CHECK(txn_active() == true);
+    CHECK(txn_write_fid(TXN_FID_A, (const uint8_t *) "a", 1) == CCID_OK);
+    CHECK(dyn_file_search(TXN_FID_A) == NULL);
+    CHECK(txn_commit() != CCID_OK);
+    CHECK(txn_active() == false);
+    CHECK(dyn_file_search(TXN_FID_A) == NULL && dyn_file_search(TXN_FID_B) == NULL);
+    txn_abort();
+    CHECK(txn_active() == false);
+
+    txn_begin();
+    txn_write_fid(TXN_FID_A, (const uint8_t *) "a", 1);
+    txn_begin();
+    txn_write_fid(TXN_FID_B, (const uint8_t *) "b", 1);
+    CHECK(txn_commit() == CCID_OK);
+    CHECK(dyn_file_search(TXN_FID_B) == NULL);
+    CHECK(txn_commit() == CCID_OK);
+    CHECK(txn_file_is(TXN_FID_A, (const uint8_t *) "a", 1));
+    CHECK(txn_file_is(TXN_FID_B, (const uint8_t *) "b", 1));
+    txn_cleanup();
+}
+
+/*
+ * A commit whose records cannot all be applied, here for lack of room in the file table,
+ * keeps its journal. The next write applies it once there is room, then drops it.
+ */
+static void test_txn_retain() {
+    int n = 0;
+    while (n < 1024 && dyn_file_new(TXN_FID_FILL + n) != NULL) {
+        n++;
+    }
+    CHECK(n > 0 && n < 1024);
+    dyn_file_delete(dyn_file_search(TXN_FID_FILL + --n)); // Room for the journal only
+
+    txn_begin();
+    txn_write_fid(TXN_FID_A, (const uint8_t *) "a", 1);
+    txn_write_fid(TXN_FID_B, (const uint8_t *) "b", 1);
+    CHECK(txn_commit() != CCID_OK);
+    CHECK(dyn_file_search(EF_TXN) != NULL);
+    CHECK(dyn_file_search(TXN_FID_A) == NULL);
+    // A button press would have to settle it, so it is skipped
+    CHECK(txn_try_lock() == false);
+
+    for (int i = 0; i < 2 && n > 0; i++) {
+        dyn_file_delete(dyn_file_search(TXN_FID_FILL + --n));
+    }
+    CHECK(txn_write_fid(TXN_FID_FILL + n, (const uint8_t *) "c", 1) == CCID_OK);
+    CHECK(dyn_file_search(EF_TXN) == NULL);
+    CHECK(txn_file_is(TXN_FID_A, (const uint8_t *) "a", 1));
+    CHECK(txn_file_is(TXN_FID_B, (const uint8_t *) "b", 1));
+    CHECK(txn_try_lock() == true);
+    txn_unlock();
+
+    for (int i = 0; i <= n; i++) {
+        dyn_file_delete(dyn_file_search(TXN_FID_FILL + i));
+    }
+    low_flash_available();
+    txn_cleanup();
+}
+
+int __wrap_main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-f filter]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    init_fido();
+
+    selftest_run("oath_hmac_cache", test_oath_hmac_cache);
+    selftest_run("oath_totp_cache", test_oath_totp_cache);
+    selftest_run("oath_migrate", test_oath_migrate);
+    selftest_run("oath_hotp_reserve", test_oath_hotp_reserve);
+    selftest_run("oath_put_batch", test_oath_put_batch);
+    selftest_run("txn_replay", test_txn_replay);
+    selftest_run("txn_torn", test_txn_torn);
+    selftest_run("txn_nested", test_txn_nested);
+    selftest_run("txn_retain", test_txn_retain);
+    selftest_run("idle", test_idle);
+    selftest_run("ctx_init", test_ctx_init);
+
+    return failures > 0 ? 1 : 0;
+}
@@ -23,6 +23,9 @@
 #include "fido.h"
 #include "usb.h"
 #include "apdu.h"
+#include "dispatch.h"
+#include "trace.h"
+#include "idle.h"
 
 const bool _btrue = true, _bfalse = false;
 
@@ -45,6 +48,56 @@ const uint8_t *cbor_data = NULL;
 size_t cbor_len = 0;
 uint8_t cmd = 0;
 
+static int cbor_get_info_cmd(const uint8_t *data, size_t len) {
+    return cbor_get_info();
+}
+
+static int cbor_reset_cmd(const uint8_t *data, size_t len) {
+    return cbor_reset();
+}
+
+static int cbor_get_assertion_cmd(const uint8_t *data, size_t len) {
+    return cbor_get_assertion(data, len, false);
+}
+
+static int cbor_selection_cmd(const uint8_t *data, size_t len) {
+    return cbor_selection();
+}
+
+static const cbor_cmd_t cbor_cmds[] = {
+    { CTAP_MAKE_CREDENTIAL, cbor_make_credential },
+    { CTAP_GET_ASSERTION, cbor_get_assertion_cmd },
+    { CTAP_GET_INFO, cbor_get_info_cmd },
+    { CTAP_CLIENT_PIN, cbor_client_pin },
+    { CTAP_RESET, cbor_reset_cmd },
+    { CTAP_GET_NEXT_ASSERTION, cbor_get_next_assertion },
+    { CTAP_CREDENTIAL_MGMT, cbor_cred_mgmt },
+    { 0x41, cbor_cred_mgmt }, // Backwards compatibility
+    { CTAP_SELECTION, cbor_selection_cmd },
+    { CTAP_LARGE_BLOBS, cbor_large_blobs },
+    { CTAP_CONFIG, cbor_config },
+    { 0x00, 0x0 }
+};
+DISPATCH_CHECK_CMDS(cbor_cmds);
+
+static dispatch_table_t cbor_table = { .id = DISPATCH_TABLE_CTAP2, .ok = CTAP2_OK, .cbor_cmds = cbor_cmds };
+
+static const cbor_cmd_t cbor_vendor_cmds[] = {
+    { CTAP_VENDOR_BACKUP, cbor_vendor },
+    { CTAP_VENDOR_MSE, cbor_vendor },
+    { CTAP_VENDOR_UNLOCK, cbor_vendor },
+    { CTAP_VENDOR_EA, cbor_vendor },
+    { CTAP_VENDOR_STATS, cbor_vendor },
+#if ENABLE_CBOR_TRACE
+    { CTAP_VENDOR_TRACE, cbor_vendor },
+#endif
+    { CTAP_VENDOR_WEAR, cbor_vendor },
+    { 0x00, 0x0 }
+};
+DISPATCH_CHECK_CMDS(cbor_vendor_cmds);
+
+static dispatch_table_t cbor_vendor_table = { .id = DISPATCH_TABLE_VENDOR, .ok = CTAP2_OK, .cbor_cmds = cbor_vendor_cmds };
+
 int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
     if (len == 0 && cmd == CTAPHID_CBOR) {
         return CTAP1_ERR_INVALID_LEN;
@@ -53,42 +106,25 @@ int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
         DEBUG_DATA(data + 1, len - 1);
     }
     driver_prepare_response_hid();
+    int ret = DISPATCH_NOT_FOUND;
     if (cmd == CTAPHID_CBOR) {
-        if (data[0] == CTAP_MAKE_CREDENTIAL) {
-            return cbor_make_credential(data + 1, len - 1);
-        }
-        if (data[0] == CTAP_GET_INFO) {
-            return cbor_get_info();
-        }
-        else if (data[0] == CTAP_RESET) {
-            return cbor_reset();
-        }
-        else if (data[0] == CTAP_CLIENT_PIN) {
-            return cbor_client_pin(data + 1, len - 1);
-        }
-        else if (data[0] == CTAP_GET_ASSERTION) {
-            return cbor_get_assertion(data + 1, len - 1, false);
-        }
-        else if (data[0] == CTAP_GET_NEXT_ASSERTION) {
-            return cbor_get_next_assertion(data + 1, len - 1);
-        }
-        else if (data[0] == CTAP_SELECTION) {
-            return cbor_selection();
-        }
-        else if (data[0] == CTAP_CREDENTIAL_MGMT || data[0] == 0x41) {
-            return cbor_cred_mgmt(data + 1, len - 1);
-        }
-        else if (data[0] == CTAP_CONFIG) {
-            return cbor_config(data + 1, len - 1);
+        ret = dispatch_cbor(&cbor_table, data[0], data + 1, len - 1);
+    }
+    else if (cmd == CTAP_VENDOR_CBOR) {
+        if (len > 0) {
+            ret = dispatch_cbor(&cbor_vendor_table, data[0], data, len);
         }
-        else if (data[0] == CTAP_LARGE_BLOBS) {
-            return cbor_large_blobs(data + 1, len - 1);
+        if (ret == DISPATCH_NOT_FOUND) {
+            ret = cbor_vendor(data, len);
         }
     }
-    else if (cmd == CTAP_VENDOR_CBOR) {
-        return cbor_vendor(data, len);
+    if (ret == DISPATCH_NOT_FOUND) {
+        ret = CTAP1_ERR_INVALID_CMD;
     }
-    return CTAP1_ERR_INVALID_CMD;
+#if ENABLE_CBOR_TRACE && defined(ENABLE_EMULATION)
+    trace_flush();
+#endif
+    return ret;
 }
 
 #ifndef ENABLE_EMULATION
@@ -97,7 +133,14 @@ void cbor_thread() {
     card_init_core1();
     while (1) {
         uint32_t m;
-        queue_remove_blocking(&usb_to_card_q, &m);
+        // Deferred flash work runs a step at a time while no command is queued
+        while (queue_try_remove(&usb_to_card_q, &m) == false) {
+            if (idle_run(dispatch_time_us()) == false) {
+                queue_remove_blocking(&usb_to_card_q, &m);
+                break;
+            }
+            sleep_us(IDLE_POLL_US);
+        }
 
         if (m == EV_EXIT) {
 
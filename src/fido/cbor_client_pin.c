@@ -28,84 +28,84 @@
 #endif
 #include "hid/ctap_hid.h"
 #include "fido.h"
+#include "context.h"
 #include "files.h"
 #include "random.h"
 #include "crypto_utils.h"
 #include "hsm.h"
+#include "txn.h"
 #include "apdu.h"
 
 uint32_t usage_timer = 0, initial_usage_time_limit = 0;
 uint32_t max_usage_time_period  = 600 * 1000;
 bool needs_power_cycle = false;
-static mbedtls_ecdh_context hkey;
-static bool hkey_init = false;
 
 int beginUsingPinUvAuthToken(bool userIsPresent) {
-    paut.user_present = userIsPresent;
-    paut.user_verified = true;
+    fido_ctx->paut.user_present = userIsPresent;
+    fido_ctx->paut.user_verified = true;
     initial_usage_time_limit = board_millis();
     usage_timer = board_millis();
-    paut.in_use = true;
+    fido_ctx->paut.in_use = true;
     return 0;
 }
 
 void clearUserPresentFlag() {
-    if (paut.in_use == true) {
-        paut.user_present = false;
+    if (fido_ctx->paut.in_use == true) {
+        fido_ctx->paut.user_present = false;
     }
 }
 
 void clearUserVerifiedFlag() {
-    if (paut.in_use == true) {
-        paut.user_verified = false;
+    if (fido_ctx->paut.in_use == true) {
+        fido_ctx->paut.user_verified = false;
     }
 }
 
 void clearPinUvAuthTokenPermissionsExceptLbw() {
-    if (paut.in_use == true) {
-        paut.permissions = CTAP_PERMISSION_LBW;
+    if (fido_ctx->paut.in_use == true) {
+        fido_ctx->paut.permissions = CTAP_PERMISSION_LBW;
     }
 }
 
 void stopUsingPinUvAuthToken() {
-    paut.permissions = 0;
+    fido_ctx->paut.permissions = 0;
     usage_timer = 0;
-    paut.in_use = false;
-    memset(paut.rp_id_hash, 0, sizeof(paut.rp_id_hash));
-    paut.has_rp_id = false;
+    fido_ctx->paut.in_use = false;
+    memset(fido_ctx->paut.rp_id_hash, 0, sizeof(fido_ctx->paut.rp_id_hash));
+    fido_ctx->paut.has_rp_id = false;
     initial_usage_time_limit = 0;
-    paut.user_present = paut.user_verified = false;
+    fido_ctx->paut.user_present = fido_ctx->paut.user_verified = false;
     user_present_time_limit = 0;
 }
 
 bool getUserPresentFlagValue() {
-    if (paut.in_use != true) {
-        paut.user_present = false;
+    if (fido_ctx->paut.in_use != true) {
+        fido_ctx->paut.user_present = false;
     }
-    return paut.user_present;
+    return fido_ctx->paut.user_present;
 }
 
 bool getUserVerifiedFlagValue() {
-    if (paut.in_use != true) {
-        paut.user_verified = false;
+    if (fido_ctx->paut.in_use != true) {
+        fido_ctx->paut.user_verified = false;
     }
-    return paut.user_verified;
+    return fido_ctx->paut.user_verified;
 }
 
 int regenerate() {
-    if (hkey_init == true) {
-        mbedtls_ecdh_free(&hkey);
+    if (fido_ctx->cp.hkey_init == true) {
+        mbedtls_ecdh_free(&fido_ctx->cp.hkey);
     }
 
-    mbedtls_ecdh_init(&hkey);
-    hkey_init = true;
-    mbedtls_ecdh_setup(&hkey, MBEDTLS_ECP_DP_SECP256R1);
-    int ret = mbedtls_ecdh_gen_public(&hkey.ctx.mbed_ecdh.grp,
-                                      &hkey.ctx.mbed_ecdh.d,
-                                      &hkey.ctx.mbed_ecdh.Q,
+    mbedtls_ecdh_init(&fido_ctx->cp.hkey);
+    fido_ctx->cp.hkey_init = true;
+    mbedtls_ecdh_setup(&fido_ctx->cp.hkey, MBEDTLS_ECP_DP_SECP256R1);
+    int ret = mbedtls_ecdh_gen_public(&fido_ctx->cp.hkey.ctx.mbed_ecdh.grp,
+                                      &fido_ctx->cp.hkey.ctx.mbed_ecdh.d,
+                                      &fido_ctx->cp.hkey.ctx.mbed_ecdh.Q,
                                       random_gen,
                                       NULL);
-    mbedtls_mpi_lset(&hkey.ctx.mbed_ecdh.Qp.Z, 1);
+    mbedtls_mpi_lset(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp.Z, 1);
     if (ret != 0) {
         return ret;
     }
@@ -155,10 +155,10 @@ int kdf(uint8_t protocol, const mbedtls_mpi *z, uint8_t *sharedSecret) {
 int ecdh(uint8_t protocol, const mbedtls_ecp_point *Q, uint8_t *sharedSecret) {
     mbedtls_mpi z;
     mbedtls_mpi_init(&z);
-    int ret = mbedtls_ecdh_compute_shared(&hkey.ctx.mbed_ecdh.grp,
+    int ret = mbedtls_ecdh_compute_shared(&fido_ctx->cp.hkey.ctx.mbed_ecdh.grp,
                                           &z,
                                           Q,
-                                          &hkey.ctx.mbed_ecdh.d,
+                                          &fido_ctx->cp.hkey.ctx.mbed_ecdh.d,
                                           random_gen,
                                           NULL);
     ret = kdf(protocol, &z, sharedSecret);
@@ -169,10 +169,10 @@ int ecdh(uint8_t protocol, const mbedtls_ecp_point *Q, uint8_t *sharedSecret) {
 int resetPinUvAuthToken() {
     uint8_t t[32];
     random_gen(NULL, t, sizeof(t));
-    flash_write_data_to_file(ef_authtoken, t, sizeof(t));
-    paut.permissions = 0;
-    paut.data = file_get_data(ef_authtoken);
-    paut.len = file_get_size(ef_authtoken);
+    txn_write(ef_authtoken, t, sizeof(t));
+    fido_ctx->paut.permissions = 0;
+    fido_ctx->paut.data = file_get_data(ef_authtoken);
+    fido_ctx->paut.len = file_get_size(ef_authtoken);
 
     low_flash_available();
     return 0;
@@ -230,7 +230,7 @@ int authenticate(uint8_t protocol,
 
 int verify(uint8_t protocol, const uint8_t *key, const uint8_t *data, size_t len, uint8_t *sign) {
     uint8_t hmac[32];
-    //if (paut.in_use == false)
+    //if (fido_ctx->paut.in_use == false)
     //    return -2;
     int ret =
         mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, 32, data, len, hmac);
@@ -264,7 +264,7 @@ int pinUvAuthTokenUsageTimerObserver() {
             user_present_time_limit + TRANSPORT_TIME_LIMIT < board_millis()) {
             clearUserPresentFlag();
         }
-        if (paut.in_use == true) {
+        if (fido_ctx->paut.in_use == true) {
             if (initial_usage_time_limit == 0 ||
                 initial_usage_time_limit + TRANSPORT_TIME_LIMIT < board_millis()) {
                 stopUsingPinUvAuthToken();
@@ -291,7 +291,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
     CborCharString rpId = { 0 };
     CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
     uint64_t val_c = 1;
-    if (hkey_init == false) {
+    if (fido_ctx->cp.hkey_init == false) {
         initialize();
     }
     CBOR_PARSE_MAP_START(map, 1)
@@ -383,10 +383,10 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             CBOR_CHECK(cbor_encode_uint(&mapEncoder2, FIDO2_CURVE_P256));
             CBOR_CHECK(cbor_encode_negative_int(&mapEncoder2, 2));
             uint8_t pkey[32];
-            mbedtls_mpi_write_binary(&hkey.ctx.mbed_ecdh.Q.X, pkey, 32);
+            mbedtls_mpi_write_binary(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Q.X, pkey, 32);
             CBOR_CHECK(cbor_encode_byte_string(&mapEncoder2, pkey, 32));
             CBOR_CHECK(cbor_encode_negative_int(&mapEncoder2, 3));
-            mbedtls_mpi_write_binary(&hkey.ctx.mbed_ecdh.Q.Y, pkey, 32);
+            mbedtls_mpi_write_binary(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Q.Y, pkey, 32);
             CBOR_CHECK(cbor_encode_byte_string(&mapEncoder2, pkey, 32));
             CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
         }
@@ -412,14 +412,14 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             (pinUvAuthProtocol == 2 && newPinEnc.len != 64 + IV_SIZE)) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
+        if (mbedtls_mpi_read_binary(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
+        if (mbedtls_mpi_read_binary(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh(pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh(pinUvAuthProtocol, &fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
@@ -443,7 +443,6 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             pin_len++;
         }
         uint8_t minPin = 4;
-        file_t *ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
         if (file_has_data(ef_minpin)) {
             minPin = *file_get_data(ef_minpin);
         }
@@ -454,7 +453,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         hsh[0] = MAX_PIN_RETRIES;
         hsh[1] = pin_len;
         mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), paddedNewPin, pin_len, hsh + 2);
-        flash_write_data_to_file(ef_pin, hsh, 2 + 16);
+        txn_write(ef_pin, hsh, 2 + 16);
         low_flash_available();
         goto err; //No return
     }
@@ -478,14 +477,14 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
              (newPinEnc.len != 64 + IV_SIZE || pinHashEnc.len != 16 + IV_SIZE))) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
+        if (mbedtls_mpi_read_binary(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
+        if (mbedtls_mpi_read_binary(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh(pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh(pinUvAuthProtocol, &fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
@@ -501,7 +500,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         uint8_t pin_data[18];
         memcpy(pin_data, file_get_data(ef_pin), 18);
         pin_data[0] -= 1;
-        flash_write_data_to_file(ef_pin, pin_data, sizeof(pin_data));
+        txn_write(ef_pin, pin_data, sizeof(pin_data));
         low_flash_available();
         uint8_t retries = pin_data[0];
         uint8_t paddedNewPin[64];
@@ -526,7 +525,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             }
         }
         pin_data[0] = MAX_PIN_RETRIES;
-        flash_write_data_to_file(ef_pin, pin_data, sizeof(pin_data));
+        txn_write(ef_pin, pin_data, sizeof(pin_data));
         low_flash_available();
         new_pin_mismatches = 0;
         ret = decrypt(pinUvAuthProtocol, sharedSecret, newPinEnc.data, newPinEnc.len, paddedNewPin);
@@ -542,7 +541,6 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             pin_len++;
         }
         uint8_t minPin = 4;
-        file_t *ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
         if (file_has_data(ef_minpin)) {
             minPin = *file_get_data(ef_minpin);
         }
@@ -557,15 +555,18 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             memcmp(hsh + 2, file_get_data(ef_pin) + 2, 16) == 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_POLICY_VIOLATION);
         }
-        flash_write_data_to_file(ef_pin, hsh, 2 + 16);
+        txn_begin();
+        txn_write(ef_pin, hsh, 2 + 16);
         if (file_has_data(ef_minpin) && file_get_data(ef_minpin)[1] == 1) {
             uint8_t *tmp = (uint8_t *) calloc(1, file_get_size(ef_minpin));
             memcpy(tmp, file_get_data(ef_minpin), file_get_size(ef_minpin));
             tmp[1] = 0;
-            flash_write_data_to_file(ef_minpin, tmp, file_get_size(ef_minpin));
+            txn_write(ef_minpin, tmp, file_get_size(ef_minpin));
             free(tmp);
         }
-        low_flash_available();
+        if (txn_commit() != CCID_OK) {
+            CBOR_ERROR(CTAP1_ERR_OTHER);
+        }
         resetPinUvAuthToken();
         goto err; // No return
     }
@@ -595,14 +596,14 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         if (*file_get_data(ef_pin) == 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_BLOCKED);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
+        if (mbedtls_mpi_read_binary(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
+        if (mbedtls_mpi_read_binary(&fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp.Y, kay.data, kay.len) != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh(pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh(pinUvAuthProtocol, &fido_ctx->cp.hkey.ctx.mbed_ecdh.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
@@ -610,7 +611,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         uint8_t pin_data[18];
         memcpy(pin_data, file_get_data(ef_pin), 18);
         pin_data[0] -= 1;
-        flash_write_data_to_file(ef_pin, pin_data, sizeof(pin_data));
+        txn_write(ef_pin, pin_data, sizeof(pin_data));
         low_flash_available();
         uint8_t retries = pin_data[0];
         uint8_t paddedNewPin[64], poff = (pinUvAuthProtocol - 1) * IV_SIZE;
@@ -636,9 +637,8 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         }
         pin_data[0] = MAX_PIN_RETRIES;
         new_pin_mismatches = 0;
-        flash_write_data_to_file(ef_pin, pin_data, sizeof(pin_data));
+        txn_write(ef_pin, pin_data, sizeof(pin_data));
         low_flash_available();
-        file_t *ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
         if (file_has_data(ef_minpin) && file_get_data(ef_minpin)[1] == 1) {
             CBOR_ERROR(CTAP2_ERR_PIN_INVALID);
         }
@@ -647,16 +647,16 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         if (subcommand == 0x05) {
             permissions = CTAP_PERMISSION_MC | CTAP_PERMISSION_GA;
         }
-        paut.permissions = permissions;
+        fido_ctx->paut.permissions = permissions;
         if (rpId.present == true) {
-            mbedtls_sha256((uint8_t *) rpId.data, rpId.len, paut.rp_id_hash, 0);
-            paut.has_rp_id = true;
+            mbedtls_sha256((uint8_t *) rpId.data, rpId.len, fido_ctx->paut.rp_id_hash, 0);
+            fido_ctx->paut.has_rp_id = true;
         }
         else {
-            paut.has_rp_id = false;
+            fido_ctx->paut.has_rp_id = false;
         }
         uint8_t pinUvAuthToken_enc[32 + IV_SIZE];
-        encrypt(pinUvAuthProtocol, sharedSecret, paut.data, 32, pinUvAuthToken_enc);
+        encrypt(pinUvAuthProtocol, sharedSecret, fido_ctx->paut.data, 32, pinUvAuthToken_enc);
         CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
         CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, pinUvAuthToken_enc, 32 + poff));
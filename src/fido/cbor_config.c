@@ -17,9 +17,11 @@
 
 #include "ctap2_cbor.h"
 #include "fido.h"
+#include "context.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
 #include "files.h"
+#include "txn.h"
 #include "apdu.h"
 #include "credential.h"
 #include "hsm.h"
@@ -28,9 +30,6 @@
 #include "mbedtls/chachapoly.h"
 #include "mbedtls/sha256.h"
 
-extern uint8_t keydev_dec[32];
-extern bool has_keydev_dec;
-
 int cbor_config(const uint8_t *data, size_t len) {
     CborParser parser;
     CborValue map;
@@ -121,7 +120,7 @@ int cbor_config(const uint8_t *data, size_t len) {
     verify_payload[33] = subcommand;
     memcpy(verify_payload + 34, raw_subpara, raw_subpara_len);
     error = verify(pinUvAuthProtocol,
-                   paut.data,
+                   fido_ctx->paut.data,
                    verify_payload,
                    32 + 1 + 1 + raw_subpara_len,
                    pinUvAuthParam.data);
@@ -130,7 +129,7 @@ int cbor_config(const uint8_t *data, size_t len) {
         CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
     }
 
-    if (!(paut.permissions & CTAP_PERMISSION_ACFG)) {
+    if (!(fido_ctx->paut.permissions & CTAP_PERMISSION_ACFG)) {
         CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
     }
 
@@ -139,19 +138,19 @@ int cbor_config(const uint8_t *data, size_t len) {
             if (!file_has_data(ef_keydev_enc)) {
                 CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
-            if (has_keydev_dec == false) {
+            if (fido_ctx->has_keydev_dec == false) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
-            flash_write_data_to_file(ef_keydev, keydev_dec, sizeof(keydev_dec));
-            mbedtls_platform_zeroize(keydev_dec, sizeof(keydev_dec));
-            flash_write_data_to_file(ef_keydev_enc, NULL, 0); // Set ef to 0 bytes
+            txn_write(ef_keydev, fido_ctx->keydev_dec, sizeof(fido_ctx->keydev_dec));
+            mbedtls_platform_zeroize(fido_ctx->keydev_dec, sizeof(fido_ctx->keydev_dec));
+            txn_write(ef_keydev_enc, NULL, 0); // Set ef to 0 bytes
             low_flash_available();
         }
         else if (vendorCommandId == CTAP_CONFIG_AUT_ENABLE) {
             if (!file_has_data(ef_keydev)) {
                 CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
-            if (mse.init == false) {
+            if (fido_ctx->mse.init == false) {
                 CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
 
@@ -178,10 +177,10 @@ int cbor_config(const uint8_t *data, size_t len) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
 
-            flash_write_data_to_file(ef_keydev_enc, key_dev_enc, sizeof(key_dev_enc));
+            txn_write(ef_keydev_enc, key_dev_enc, sizeof(key_dev_enc));
             mbedtls_platform_zeroize(key_dev_enc, sizeof(key_dev_enc));
-            flash_write_data_to_file(ef_keydev, key_dev_enc, file_get_size(ef_keydev)); // Overwrite ef with 0
-            flash_write_data_to_file(ef_keydev, NULL, 0); // Set ef to 0 bytes
+            txn_write(ef_keydev, key_dev_enc, file_get_size(ef_keydev)); // Overwrite ef with 0
+            txn_write(ef_keydev, NULL, 0); // Set ef to 0 bytes
             low_flash_available();
         }
         else {
@@ -191,7 +190,6 @@ int cbor_config(const uint8_t *data, size_t len) {
     }
     else if (subcommand == 0x03) {
         uint8_t currentMinPinLen = 4;
-        file_t *ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
         if (file_has_data(ef_minpin)) {
             currentMinPinLen = *file_get_data(ef_minpin);
         }
@@ -216,7 +214,7 @@ int cbor_config(const uint8_t *data, size_t len) {
                            data + 2 + m * 32,
                            0);
         }
-        flash_write_data_to_file(ef_minpin, data, 2 + minPinLengthRPIDs_len * 32);
+        txn_write(ef_minpin, data, 2 + minPinLengthRPIDs_len * 32);
         low_flash_available();
         goto err; //No return
     }
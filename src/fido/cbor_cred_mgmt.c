@@ -16,6 +16,7 @@
  */
 
 #include "fido.h"
+#include "context.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
 #include "cbor_make_credential.h"
@@ -23,12 +24,7 @@
 #include "apdu.h"
 #include "credential.h"
 #include "hsm.h"
-
-uint8_t rp_counter = 1;
-uint8_t rp_total = 0;
-uint8_t cred_counter = 1;
-uint8_t cred_total = 0;
-CborByteString rpIdHashx = { 0 };
+#include "txn.h"
 
 int cbor_cred_mgmt(const uint8_t *data, size_t len) {
     CborParser parser;
@@ -122,17 +118,17 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
 
     cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_PACKET_SIZE, 0);
     if (subcommand == 0x01) {
-        if (verify(pinUvAuthProtocol, paut.data, (const uint8_t *) "\x01", 1,
+        if (verify(pinUvAuthProtocol, fido_ctx->paut.data, (const uint8_t *) "\x01", 1,
                    pinUvAuthParam.data) != CborNoError) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (is_preview == false &&
-            (!(paut.permissions & CTAP_PERMISSION_CM) || paut.has_rp_id == true)) {
+            (!(fido_ctx->paut.permissions & CTAP_PERMISSION_CM) || fido_ctx->paut.has_rp_id == true)) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         uint8_t existing = 0;
         for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            if (file_has_data(search_dynamic_file(EF_CRED + i))) {
+            if (file_has_data(dyn_file_search(EF_CRED + i))) {
                 existing++;
             }
         }
@@ -145,27 +141,27 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
     else if (subcommand == 0x02 || subcommand == 0x03) {
         file_t *rp_ef = NULL;
         if (subcommand == 0x02) {
-            if (verify(pinUvAuthProtocol, paut.data, (const uint8_t *) "\x02", 1,
+            if (verify(pinUvAuthProtocol, fido_ctx->paut.data, (const uint8_t *) "\x02", 1,
                        pinUvAuthParam.data) != CborNoError) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
             if (is_preview == false &&
-                (!(paut.permissions & CTAP_PERMISSION_CM) || paut.has_rp_id == true)) {
+                (!(fido_ctx->paut.permissions & CTAP_PERMISSION_CM) || fido_ctx->paut.has_rp_id == true)) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
-            rp_counter = 1;
-            rp_total = 0;
+            fido_ctx->cm.rp_counter = 1;
+            fido_ctx->cm.rp_total = 0;
         }
         else {
-            if (rp_counter > rp_total) {
+            if (fido_ctx->cm.rp_counter > fido_ctx->cm.rp_total) {
                 CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
         }
         uint8_t skip = 0;
         for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            file_t *tef = search_dynamic_file(EF_RP + i);
+            file_t *tef = dyn_file_search(EF_RP + i);
             if (file_has_data(tef) && *file_get_data(tef) > 0) {
-                if (++skip == rp_counter) {
+                if (++skip == fido_ctx->cm.rp_counter) {
                     if (rp_ef == NULL) {
                         rp_ef = tef;
                     }
@@ -174,14 +170,14 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                     }
                 }
                 if (subcommand == 0x02) {
-                    rp_total++;
+                    fido_ctx->cm.rp_total++;
                 }
             }
         }
         if (rp_ef == NULL) {
             CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
         }
-        rp_counter++;
+        fido_ctx->cm.rp_counter++;
         CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, subcommand == 0x02 ? 3 : 2));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x03));
         CBOR_CHECK(cbor_encoder_create_map(&mapEncoder, &mapEncoder2, 1));
@@ -193,7 +189,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, file_get_data(rp_ef) + 1, 32));
         if (subcommand == 0x02) {
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x05));
-            CBOR_CHECK(cbor_encode_uint(&mapEncoder, rp_total));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, fido_ctx->cm.rp_total));
         }
     }
     else if (subcommand == 0x04 || subcommand == 0x05) {
@@ -202,30 +198,30 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         }
         if (subcommand == 0x04) {
             *(raw_subpara - 1) = 0x04;
-            if (verify(pinUvAuthProtocol, paut.data, raw_subpara - 1, raw_subpara_len + 1,
+            if (verify(pinUvAuthProtocol, fido_ctx->paut.data, raw_subpara - 1, raw_subpara_len + 1,
                        pinUvAuthParam.data) != CborNoError) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
             if (is_preview == false &&
-                (!(paut.permissions & CTAP_PERMISSION_CM) ||
-                 (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
+                (!(fido_ctx->paut.permissions & CTAP_PERMISSION_CM) ||
+                 (fido_ctx->paut.has_rp_id == true && memcmp(fido_ctx->paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
-            cred_counter = 1;
-            cred_total = 0;
+            fido_ctx->cm.cred_counter = 1;
+            fido_ctx->cm.cred_total = 0;
         }
         else {
-            if (cred_counter > cred_total) {
+            if (fido_ctx->cm.cred_counter > fido_ctx->cm.cred_total) {
                 CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
             }
-            rpIdHash = rpIdHashx;
+            rpIdHash = fido_ctx->cm.rp_id_hash;
         }
         file_t *cred_ef = NULL;
         uint8_t skip = 0;
         for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            file_t *tef = search_dynamic_file(EF_CRED + i);
+            file_t *tef = dyn_file_search(EF_CRED + i);
             if (file_has_data(tef) && memcmp(file_get_data(tef), rpIdHash.data, 32) == 0) {
-                if (++skip == cred_counter) {
+                if (++skip == fido_ctx->cm.cred_counter) {
                     if (cred_ef == NULL) {
                         cred_ef = tef;
                     }
@@ -234,7 +230,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                     }
                 }
                 if (subcommand == 0x04) {
-                    cred_total++;
+                    fido_ctx->cm.cred_total++;
                 }
             }
         }
@@ -256,7 +252,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
         }
 
-        cred_counter++;
+        fido_ctx->cm.cred_counter++;
 
         uint8_t l = 3;
         if (subcommand == 0x04) {
@@ -327,11 +323,11 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
 
         if (subcommand == 0x04) {
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x09));
-            CBOR_CHECK(cbor_encode_uint(&mapEncoder, cred_total));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, fido_ctx->cm.cred_total));
         }
-        if (cred_counter <= cred_total) {
+        if (fido_ctx->cm.cred_counter <= fido_ctx->cm.cred_total) {
             asserted = true;
-            rpIdHashx = rpIdHash;
+            fido_ctx->cm.rp_id_hash = rpIdHash;
         }
         if (cred.extensions.present == true) {
             if (cred.extensions.credProtect > 0) {
@@ -358,42 +354,43 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
         *(raw_subpara - 1) = 0x06;
-        if (verify(pinUvAuthProtocol, paut.data, raw_subpara - 1, raw_subpara_len + 1,
+        if (verify(pinUvAuthProtocol, fido_ctx->paut.data, raw_subpara - 1, raw_subpara_len + 1,
                    pinUvAuthParam.data) != CborNoError) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (is_preview == false &&
-            (!(paut.permissions & CTAP_PERMISSION_CM) ||
-             (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
+            (!(fido_ctx->paut.permissions & CTAP_PERMISSION_CM) ||
+             (fido_ctx->paut.has_rp_id == true && memcmp(fido_ctx->paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            file_t *ef = search_dynamic_file(EF_CRED + i);
+            file_t *ef = dyn_file_search(EF_CRED + i);
             if (file_has_data(ef) &&
                 memcmp(file_get_data(ef) + 32, credentialId.id.data,
                        MIN(file_get_size(ef) - 32, credentialId.id.len)) == 0) {
                 uint8_t *rp_id_hash = file_get_data(ef);
-                if (delete_file(ef) != 0) {
-                    CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
-                }
+                txn_begin();
+                txn_delete(ef);
                 for (int j = 0; j < MAX_RESIDENT_CREDENTIALS; j++) {
-                    file_t *rp_ef = search_dynamic_file(EF_RP + j);
+                    file_t *rp_ef = dyn_file_search(EF_RP + j);
                     if (file_has_data(rp_ef) &&
                         memcmp(file_get_data(rp_ef) + 1, rp_id_hash, 32) == 0) {
                         uint8_t *rp_data = (uint8_t *) calloc(1, file_get_size(rp_ef));
                         memcpy(rp_data, file_get_data(rp_ef), file_get_size(rp_ef));
                         rp_data[0] -= 1;
                         if (rp_data[0] == 0) {
-                            delete_file(rp_ef);
+                            txn_delete(rp_ef);
                         }
                         else {
-                            flash_write_data_to_file(rp_ef, rp_data, file_get_size(rp_ef));
+                            txn_write(rp_ef, rp_data, file_get_size(rp_ef));
                         }
                         free(rp_data);
                         break;
                     }
                 }
-                low_flash_available();
+                if (txn_commit() != CCID_OK) {
+                    CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
+                }
                 goto err; //no error
             }
         }
@@ -404,17 +401,17 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
         *(raw_subpara - 1) = 0x07;
-        if (verify(pinUvAuthProtocol, paut.data, raw_subpara - 1, raw_subpara_len + 1,
+        if (verify(pinUvAuthProtocol, fido_ctx->paut.data, raw_subpara - 1, raw_subpara_len + 1,
                    pinUvAuthParam.data) != CborNoError) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (is_preview == false &&
-            (!(paut.permissions & CTAP_PERMISSION_CM) ||
-             (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
+            (!(fido_ctx->paut.permissions & CTAP_PERMISSION_CM) ||
+             (fido_ctx->paut.has_rp_id == true && memcmp(fido_ctx->paut.rp_id_hash, rpIdHash.data, 32) != 0))) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            file_t *ef = search_dynamic_file(EF_CRED + i);
+            file_t *ef = dyn_file_search(EF_CRED + i);
             if (file_has_data(ef) &&
                 memcmp(file_get_data(ef) + 32, credentialId.id.data,
                        MIN(file_get_size(ef) - 32, credentialId.id.len)) == 0) {
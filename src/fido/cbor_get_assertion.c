@@ -22,7 +22,9 @@
 #endif
 #include "hid/ctap_hid.h"
 #include "fido.h"
+#include "context.h"
 #include "files.h"
+#include "txn.h"
 #include "crypto_utils.h"
 #include "hsm.h"
 #include "apdu.h"
@@ -33,41 +35,32 @@
 
 int cbor_get_assertion(const uint8_t *data, size_t len, bool next);
 
-bool residentx = false;
-Credential credsx[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
-uint8_t credentialCounter = 1;
-uint8_t numberOfCredentialsx = 0;
-uint8_t flagsx = 0;
-uint32_t timerx = 0;
-uint8_t *datax = NULL;
-size_t lenx = 0;
-
 int cbor_get_next_assertion(const uint8_t *data, size_t len) {
     CborError error = CborNoError;
-    if (credentialCounter >= numberOfCredentialsx) {
+    if (fido_ctx->ga.counter >= fido_ctx->ga.count) {
         CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
     }
-    if (timerx + 30 * 1000 < board_millis()) {
+    if (fido_ctx->ga.timer + 30 * 1000 < board_millis()) {
         CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
     }
-    CBOR_CHECK(cbor_get_assertion(datax, lenx, true));
-    timerx = board_millis();
-    credentialCounter++;
+    CBOR_CHECK(cbor_get_assertion(fido_ctx->ga.data, fido_ctx->ga.len, true));
+    fido_ctx->ga.timer = board_millis();
+    fido_ctx->ga.counter++;
 err:
-    if (error != CborNoError || credentialCounter == numberOfCredentialsx) {
+    if (error != CborNoError || fido_ctx->ga.counter == fido_ctx->ga.count) {
         for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-            credential_free(&credsx[i]);
-        }
-        if (datax) {
-            free(datax);
-            datax = NULL;
-        }
-        lenx = 0;
-        residentx = false;
-        timerx = 0;
-        flagsx = 0;
-        credentialCounter = 0;
-        numberOfCredentialsx = 0;
+            credential_free(&fido_ctx->ga.creds[i]);
+        }
+        if (fido_ctx->ga.data) {
+            free(fido_ctx->ga.data);
+            fido_ctx->ga.data = NULL;
+        }
+        fido_ctx->ga.len = 0;
+        fido_ctx->ga.resident = false;
+        fido_ctx->ga.timer = 0;
+        fido_ctx->ga.flags = 0;
+        fido_ctx->ga.counter = 0;
+        fido_ctx->ga.count = 0;
         if (error == CborErrorImproperValue) {
             return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
         }
@@ -273,7 +266,7 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
 
         if (pinUvAuthParam.present == true) { //6.1
             int ret = verify(pinUvAuthProtocol,
-                             paut.data,
+                             fido_ctx->paut.data,
                              clientDataHash.data,
                              clientDataHash.len,
                              pinUvAuthParam.data);
@@ -283,10 +276,10 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
             if (getUserVerifiedFlagValue() == false) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
-            if (!(paut.permissions & CTAP_PERMISSION_GA)) {
+            if (!(fido_ctx->paut.permissions & CTAP_PERMISSION_GA)) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
-            if (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rp_id_hash, 32) != 0) {
+            if (fido_ctx->paut.has_rp_id == true && memcmp(fido_ctx->paut.rp_id_hash, rp_id_hash, 32) != 0) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
             flags |= FIDO2_AUT_FLAG_UV;
@@ -325,7 +318,7 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
             for (int i = 0;
                  i < MAX_RESIDENT_CREDENTIALS && creds_len < MAX_CREDENTIAL_COUNT_IN_LIST;
                  i++) {
-                file_t *ef = search_dynamic_file(EF_CRED + i);
+                file_t *ef = dyn_file_search(EF_CRED + i);
                 if (!file_has_data(ef) || memcmp(file_get_data(ef), rp_id_hash, 32) != 0) {
                     continue;
                 }
@@ -408,25 +401,25 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
             selcred = &creds[0];
             if (numberOfCredentials > 1) {
                 asserted = true;
-                residentx = resident;
+                fido_ctx->ga.resident = resident;
                 for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-                    credsx[i] = creds[i];
+                    fido_ctx->ga.creds[i] = creds[i];
                 }
-                numberOfCredentialsx = numberOfCredentials;
-                datax = (uint8_t *) calloc(1, len);
-                memcpy(datax, data, len);
-                lenx = len;
-                flagsx = flags;
-                timerx = board_millis();
-                credentialCounter = 1;
+                fido_ctx->ga.count = numberOfCredentials;
+                fido_ctx->ga.data = (uint8_t *) calloc(1, len);
+                memcpy(fido_ctx->ga.data, data, len);
+                fido_ctx->ga.len = len;
+                fido_ctx->ga.flags = flags;
+                fido_ctx->ga.timer = board_millis();
+                fido_ctx->ga.counter = 1;
             }
         }
     }
     else {
-        resident = residentx;
-        numberOfCredentials = numberOfCredentialsx;
-        flags = flagsx;
-        selcred = &credsx[credentialCounter];
+        resident = fido_ctx->ga.resident;
+        numberOfCredentials = fido_ctx->ga.count;
+        flags = fido_ctx->ga.flags;
+        selcred = &fido_ctx->ga.creds[fido_ctx->ga.counter];
     }
     mbedtls_ecdsa_context ekey;
     mbedtls_ecdsa_init(&ekey);
@@ -643,7 +636,7 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
     resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
     ctr++;
-    flash_write_data_to_file(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
+    txn_write(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
     low_flash_available();
 err:
     CBOR_FREE_BYTE_STRING(clientDataHash);
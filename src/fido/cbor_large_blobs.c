@@ -17,16 +17,15 @@
 
 #include "ctap2_cbor.h"
 #include "fido.h"
+#include "context.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
 #include "files.h"
+#include "txn.h"
 #include "apdu.h"
 #include "hsm.h"
 #include "mbedtls/sha256.h"
 
-static uint64_t expectedLength = 0, expectedNextOffset = 0;
-uint8_t temp_lba[MAX_LARGE_BLOB_SIZE];
-
 int cbor_large_blobs(const uint8_t *data, size_t len) {
     CborParser parser;
     CborValue map;
@@ -109,15 +108,15 @@ int cbor_large_blobs(const uint8_t *data, size_t len) {
             if (length < 17) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
-            expectedLength = length;
-            expectedNextOffset = 0;
+            fido_ctx->lb.expected_length = length;
+            fido_ctx->lb.expected_next_offset = 0;
         }
         else {
             if (length != 0) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
         }
-        if (offset != expectedNextOffset) {
+        if (offset != fido_ctx->lb.expected_next_offset) {
             CBOR_ERROR(CTAP1_ERR_INVALID_SEQ);
         }
         if (pinUvAuthParam.present == false) {
@@ -134,28 +133,28 @@ int cbor_large_blobs(const uint8_t *data, size_t len) {
         verify_data[36] = offset >> 16;
         verify_data[37] = offset >> 24;
         mbedtls_sha256(set.data, set.len, verify_data + 38, 0);
-        if (verify(pinUvAuthProtocol, paut.data, verify_data, sizeof(verify_data),
+        if (verify(pinUvAuthProtocol, fido_ctx->paut.data, verify_data, sizeof(verify_data),
                    pinUvAuthParam.data) != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
-        if (!(paut.permissions & CTAP_PERMISSION_LBW)) {
+        if (!(fido_ctx->paut.permissions & CTAP_PERMISSION_LBW)) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
-        if (offset + set.len > expectedLength) {
+        if (offset + set.len > fido_ctx->lb.expected_length) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         if (offset == 0) {
-            memset(temp_lba, 0, sizeof(temp_lba));
+            memset(fido_ctx->lb.temp, 0, sizeof(fido_ctx->lb.temp));
         }
-        memcpy(temp_lba + expectedNextOffset, set.data, set.len);
-        expectedNextOffset += set.len;
-        if (expectedNextOffset == expectedLength) {
+        memcpy(fido_ctx->lb.temp + fido_ctx->lb.expected_next_offset, set.data, set.len);
+        fido_ctx->lb.expected_next_offset += set.len;
+        if (fido_ctx->lb.expected_next_offset == fido_ctx->lb.expected_length) {
             uint8_t sha[32];
-            mbedtls_sha256(temp_lba, expectedLength - 16, sha, 0);
-            if (expectedLength > 17 && memcmp(sha, temp_lba + expectedLength - 16, 16) != 0) {
+            mbedtls_sha256(fido_ctx->lb.temp, fido_ctx->lb.expected_length - 16, sha, 0);
+            if (fido_ctx->lb.expected_length > 17 && memcmp(sha, fido_ctx->lb.temp + fido_ctx->lb.expected_length - 16, 16) != 0) {
                 CBOR_ERROR(CTAP2_ERR_INTEGRITY_FAILURE);
             }
-            flash_write_data_to_file(ef_largeblob, temp_lba, expectedLength);
+            txn_write(ef_largeblob, fido_ctx->lb.temp, fido_ctx->lb.expected_length);
             low_flash_available();
         }
         goto err;
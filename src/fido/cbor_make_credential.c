@@ -19,6 +19,7 @@
 #include "ctap2_cbor.h"
 #include "hid/ctap_hid.h"
 #include "fido.h"
+#include "context.h"
 #include "ctap.h"
 #include "files.h"
 #include "apdu.h"
@@ -26,6 +27,7 @@
 #include "mbedtls/sha256.h"
 #include "random.h"
 #include "hsm.h"
+#include "txn.h"
 
 int cbor_make_credential(const uint8_t *data, size_t len) {
     CborParser parser;
@@ -239,26 +241,26 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     }
     if (pinUvAuthParam.present == true) { //11.1
         int ret = verify(pinUvAuthProtocol,
-                         paut.data,
+                         fido_ctx->paut.data,
                          clientDataHash.data,
                          clientDataHash.len,
                          pinUvAuthParam.data);
         if (ret != CborNoError) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
-        if (!(paut.permissions & CTAP_PERMISSION_MC)) {
+        if (!(fido_ctx->paut.permissions & CTAP_PERMISSION_MC)) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
-        if (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rp_id_hash, 32) != 0) {
+        if (fido_ctx->paut.has_rp_id == true && memcmp(fido_ctx->paut.rp_id_hash, rp_id_hash, 32) != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (getUserVerifiedFlagValue() == false) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         flags |= FIDO2_AUT_FLAG_UV;
-        if (paut.has_rp_id == false) {
-            memcpy(paut.rp_id_hash, rp_id_hash, 32);
-            paut.has_rp_id = true;
+        if (fido_ctx->paut.has_rp_id == false) {
+            memcpy(fido_ctx->paut.rp_id_hash, rp_id_hash, 32);
+            fido_ctx->paut.has_rp_id = true;
         }
     }
 
@@ -323,7 +325,6 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
             l++;
         }
         if (extensions.minPinLength != NULL) {
-            file_t *ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
             if (file_has_data(ef_minpin)) {
                 uint8_t *minpin_data = file_get_data(ef_minpin);
                 for (int o = 2; o < file_get_size(ef_minpin); o += 32) {
@@ -473,7 +474,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         CborEncoder arrEncoder;
         file_t *ef_cert = NULL;
         if (enterpriseAttestation == 2) {
-            ef_cert = search_by_fid(EF_EE_DEV_EA, NULL, SPECIFY_EF);
+            ef_cert = ef_certdev_ea;
         }
         if (!file_has_data(ef_cert)) {
             ef_cert = ef_certdev;
@@ -497,15 +498,19 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
     resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
 
+    txn_begin();
     if (options.rk == ptrue) {
         if (credential_store(cred_id, cred_id_len, rp_id_hash) != 0) {
             CBOR_ERROR(CTAP2_ERR_KEY_STORE_FULL);
         }
     }
     ctr++;
-    flash_write_data_to_file(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
-    low_flash_available();
+    txn_write(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
+    if (txn_commit() != CCID_OK) {
+        CBOR_ERROR(CTAP2_ERR_KEY_STORE_FULL);
+    }
 err:
+    txn_abort();
     CBOR_FREE_BYTE_STRING(clientDataHash);
     CBOR_FREE_BYTE_STRING(pinUvAuthParam);
     CBOR_FREE_BYTE_STRING(rp.id);
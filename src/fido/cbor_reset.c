@@ -17,12 +17,16 @@
 
 #include "file.h"
 #include "fido.h"
+#include "context.h"
 #include "ctap.h"
+#include "wear.h"
 #ifndef ENABLE_EMULATION
 #include "bsp/board.h"
 #endif
 
 extern void scan_all();
+extern void oath_index_reset();
+extern void otp_slots_reset();
 
 int cbor_reset() {
 #ifndef ENABLE_EMULATION
@@ -36,6 +40,10 @@ int cbor_reset() {
     }
 #endif
     initialize_flash(true);
+    wear_format();
+    oath_index_reset();
+    otp_slots_reset();
     init_fido();
+    wear_flush();
     return 0;
 }
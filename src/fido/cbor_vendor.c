@@ -17,30 +17,30 @@
 
 #include "ctap2_cbor.h"
 #include "fido.h"
+#include "context.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
 #include "files.h"
+#include "txn.h"
 #include "apdu.h"
 #include "hsm.h"
+#include "dispatch.h"
+#include "wear.h"
 #include "random.h"
 #include "mbedtls/ecdh.h"
 #include "mbedtls/chachapoly.h"
 #include "mbedtls/hkdf.h"
 #include "mbedtls/x509_csr.h"
 
-extern uint8_t keydev_dec[32];
-extern bool has_keydev_dec;
-
-mse_t mse = { .init = false };
 
 int mse_decrypt_ct(uint8_t *data, size_t len) {
     mbedtls_chachapoly_context chatx;
     mbedtls_chachapoly_init(&chatx);
-    mbedtls_chachapoly_setkey(&chatx, mse.key_enc + 12);
+    mbedtls_chachapoly_setkey(&chatx, fido_ctx->mse.key_enc + 12);
     int ret = mbedtls_chachapoly_auth_decrypt(&chatx,
                                               len - 16,
-                                              mse.key_enc,
-                                              mse.Qpt,
+                                              fido_ctx->mse.key_enc,
+                                              fido_ctx->mse.Qpt,
                                               65,
                                               data + len - 16,
                                               data,
@@ -49,6 +49,31 @@ int mse_decrypt_ct(uint8_t *data, size_t len) {
     return ret;
 }
 
+/*
+ * Telemetry commands need a pinUvAuthToken with the authenticator configuration
+ * permission. Their subcommands take no parameters, so the token authenticates
+ * 32 x 0xff | cmd | vendorCmd.
+ */
+static int vendor_check_puat(uint8_t cmd, uint8_t vendorCmd, uint64_t protocol, CborByteString *param) {
+    if (param->present == false) {
+        return CTAP2_ERR_PUAT_REQUIRED;
+    }
+    if (protocol == 0) {
+        return CTAP2_ERR_MISSING_PARAMETER;
+    }
+    uint8_t payload[32 + 2];
+    memset(payload, 0xff, 32);
+    payload[32] = cmd;
+    payload[33] = vendorCmd;
+    if (verify(protocol, fido_ctx->paut.data, payload, sizeof(payload), param->data) != 0) {
+        return CTAP2_ERR_PIN_AUTH_INVALID;
+    }
+    if (!(fido_ctx->paut.permissions & CTAP_PERMISSION_ACFG)) {
+        return CTAP2_ERR_PIN_AUTH_INVALID;
+    }
+    return CTAP2_OK;
+}
+
 int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
     CborParser parser;
     CborValue map;
@@ -126,9 +151,16 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
 
     cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_PACKET_SIZE, 0);
 
+    if (cmd == CTAP_VENDOR_STATS || cmd == CTAP_VENDOR_TRACE || cmd == CTAP_VENDOR_WEAR) {
+        int ret = vendor_check_puat(cmd, (uint8_t) vendorCmd, pinUvAuthProtocol, &pinUvAuthParam);
+        if (ret != CTAP2_OK) {
+            CBOR_ERROR(ret);
+        }
+    }
+
     if (cmd == CTAP_VENDOR_BACKUP) {
         if (vendorCmd == 0x01) {
-            if (has_keydev_dec == false) {
+            if (fido_ctx->has_keydev_dec == false) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
 
@@ -144,9 +176,9 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
             }
             uint8_t zeros[32];
             memset(zeros, 0, sizeof(zeros));
-            flash_write_data_to_file(ef_keydev_enc, vendorParam.data, vendorParam.len);
-            flash_write_data_to_file(ef_keydev, zeros, file_get_size(ef_keydev)); // Overwrite ef with 0
-            flash_write_data_to_file(ef_keydev, NULL, 0); // Set ef to 0 bytes
+            txn_write(ef_keydev_enc, vendorParam.data, vendorParam.len);
+            txn_write(ef_keydev, zeros, file_get_size(ef_keydev)); // Overwrite ef with 0
+            txn_write(ef_keydev, NULL, 0); // Set ef to 0 bytes
             low_flash_available();
             goto err;
         }
@@ -187,8 +219,8 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
                                                  &hkey.ctx.mbed_ecdh.Qp,
                                                  MBEDTLS_ECP_PF_UNCOMPRESSED,
                                                  &olen,
-                                                 mse.Qpt,
-                                                 sizeof(mse.Qpt));
+                                                 fido_ctx->mse.Qpt,
+                                                 sizeof(fido_ctx->mse.Qpt));
             if (ret != 0) {
                 mbedtls_ecdh_free(&hkey);
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
@@ -210,16 +242,16 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
                                0,
                                buf,
                                olen,
-                               mse.Qpt,
-                               sizeof(mse.Qpt),
-                               mse.key_enc,
-                               sizeof(mse.key_enc));
+                               fido_ctx->mse.Qpt,
+                               sizeof(fido_ctx->mse.Qpt),
+                               fido_ctx->mse.key_enc,
+                               sizeof(fido_ctx->mse.key_enc));
             mbedtls_platform_zeroize(buf, sizeof(buf));
             if (ret != 0) {
                 mbedtls_ecdh_free(&hkey);
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
-            mse.init = true;
+            fido_ctx->mse.init = true;
 
             CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
@@ -243,7 +275,7 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
         }
     }
     else if (cmd == CTAP_VENDOR_UNLOCK) {
-        if (mse.init == false) {
+        if (fido_ctx->mse.init == false) {
             CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
         }
 
@@ -262,18 +294,18 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
         mbedtls_chachapoly_init(&chatx);
         mbedtls_chachapoly_setkey(&chatx, vendorParam.data);
         ret = mbedtls_chachapoly_auth_decrypt(&chatx,
-                                              sizeof(keydev_dec),
+                                              sizeof(fido_ctx->keydev_dec),
                                               keyenc,
                                               NULL,
                                               0,
                                               keyenc + keyenc_len - 16,
                                               keyenc + 12,
-                                              keydev_dec);
+                                              fido_ctx->keydev_dec);
         mbedtls_chachapoly_free(&chatx);
         if (ret != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        has_keydev_dec = true;
+        fido_ctx->has_keydev_dec = true;
         goto err;
     }
     else if (cmd == CTAP_VENDOR_EA) {
@@ -342,14 +374,161 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
             if (vendorParam.present == false) {
                 CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
             }
-            file_t *ef_ee_ea = search_by_fid(EF_EE_DEV_EA, NULL, SPECIFY_EF);
-            if (ef_ee_ea) {
-                flash_write_data_to_file(ef_ee_ea, vendorParam.data, vendorParam.len);
+            if (ef_certdev_ea) {
+                txn_write(ef_certdev_ea, vendorParam.data, vendorParam.len);
             }
             low_flash_available();
             goto err;
         }
     }
+    else if (cmd == CTAP_VENDOR_STATS) {
+        if (vendorCmd == 0x01) {
+            size_t entries = 0;
+            for (dispatch_table_t *t = dispatch_tables(); t; t = t->next) {
+                for (int i = 0; i < DISPATCH_MAX_CMDS; i++) {
+                    if (t->stats[i].count > 0) {
+                        entries++;
+                    }
+                }
+            }
+            CborEncoder arrEncoder, errEncoder;
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrEncoder, entries));
+            for (dispatch_table_t *t = dispatch_tables(); t; t = t->next) {
+                for (int i = 0; i < DISPATCH_MAX_CMDS; i++) {
+                    const dispatch_stats_t *st = &t->stats[i];
+                    if (st->count == 0) {
+                        continue;
+                    }
+                    uint8_t errs[DISPATCH_MAX_ERRORS], nerrs = 0;
+                    for (int e = 0; e < DISPATCH_MAX_ERRORS && st->err_count[e] > 0; e++) {
+                        int j = nerrs++;
+                        for (; j > 0 && st->err_code[errs[j - 1]] > st->err_code[e]; j--) {
+                            errs[j] = errs[j - 1];
+                        }
+                        errs[j] = e;
+                    }
+                    size_t fields = st->err_other > 0 ? 7 : 6;
+#ifdef ENABLE_EMULATION
+                    fields += 3;
+#endif
+                    CBOR_CHECK(cbor_encoder_create_map(&arrEncoder, &mapEncoder2, fields));
+                    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x01, t->id);
+                    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x02, dispatch_cmd_byte(t, i));
+                    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x03, st->count);
+                    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x04, st->time_total);
+                    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x05, st->time_max);
+                    CBOR_CHECK(cbor_encode_uint(&mapEncoder2, 0x06));
+                    CBOR_CHECK(cbor_encoder_create_map(&mapEncoder2, &errEncoder, nerrs));
+                    for (int e = 0; e < nerrs; e++) {
+                        CBOR_APPEND_KEY_UINT_VAL_UINT(errEncoder, st->err_code[errs[e]],
+                                                      st->err_count[errs[e]]);
+                    }
+                    CBOR_CHECK(cbor_encoder_close_container(&mapEncoder2, &errEncoder));
+                    if (st->err_other > 0) {
+                        CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x07, st->err_other);
+                    }
+#ifdef ENABLE_EMULATION
+                    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x08, st->heap_peak);
+                    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x09, st->allocs);
+                    CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x0A, st->stack_max);
+#endif
+                    CBOR_CHECK(cbor_encoder_close_container(&arrEncoder, &mapEncoder2));
+                }
+            }
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &arrEncoder));
+        }
+        else if (vendorCmd == 0x02) {
+            dispatch_stats_reset();
+            goto err;
+        }
+        else {
+            CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
+        }
+    }
+    else if (cmd == CTAP_VENDOR_WEAR) {
+        if (vendorCmd == 0x01) {
+            wear_save();
+            size_t entries = 0;
+            for (uint8_t c = 0; c < WEAR_CLASSES; c++) {
+                if (wear_stats(c)->writes > 0 || wear_stats(c)->deletes > 0 || wear_stats(c)->erases > 0) {
+                    entries++;
+                }
+            }
+            uint64_t erases = wear_erases(), budget = wear_budget();
+            CborEncoder arrEncoder;
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 4));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrEncoder, entries));
+            for (uint8_t c = 0; c < WEAR_CLASSES; c++) {
+                const wear_stats_t *w = wear_stats(c);
+                if (w->writes == 0 && w->deletes == 0 && w->erases == 0) {
+                    continue;
+                }
+                CBOR_CHECK(cbor_encoder_create_map(&arrEncoder, &mapEncoder2, 5));
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x01, c);
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x02, w->writes);
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x03, w->bytes);
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x04, w->deletes);
+                CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder2, 0x05, w->erases); // Estimated
+                CBOR_CHECK(cbor_encoder_close_container(&arrEncoder, &mapEncoder2));
+            }
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &arrEncoder));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x02, erases);  // Estimated, an upper bound
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x03, budget);
+            // Remaining endurance in permille
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x04, erases >= budget ? 0 : 1000 - erases * 1000 / budget);
+        }
+        else {
+            CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
+        }
+    }
+#if ENABLE_CBOR_TRACE
+    else if (cmd == CTAP_VENDOR_TRACE) {
+        if (vendorCmd == 0x01) {
+            trace_entry_t entries[TRACE_MAX_ENTRIES];
+            const char *files[TRACE_MAX_ENTRIES];
+            uint8_t fids[TRACE_MAX_ENTRIES], n = trace_read(entries, TRACE_MAX_ENTRIES), nfiles = 0;
+            for (int i = 0; i < n; i++) {
+                uint8_t f = 0;
+                for (; f < nfiles && files[f] != entries[i].file; f++) {
+                    ;
+                }
+                if (f == nfiles) {
+                    files[nfiles++] = entries[i].file;
+                }
+                fids[i] = f;
+            }
+            CborEncoder arrEncoder, entEncoder;
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 3));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrEncoder, n));
+            for (int i = 0; i < n; i++) {
+                CBOR_CHECK(cbor_encoder_create_array(&arrEncoder, &entEncoder, 3));
+                CBOR_CHECK(cbor_encode_uint(&entEncoder, fids[i]));
+                CBOR_CHECK(cbor_encode_uint(&entEncoder, entries[i].line));
+                CBOR_CHECK(cbor_encode_int(&entEncoder, entries[i].error));
+                CBOR_CHECK(cbor_encoder_close_container(&arrEncoder, &entEncoder));
+            }
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &arrEncoder));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &arrEncoder, nfiles));
+            for (int f = 0; f < nfiles; f++) {
+                CBOR_CHECK(cbor_encode_text_stringz(&arrEncoder, trace_basename(files[f])));
+            }
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &arrEncoder));
+            CBOR_APPEND_KEY_UINT_VAL_UINT(mapEncoder, 0x03, trace_total());
+        }
+        else if (vendorCmd == 0x02) {
+            trace_clear();
+            goto err;
+        }
+        else {
+            CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
+        }
+    }
+#endif
     else {
         CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
     }
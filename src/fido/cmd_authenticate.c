@@ -21,6 +21,7 @@
 #include "ctap.h"
 #include "random.h"
 #include "files.h"
+#include "txn.h"
 #include "credential.h"
 
 int cmd_authenticate() {
@@ -97,7 +98,7 @@ int cmd_authenticate() {
     res_APDU_size = 1 + 4 + olen;
 
     ctr++;
-    flash_write_data_to_file(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
+    txn_write(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
     low_flash_available();
     return SW_OK();
 }
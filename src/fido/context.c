@@ -0,0 +1,40 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "context.h"
+#include "files.h"
+
+static fido_ctx_t fido_ctx_default = {
+    .ga = { .counter = 1 },
+    .cm = { .rp_counter = 1, .cred_counter = 1 },
+    .oath = { .validated = true },
+};
+
+FIDO_CTX_TLS fido_ctx_t *fido_ctx = &fido_ctx_default;
+
+void fido_ctx_init(fido_ctx_t *ctx) {
+    memset(ctx, 0, sizeof(fido_ctx_t));
+    ctx->ga.counter = 1;
+    ctx->cm.rp_counter = 1;
+    ctx->cm.cred_counter = 1;
+    ctx->oath.validated = true;
+    // The token key is in flash and shared, as scan_files() sets it for the default context
+    if (ef_authtoken != NULL) {
+        ctx->paut.data = file_get_data(ef_authtoken);
+        ctx->paut.len = file_get_size(ef_authtoken);
+    }
+}
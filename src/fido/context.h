@@ -0,0 +1,101 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONTEXT_H_
+#define _CONTEXT_H_
+
+#include "fido.h"
+#include "ctap.h"
+#include "credential.h"
+#include "mbedtls/ecdh.h"
+
+#define OATH_CHALLENGE_LEN  8
+
+/*
+ * Volatile state of one authenticator. Handlers reach it through fido_ctx,
+ * which points to the context being served. A process hosts a single
+ * authenticator with a single context: no host sets up a second one. The
+ * emulation build keeps fido_ctx per thread and fido_ctx_init() sets up a fresh
+ * context, but a second authenticator would still share the flash and all the
+ * global state below with the first one.
+ *
+ * State that follows the flash rather than a session is global, as all
+ * authenticators of a process share one flash: the dynamic file map (files.c),
+ * the staged transaction and EF_TXN journal (txn.c), the wear counters (wear.c),
+ * the idle jobs (idle.c), the OATH credential index and code caches (oath.c) and
+ * the parsed OTP slots (otp.c). So are the per-command statistics
+ * of the dispatch tables, the trace ring and the keyboard queue, which describe
+ * the device as a whole.
+ */
+typedef struct fido_ctx {
+    pinUvAuthToken_t paut;
+    uint8_t keydev_dec[32];
+    bool has_keydev_dec;
+    mse_t mse;
+
+    struct {                    // ClientPIN
+        mbedtls_ecdh_context hkey;
+        bool hkey_init;
+    } cp;
+
+    struct {                    // GetAssertion session, for GetNextAssertion
+        bool resident;
+        Credential creds[MAX_CREDENTIAL_COUNT_IN_LIST];
+        uint8_t counter;
+        uint8_t count;
+        uint8_t flags;
+        uint32_t timer;
+        uint8_t *data;
+        size_t len;
+    } ga;
+
+    struct {                    // CredentialManagement enumerations
+        uint8_t rp_counter;
+        uint8_t rp_total;
+        uint8_t cred_counter;
+        uint8_t cred_total;
+        CborByteString rp_id_hash;
+    } cm;
+
+    struct {                    // LargeBlobs fragmented write
+        uint64_t expected_length;
+        uint64_t expected_next_offset;
+        uint8_t temp[MAX_LARGE_BLOB_SIZE];
+    } lb;
+
+    struct {
+        bool validated;
+        uint8_t challenge[OATH_CHALLENGE_LEN];
+        uint8_t more_ins;       // LIST or CALCULATE_ALL pending SEND_REMAINING, 0 if none
+        uint8_t more_p2;
+        uint16_t more_slot;     // First credential not sent yet
+        uint8_t more_chal[64];
+        uint8_t more_chal_len;
+    } oath;
+} fido_ctx_t;
+
+#ifdef ENABLE_EMULATION
+#define FIDO_CTX_TLS __thread
+#else
+#define FIDO_CTX_TLS
+#endif
+
+extern FIDO_CTX_TLS fido_ctx_t *fido_ctx;
+
+extern void fido_ctx_init(fido_ctx_t *ctx);
+
+#endif //_CONTEXT_H_
@@ -27,6 +27,7 @@
 #include "random.h"
 #include "files.h"
 #include "hsm.h"
+#include "txn.h"
 
 int credential_derive_chacha_key(uint8_t *outk);
 
@@ -267,7 +268,7 @@ int credential_store(const uint8_t *cred_id, size_t cred_id_len, const uint8_t *
         return ret;
     }
     for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-        file_t *ef = search_dynamic_file(EF_CRED + i);
+        file_t *ef = dyn_file_search(EF_CRED + i);
         Credential rcred = { 0 };
         if (!file_has_data(ef)) {
             if (sloti == -1) {
@@ -298,14 +299,15 @@ int credential_store(const uint8_t *cred_id, size_t cred_id_len, const uint8_t *
     uint8_t *data = (uint8_t *) calloc(1, cred_id_len + 32);
     memcpy(data, rp_id_hash, 32);
     memcpy(data + 32, cred_id, cred_id_len);
-    file_t *ef = file_new(EF_CRED + sloti);
-    flash_write_data_to_file(ef, data, cred_id_len + 32);
+    txn_begin();
+    txn_write_fid(EF_CRED + sloti, data, cred_id_len + 32);
+    file_t *ef = NULL;
     free(data);
 
     if (new_record == true) { //increase rps
         sloti = -1;
         for (int i = 0; i < MAX_RESIDENT_CREDENTIALS; i++) {
-            ef = search_dynamic_file(EF_RP + i);
+            ef = dyn_file_search(EF_RP + i);
             if (!file_has_data(ef)) {
                 if (sloti == -1) {
                     sloti = i;
@@ -318,29 +320,29 @@ int credential_store(const uint8_t *cred_id, size_t cred_id_len, const uint8_t *
             }
         }
         if (sloti == -1) {
+            txn_abort();
+            credential_free(&cred);
             return -1;
         }
-        ef = search_dynamic_file(EF_RP + sloti);
+        ef = dyn_file_search(EF_RP + sloti);
         if (file_has_data(ef)) {
             data = (uint8_t *) calloc(1, file_get_size(ef));
             memcpy(data, file_get_data(ef), file_get_size(ef));
             data[0] += 1;
-            flash_write_data_to_file(ef, data, file_get_size(ef));
+            txn_write(ef, data, file_get_size(ef));
             free(data);
         }
         else {
-            ef = file_new(EF_RP + sloti);
             data = (uint8_t *) calloc(1, 1 + 32 + cred.rpId.len);
             data[0] = 1;
             memcpy(data + 1, rp_id_hash, 32);
             memcpy(data + 1 + 32, cred.rpId.data, cred.rpId.len);
-            flash_write_data_to_file(ef, data, 1 + 32 + cred.rpId.len);
+            txn_write_fid(EF_RP + sloti, data, 1 + 32 + cred.rpId.len);
             free(data);
         }
     }
     credential_free(&cred);
-    low_flash_available();
-    return 0;
+    return txn_commit() == CCID_OK ? 0 : -1;
 }
 
 int credential_derive_hmac_key(const uint8_t *cred_id, size_t cred_id_len, uint8_t *outk) {
@@ -128,6 +128,9 @@ typedef struct {
 #define CTAP_VENDOR_MSE                 0x02
 #define CTAP_VENDOR_UNLOCK              0x03
 #define CTAP_VENDOR_EA                  0x04
+#define CTAP_VENDOR_STATS               0x05
+#define CTAP_VENDOR_TRACE               0x06
+#define CTAP_VENDOR_WEAR                0x07
 
 #define CTAP_PERMISSION_MC              0x01  // MakeCredential
 #define CTAP_PERMISSION_GA              0x02  // GetAssertion
@@ -141,7 +144,6 @@ typedef struct mse {
     uint8_t key_enc[12 + 32];
     bool init;
 } mse_t;
-extern mse_t mse;
 
 extern int mse_decrypt_ct(uint8_t *, size_t);
 
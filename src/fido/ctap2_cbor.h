@@ -19,6 +19,7 @@
 #define _CTAP2_CBOR_H_
 
 #include "cbor.h"
+#include "trace.h"
 
 extern uint8_t *driver_prepare_response();
 extern void driver_exec_finished(size_t size_next);
@@ -35,7 +36,7 @@ extern const bool _btrue, _bfalse;
         error = f;      \
         if (error != CborNoError) \
         {                       \
-            printf("Cannot encode CBOR [%s:%d]: %s (%d)\n", __FILE__, __LINE__, #f, error); \
+            TRACE_ERROR(error); \
             goto err; \
         } \
     } while (0)
@@ -54,7 +55,7 @@ extern const bool _btrue, _bfalse;
     do                \
     {                 \
         error = e;    \
-        printf("Cbor ERROR [%s:%d]: %d\n", __FILE__, __LINE__, e); \
+        TRACE_ERROR(error); \
         goto err;     \
     } while (0)
 
@@ -64,7 +65,7 @@ extern const bool _btrue, _bfalse;
         if (!c)                             \
         {                                   \
             error = CborErrorImproperValue; \
-            printf("Cbor ASSERT [%s:%d]: %s\n", __FILE__, __LINE__, #c); \
+            TRACE_ERROR(error);             \
             goto err;                       \
         }                                   \
     } while (0)
@@ -0,0 +1,365 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENABLE_EMULATION
+#include "pico/stdlib.h"
+#else
+#include <time.h>
+#include <stdint.h>
+#endif
+#include "dispatch.h"
+#include "idle.h"
+
+static dispatch_table_t *tables = NULL;
+
+#ifdef ENABLE_EMULATION
+#define STACK_PATTERN   0xA5
+#define STACK_REPAINT   64      // Commands between two full paints
+
+/* Painted area of the calling thread and the lowest byte the last command overwrote */
+static __thread uint8_t *stack_low = NULL;
+static __thread const uint8_t *stack_dirty = NULL;
+static __thread uint32_t stack_paints = 0;
+
+/*
+ * The whole area is painted the first time and every STACK_REPAINT commands, in
+ * between only the part overwritten by the previous command is painted again.
+ */
+static void __attribute__((noinline)) dispatch_stack_paint() {
+    uint8_t buf[DISPATCH_STACK_PAINT];
+    if (stack_low != buf || stack_dirty == NULL || stack_paints++ % STACK_REPAINT == 0) {
+        memset(buf, STACK_PATTERN, sizeof(buf));
+    }
+    else if (stack_dirty < buf + sizeof(buf)) {
+        memset((uint8_t *) stack_dirty, STACK_PATTERN, buf + sizeof(buf) - stack_dirty);
+    }
+    __asm__ volatile ("" : : "r" (buf) : "memory"); // Keep the dead stores
+    stack_low = buf;
+    stack_dirty = NULL;
+}
+
+/* Called after the command returned: scans the dead stack below base for the first overwritten byte. */
+static uint32_t __attribute__((noinline)) dispatch_stack_used(const uint8_t *base) {
+    const volatile uint8_t *p = stack_low;
+    while (p < base && *p == STACK_PATTERN) {
+        p++;
+    }
+    stack_dirty = (const uint8_t *) p;
+    return (uint32_t) (base - p);
+}
+
+#ifdef DISPATCH_WRAP_ALLOC
+uint64_t dispatch_heap_allocs = 0, dispatch_heap_bytes = 0;
+size_t dispatch_heap_in_use = 0, dispatch_heap_peak = 0;
+
+extern void *__real_malloc(size_t);
+extern void *__real_calloc(size_t, size_t);
+extern void *__real_realloc(void *, size_t);
+extern void __real_free(void *);
+
+/*
+ * Blocks allocated through the wrappers carry their size in front of them, so
+ * memory obtained elsewhere (libc internals, allocations made before the wrap)
+ * is released without touching the counters. The magic lands on the glibc
+ * chunk size field of foreign blocks, which never holds such a value.
+ */
+#define HEAP_MAGIC      ((size_t) 0xA110CA7EDB10C5A5ull)
+
+typedef struct heap_hdr {
+    size_t size;
+    size_t magic;
+} __attribute__((aligned(16))) heap_hdr_t;
+
+static heap_hdr_t *heap_hdr(void *ptr) {
+    heap_hdr_t *h = (heap_hdr_t *) ptr - 1;
+    return h->magic == HEAP_MAGIC ? h : NULL;
+}
+
+static void heap_peak_update(size_t in_use) {
+    size_t peak = __atomic_load_n(&dispatch_heap_peak, __ATOMIC_RELAXED);
+    while (in_use > peak &&
+           !__atomic_compare_exchange_n(&dispatch_heap_peak, &peak, in_use, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+static void *heap_account(heap_hdr_t *h, size_t size, size_t old) {
+    if (h == NULL) {
+        return NULL;
+    }
+    h->size = size;
+    h->magic = HEAP_MAGIC;
+    __atomic_add_fetch(&dispatch_heap_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dispatch_heap_bytes, size, __ATOMIC_RELAXED);
+    heap_peak_update(__atomic_add_fetch(&dispatch_heap_in_use, size - old, __ATOMIC_RELAXED));
+    return h + 1;
+}
+
+void *__wrap_malloc(size_t size) {
+    if (size > SIZE_MAX - sizeof(heap_hdr_t)) {
+        return NULL;
+    }
+    return heap_account(__real_malloc(sizeof(heap_hdr_t) + size), size, 0);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    if (size != 0 && n > (SIZE_MAX - sizeof(heap_hdr_t)) / size) {
+        return NULL;
+    }
+    return heap_account(__real_calloc(1, sizeof(heap_hdr_t) + n * size), n * size, 0);
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    heap_hdr_t *h = heap_hdr(ptr);
+    if (h == NULL) {
+        __real_free(ptr);
+        return;
+    }
+    h->magic = 0;
+    __atomic_sub_fetch(&dispatch_heap_in_use, h->size, __ATOMIC_RELAXED);
+    __real_free(h);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return __wrap_malloc(size);
+    }
+    heap_hdr_t *h = heap_hdr(ptr);
+    if (h == NULL) {
+        return __real_realloc(ptr, size);
+    }
+    if (size == 0) {
+        __wrap_free(ptr);
+        return NULL;
+    }
+    if (size > SIZE_MAX - sizeof(heap_hdr_t)) {
+        return NULL;
+    }
+    size_t old = h->size;
+    h->magic = 0;
+    heap_hdr_t *n = __real_realloc(h, sizeof(heap_hdr_t) + size);
+    if (n == NULL) { // Original block is kept
+        h->magic = HEAP_MAGIC;
+        return NULL;
+    }
+    return heap_account(n, size, old);
+}
+#endif
+#endif
+
+uint64_t dispatch_time_us() {
+#ifndef ENABLE_EMULATION
+    return time_us_64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * Tables are indexed on first use and statistics are shared by every thread that
+ * dispatches commands. The emulator runs several of them, so there indexing is
+ * serialized and the counters are updated atomically, like the heap counters.
+ * The firmware dispatches each table from a single core.
+ */
+#ifdef ENABLE_EMULATION
+static bool index_lock = false;
+
+#define STAT_LOAD(p)        __atomic_load_n(p, __ATOMIC_RELAXED)
+#define STAT_ADD(p, v)      __atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+#define STAT_CAS(p, e, v)   __atomic_compare_exchange_n(p, e, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define INDEXED(t)          __atomic_load_n(&(t)->indexed, __ATOMIC_ACQUIRE)
+#else
+#define STAT_LOAD(p)        (*(p))
+#define STAT_ADD(p, v)      (*(p) += (v))
+#define STAT_CAS(p, e, v)   (*(p) == *(e) ? (*(p) = (v), true) : (*(e) = *(p), false))
+#define INDEXED(t)          ((t)->indexed)
+#endif
+
+static void stat_max(uint32_t *p, uint32_t v) {
+    uint32_t cur = STAT_LOAD(p);
+    while (v > cur && !STAT_CAS(p, &cur, v)) {
+    }
+}
+
+static void stat_inc(uint16_t *p) {
+    uint16_t cur = STAT_LOAD(p);
+    while (cur < UINT16_MAX && !STAT_CAS(p, &cur, (uint16_t) (cur + 1))) {
+    }
+}
+
+static void dispatch_index(dispatch_table_t *table) {
+#ifdef ENABLE_EMULATION
+    while (__atomic_test_and_set(&index_lock, __ATOMIC_ACQUIRE)) {
+    }
+    if (table->indexed == true) {
+        __atomic_clear(&index_lock, __ATOMIC_RELEASE);
+        return;
+    }
+#endif
+    memset(table->index, 0, sizeof(table->index));
+    for (int i = 0; i < DISPATCH_MAX_CMDS; i++) {
+        uint8_t cmd = 0;
+        if (table->cbor_cmds) {
+            if (table->cbor_cmds[i].cmd == 0x00) {
+                break;
+            }
+            cmd = table->cbor_cmds[i].cmd;
+        }
+        else {
+            if (table->cmds[i].ins == 0x00) {
+                break;
+            }
+            cmd = table->cmds[i].ins;
+        }
+        if (table->index[cmd] == 0) {
+            table->index[cmd] = i + 1;
+        }
+    }
+    table->next = tables;
+#ifdef ENABLE_EMULATION
+    __atomic_store_n(&tables, table, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->indexed, true, __ATOMIC_RELEASE);
+    __atomic_clear(&index_lock, __ATOMIC_RELEASE);
+#else
+    tables = table;
+    table->indexed = true;
+#endif
+}
+
+#ifdef ENABLE_EMULATION
+typedef struct mem_mark {
+    const uint8_t *base;
+    uint64_t allocs;
+    size_t heap;
+} mem_mark_t;
+
+#define MEM_MARK(m) \
+    do { \
+        (m).base = __builtin_frame_address(0); \
+        dispatch_stack_paint(); \
+        mem_mark_heap(&(m)); \
+    } while (0)
+
+static void mem_mark_heap(mem_mark_t *m) {
+#ifdef DISPATCH_WRAP_ALLOC
+    m->allocs = __atomic_load_n(&dispatch_heap_allocs, __ATOMIC_RELAXED);
+    m->heap = __atomic_load_n(&dispatch_heap_in_use, __ATOMIC_RELAXED);
+    __atomic_store_n(&dispatch_heap_peak, m->heap, __ATOMIC_RELAXED);
+#endif
+}
+
+static void mem_account(dispatch_table_t *table, int entry, const mem_mark_t *m) {
+    dispatch_stats_t *st = &table->stats[entry];
+    stat_max(&st->stack_max, dispatch_stack_used(m->base));
+#ifdef DISPATCH_WRAP_ALLOC
+    size_t peak = __atomic_load_n(&dispatch_heap_peak, __ATOMIC_RELAXED);
+    if (peak > m->heap) {
+        stat_max(&st->heap_peak, (uint32_t) (peak - m->heap));
+    }
+    STAT_ADD(&st->allocs, (uint32_t) (__atomic_load_n(&dispatch_heap_allocs, __ATOMIC_RELAXED) - m->allocs));
+#endif
+}
+#endif
+
+static void dispatch_account(dispatch_table_t *table, int entry, uint64_t t0, int ret) {
+    dispatch_stats_t *st = &table->stats[entry];
+    uint64_t now = dispatch_time_us(), elapsed = now - t0;
+    idle_activity(now);
+    STAT_ADD(&st->count, 1);
+    STAT_ADD(&st->time_total, elapsed);
+    stat_max(&st->time_max, elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed);
+    if (ret == table->ok || (table->ok == 0x9000 && (ret & 0xff00) == 0x6100)) {
+        return;
+    }
+    for (int e = 0; e < DISPATCH_MAX_ERRORS; e++) {
+        uint16_t code = 0;
+        // Claims a free entry for this code, unless another thread just claimed it for another one
+        if (STAT_CAS(&st->err_code[e], &code, (uint16_t) ret) || code == (uint16_t) ret) {
+            stat_inc(&st->err_count[e]);
+            return;
+        }
+    }
+    stat_inc(&st->err_other);
+}
+
+int dispatch_cbor(dispatch_table_t *table, uint8_t cmd, const uint8_t *data, size_t len) {
+    if (INDEXED(table) == false) {
+        dispatch_index(table);
+    }
+    int entry = table->index[cmd] - 1;
+    if (entry < 0) {
+        return DISPATCH_NOT_FOUND;
+    }
+#ifdef ENABLE_EMULATION
+    mem_mark_t m;
+    MEM_MARK(m);
+#endif
+    uint64_t t0 = dispatch_time_us();
+    int ret = table->cbor_cmds[entry].cmd_handler(data, len);
+    dispatch_account(table, entry, t0, ret);
+#ifdef ENABLE_EMULATION
+    mem_account(table, entry, &m);
+#endif
+    return ret;
+}
+
+int dispatch_apdu(dispatch_table_t *table) {
+    if (INDEXED(table) == false) {
+        dispatch_index(table);
+    }
+    int entry = table->index[INS(apdu)] - 1;
+    if (entry < 0) {
+        return DISPATCH_NOT_FOUND;
+    }
+#ifdef ENABLE_EMULATION
+    mem_mark_t m;
+    MEM_MARK(m);
+#endif
+    uint64_t t0 = dispatch_time_us();
+    int ret = table->cmds[entry].cmd_handler();
+    dispatch_account(table, entry, t0, ret);
+#ifdef ENABLE_EMULATION
+    mem_account(table, entry, &m);
+#endif
+    return ret;
+}
+
+dispatch_table_t *dispatch_tables() {
+#ifdef ENABLE_EMULATION
+    return __atomic_load_n(&tables, __ATOMIC_ACQUIRE);
+#else
+    return tables;
+#endif
+}
+
+uint8_t dispatch_cmd_byte(const dispatch_table_t *table, int entry) {
+    if (table->cbor_cmds) {
+        return table->cbor_cmds[entry].cmd;
+    }
+    return table->cmds[entry].ins;
+}
+
+void dispatch_stats_reset() {
+    for (dispatch_table_t *table = dispatch_tables(); table; table = table->next) {
+        memset(table->stats, 0, sizeof(table->stats));
+    }
+}
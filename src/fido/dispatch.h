@@ -0,0 +1,95 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DISPATCH_H_
+#define _DISPATCH_H_
+
+#include "common.h"
+#include "apdu.h"
+
+#define DISPATCH_TABLE_CTAP2    0x01
+#define DISPATCH_TABLE_VENDOR   0x02
+#define DISPATCH_TABLE_U2F      0x03
+#define DISPATCH_TABLE_OATH     0x04
+#define DISPATCH_TABLE_MAN      0x05
+#define DISPATCH_TABLE_OTP      0x06
+
+#define DISPATCH_MAX_CMDS       16
+#define DISPATCH_MAX_ERRORS     4
+
+typedef struct dispatch_stats {
+    uint32_t count;
+    uint32_t time_max;          // Microseconds
+    uint64_t time_total;        // Microseconds
+    uint16_t err_code[DISPATCH_MAX_ERRORS]; // First distinct error codes returned
+    uint16_t err_count[DISPATCH_MAX_ERRORS];
+    uint16_t err_other;         // Errors with codes seen after err_code was full
+#ifdef ENABLE_EMULATION
+    uint32_t heap_peak;         // Bytes above the heap in use when the command started
+    uint32_t allocs;
+    uint32_t stack_max;         // Bytes
+#endif
+} dispatch_stats_t;
+
+typedef struct cbor_cmd {
+    uint8_t cmd;
+    int (*cmd_handler)(const uint8_t *data, size_t len);
+} cbor_cmd_t;
+
+typedef struct dispatch_table {
+    const uint8_t id;
+    const uint16_t ok;                  // Return value of a successful command
+    const cbor_cmd_t *cbor_cmds;        // Either cbor_cmds or cmds, 0x00-terminated
+    const cmd_t *cmds;
+    uint8_t index[256];                 // Command byte -> entry + 1. 0 means not supported
+    bool indexed;
+    dispatch_stats_t stats[DISPATCH_MAX_CMDS]; // Device-wide, shared by every context
+    struct dispatch_table *next;
+} dispatch_table_t;
+
+#define DISPATCH_NOT_FOUND  -1
+
+/* Fails the build if a command array, terminator included, has more than DISPATCH_MAX_CMDS entries */
+#define DISPATCH_CHECK_CMDS(c) \
+    _Static_assert(sizeof(c) / sizeof((c)[0]) <= DISPATCH_MAX_CMDS + 1, #c " exceeds DISPATCH_MAX_CMDS")
+
+/* Dispatches a CBOR command. Returns DISPATCH_NOT_FOUND if cmd is not in the table. */
+extern int dispatch_cbor(dispatch_table_t *table, uint8_t cmd, const uint8_t *data, size_t len);
+/* Dispatches INS(apdu). Returns DISPATCH_NOT_FOUND if INS is not in the table. */
+extern int dispatch_apdu(dispatch_table_t *table);
+
+extern dispatch_table_t *dispatch_tables();
+extern uint8_t dispatch_cmd_byte(const dispatch_table_t *table, int entry);
+extern void dispatch_stats_reset();
+
+extern uint64_t dispatch_time_us();
+
+#ifdef ENABLE_EMULATION
+/* Stack painted below the dispatcher to measure the depth of each command */
+#define DISPATCH_STACK_PAINT    (64 * 1024)
+#ifdef DISPATCH_WRAP_ALLOC
+/*
+ * Updated atomically by the malloc wrappers, enabled with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free.
+ * They count the blocks allocated through the wrappers only; dispatch_heap_peak is shared by the emulator
+ * threads, so the heap peak of a command also sees the allocations other threads make meanwhile.
+ */
+extern uint64_t dispatch_heap_allocs, dispatch_heap_bytes;
+extern size_t dispatch_heap_in_use, dispatch_heap_peak;
+#endif
+#endif
+
+#endif //_DISPATCH_H_
@@ -16,10 +16,14 @@
  */
 
 #include "fido.h"
+#include "context.h"
 #include "hsm.h"
 #include "apdu.h"
 #include "ctap.h"
+#include "dispatch.h"
 #include "files.h"
+#include "txn.h"
+#include "wear.h"
 #include "usb.h"
 #include "random.h"
 #include "mbedtls/x509_crt.h"
@@ -35,10 +39,6 @@
 int fido_process_apdu();
 int fido_unload();
 
-pinUvAuthToken_t paut = { 0 };
-
-uint8_t keydev_dec[32];
-bool has_keydev_dec = false;
 
 const uint8_t fido_aid[] = {
     8,
@@ -139,11 +139,11 @@ int x509_create_cert(mbedtls_ecdsa_context *ecdsa, uint8_t *buffer, size_t buffe
 }
 
 int load_keydev(uint8_t *key) {
-    if (has_keydev_dec == false && !file_has_data(ef_keydev)) {
+    if (fido_ctx->has_keydev_dec == false && !file_has_data(ef_keydev)) {
         return CCID_ERR_MEMORY_FATAL;
     }
-    if (has_keydev_dec == true) {
-        memcpy(key, keydev_dec, sizeof(keydev_dec));
+    if (fido_ctx->has_keydev_dec == true) {
+        memcpy(key, fido_ctx->keydev_dec, sizeof(fido_ctx->keydev_dec));
     }
     else {
         memcpy(key, file_get_data(ef_keydev), file_get_size(ef_keydev));
@@ -252,6 +252,8 @@ int derive_key(const uint8_t *app_id,
 }
 
 int scan_files() {
+    dyn_file_reset();
+    wear_load();
     ef_keydev = search_by_fid(EF_KEY_DEV, NULL, SPECIFY_EF);
     ef_keydev_enc = search_by_fid(EF_KEY_DEV_ENC, NULL, SPECIFY_EF);
     if (ef_keydev) {
@@ -268,7 +270,7 @@ int scan_files() {
             uint8_t kdata[32];
             int key_size = mbedtls_mpi_size(&ecdsa.d);
             mbedtls_mpi_write_binary(&ecdsa.d, kdata, key_size);
-            ret = flash_write_data_to_file(ef_keydev, kdata, key_size);
+            ret = txn_write(ef_keydev, kdata, key_size);
             mbedtls_platform_zeroize(kdata, sizeof(kdata));
             mbedtls_ecdsa_free(&ecdsa);
             if (ret != CCID_OK) {
@@ -304,42 +306,47 @@ int scan_files() {
             if (ret <= 0) {
                 return ret;
             }
-            flash_write_data_to_file(ef_certdev, cert + sizeof(cert) - ret, ret);
+            txn_write(ef_certdev, cert + sizeof(cert) - ret, ret);
         }
     }
     else {
         printf("FATAL ERROR: CERT DEV not found in memory!\r\n");
     }
+    ef_certdev_ea = search_by_fid(EF_EE_DEV_EA, NULL, SPECIFY_EF);
     ef_counter = search_by_fid(EF_COUNTER, NULL, SPECIFY_EF);
     if (ef_counter) {
         if (!file_has_data(ef_counter)) {
             uint32_t v = 0;
-            flash_write_data_to_file(ef_counter, (uint8_t *) &v, sizeof(v));
+            txn_write(ef_counter, (uint8_t *) &v, sizeof(v));
         }
     }
     else {
         printf("FATAL ERROR: Global counter not found in memory!\r\n");
     }
     ef_pin = search_by_fid(EF_PIN, NULL, SPECIFY_EF);
+    ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
+    ef_opts = search_by_fid(EF_OPTS, NULL, SPECIFY_EF);
     ef_authtoken = search_by_fid(EF_AUTHTOKEN, NULL, SPECIFY_EF);
     if (ef_authtoken) {
         if (!file_has_data(ef_authtoken)) {
             uint8_t t[32];
             random_gen(NULL, t, sizeof(t));
-            flash_write_data_to_file(ef_authtoken, t, sizeof(t));
+            txn_write(ef_authtoken, t, sizeof(t));
         }
-        paut.data = file_get_data(ef_authtoken);
-        paut.len = file_get_size(ef_authtoken);
+        fido_ctx->paut.data = file_get_data(ef_authtoken);
+        fido_ctx->paut.len = file_get_size(ef_authtoken);
     }
     else {
         printf("FATAL ERROR: Auth Token not found in memory!\r\n");
     }
     ef_largeblob = search_by_fid(EF_LARGEBLOB, NULL, SPECIFY_EF);
     if (!file_has_data(ef_largeblob)) {
-        flash_write_data_to_file(ef_largeblob,
-                                 (const uint8_t *) "\x80\x76\xbe\x8b\x52\x8d\x00\x75\xf7\xaa\xe9\x8d\x6f\xa5\x7a\x6d\x3c",
-                                 17);
+        txn_write(ef_largeblob,
+                  (const uint8_t *) "\x80\x76\xbe\x8b\x52\x8d\x00\x75\xf7\xaa\xe9\x8d\x6f\xa5\x7a\x6d\x3c",
+                  17);
     }
+    // Last: a replayed journal is dropped by the next write, which waits for the flash task
+    txn_recover();
     low_flash_available();
     return CCID_OK;
 }
@@ -387,16 +394,14 @@ uint32_t get_sign_counter() {
 }
 
 uint8_t get_opts() {
-    file_t *ef = search_by_fid(EF_OPTS, NULL, SPECIFY_EF);
-    if (file_has_data(ef)) {
-        return *file_get_data(ef);
+    if (file_has_data(ef_opts)) {
+        return *file_get_data(ef_opts);
     }
     return 0;
 }
 
 void set_opts(uint8_t opts) {
-    file_t *ef = search_by_fid(EF_OPTS, NULL, SPECIFY_EF);
-    flash_write_data_to_file(ef, &opts, sizeof(uint8_t));
+    txn_write(ef_opts, &opts, sizeof(uint8_t));
     low_flash_available();
 }
 
@@ -410,16 +415,21 @@ static const cmd_t cmds[] = {
     { CTAP_VERSION, cmd_version },
     { 0x00, 0x0 }
 };
+DISPATCH_CHECK_CMDS(cmds);
+
+static dispatch_table_t table = {
+    .id = DISPATCH_TABLE_U2F,
+    .ok = 0x9000,
+    .cmds = cmds,
+};
 
 int fido_process_apdu() {
     if (CLA(apdu) != 0x00) {
         return SW_CLA_NOT_SUPPORTED();
     }
-    for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-        if (cmd->ins == INS(apdu)) {
-            int r = cmd->cmd_handler();
-            return r;
-        }
+    int r = dispatch_apdu(&table);
+    if (r == DISPATCH_NOT_FOUND) {
+        return SW_INS_NOT_SUPPORTED();
     }
-    return SW_INS_NOT_SUPPORTED();
+    return r;
 }
@@ -98,6 +98,8 @@ extern void set_opts(uint8_t);
 #define MAX_MSG_SIZE              1024
 #define MAX_FRAGMENT_LENGTH       (MAX_MSG_SIZE - 64)
 #define MAX_LARGE_BLOB_SIZE       2048
+#define MAX_OATH_CRED             512
+#define MAX_OATH_RECORD           256
 
 typedef struct known_app {
     const uint8_t *rp_id_hash;
@@ -125,7 +127,6 @@ typedef struct pinUvAuthToken {
 
 extern uint32_t user_present_time_limit;
 
-extern pinUvAuthToken_t paut;
 extern int verify(uint8_t protocol,
                   const uint8_t *key,
                   const uint8_t *data,
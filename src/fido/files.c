@@ -16,6 +16,19 @@
  */
 
 #include "files.h"
+#include "hsm.h"
+#include "wear.h"
+#include <string.h>
+
+// The map holds every dynamic file at once, at most 3/4 full
+#if MAX_DYNAMIC_FILES <= 384
+#define DYN_MAP_SIZE    512     // Power of two
+#elif MAX_DYNAMIC_FILES <= 768
+#define DYN_MAP_SIZE    1024
+#else
+#define DYN_MAP_SIZE    2048
+#endif
+#define DYN_MAP_LOAD    (DYN_MAP_SIZE * 3 / 4)
 
 file_t file_entries[] = {
     { .fid = 0x3f00, .parent = 0xff, .name = NULL, .type = FILE_TYPE_DF, .data = NULL,
@@ -59,3 +72,108 @@ file_t *ef_pin = NULL;
 file_t *ef_authtoken = NULL;
 file_t *ef_keydev_enc = NULL;
 file_t *ef_largeblob = NULL;
+file_t *ef_minpin = NULL;
+file_t *ef_opts = NULL;
+file_t *ef_certdev_ea = NULL;
+
+// FID of 0 marks a free entry. Only existing files are cached. Global, like the file table it caches
+static struct {
+    uint16_t fid;
+    file_t *ef;
+} dyn_map[DYN_MAP_SIZE];
+static uint16_t dyn_map_used = 0;
+
+void dyn_file_reset() {
+    memset(dyn_map, 0, sizeof(dyn_map));
+    dyn_map_used = 0;
+}
+
+static uint16_t dyn_map_home(uint16_t fid) {
+    return (uint16_t) (fid * 40503u) & (DYN_MAP_SIZE - 1);
+}
+
+static uint16_t dyn_map_slot(uint16_t fid) {
+    uint16_t i = dyn_map_home(fid);
+    while (dyn_map[i].fid != 0 && dyn_map[i].fid != fid) {
+        i = (i + 1) & (DYN_MAP_SIZE - 1);
+    }
+    return i;
+}
+
+static void dyn_map_set(uint16_t fid, file_t *ef) {
+    uint16_t i = dyn_map_slot(fid);
+    if (dyn_map[i].fid == 0) {
+        if (ef == NULL || dyn_map_used == DYN_MAP_LOAD) {
+            return;
+        }
+        dyn_map[i].fid = fid;
+        dyn_map_used++;
+    }
+    dyn_map[i].ef = ef;
+}
+
+// Removes an entry and moves back the ones probed past it
+static void dyn_map_remove(uint16_t fid) {
+    uint16_t i = dyn_map_slot(fid), j = i;
+    if (dyn_map[i].fid == 0) {
+        return;
+    }
+    while (true) {
+        j = (j + 1) & (DYN_MAP_SIZE - 1);
+        if (dyn_map[j].fid == 0) {
+            break;
+        }
+        uint16_t h = dyn_map_home(dyn_map[j].fid);
+        // Entry j stays if its home lies cyclically in (i, j]
+        if (i <= j ? (i < h && h <= j) : (i < h || h <= j)) {
+            continue;
+        }
+        dyn_map[i] = dyn_map[j];
+        i = j;
+    }
+    dyn_map[i].fid = 0;
+    dyn_map[i].ef = NULL;
+    dyn_map_used--;
+}
+
+file_t *dyn_file_search(uint16_t fid) {
+    uint16_t i = dyn_map_slot(fid);
+    if (dyn_map[i].fid == fid) {
+        if (dyn_map[i].ef->fid == fid) {
+            return dyn_map[i].ef;
+        }
+        dyn_map_remove(fid);
+    }
+    file_t *ef = search_dynamic_file(fid);
+    dyn_map_set(fid, ef);
+    return ef;
+}
+
+file_t *dyn_file_new(uint16_t fid) {
+    file_t *ef = file_new(fid);
+    dyn_map_set(fid, ef);
+    return ef;
+}
+
+// Deleting a dynamic file moves the entries after it in the file table one place down.
+// Static files stay where they are, and so do the dynamic ones.
+int dyn_file_delete(file_t *ef) {
+    if (ef == NULL) {
+        return delete_file(ef);
+    }
+    uint16_t fid = ef->fid;
+    bool dynamic = ef < file_entries || ef > file_last;
+    wear_delete(fid);
+    int ret = delete_file(ef);
+    if (ret != CCID_OK) {
+        dyn_file_reset();
+        return ret;
+    }
+    dyn_map_remove(fid);
+    for (int i = 0; i < DYN_MAP_SIZE && dynamic; i++) {
+        if (dyn_map[i].fid != 0 && dyn_map[i].ef > ef) {
+            dyn_map[i].ef--;
+        }
+    }
+    return ret;
+}
@@ -20,22 +20,41 @@
 
 #include "file.h"
 
+#ifndef MAX_DYNAMIC_FILES
+#define MAX_DYNAMIC_FILES   256
+#endif
+/*
+ * Share of the dynamic file table left to OATH: its pools and EF_OATH_CODE. The rest
+ * holds FIDO credentials and RPs, OTP slots and the service files.
+ */
+#define OATH_DYN_FILES      (MAX_DYNAMIC_FILES / 3)
+
 #define EF_KEY_DEV      0xCC00
 #define EF_KEY_DEV_ENC  0xCC01
 #define EF_EE_DEV       0xCE00
 #define EF_EE_DEV_EA    0xCE01
 #define EF_COUNTER      0xC000
 #define EF_OPTS         0xC001
+#define EF_TXN          0xC002 // Journal of an interrupted flash transaction
+#define EF_WEAR         0xC003 // Flash wear counters
 #define EF_PIN          0x1080
 #define EF_AUTHTOKEN    0x1090
 #define EF_MINPINLEN    0x1100
 #define EF_CRED         0xCF00 // Creds at 0xCF00 - 0xCFFF
 #define EF_RP           0xD000 // RPs at 0xD000 - 0xD0FF
 #define EF_LARGEBLOB    0x1101 // Large Blob Array
-#define EF_OATH_CRED    0xBA00 // OATH Creds at 0xBA00 - 0xBAFE
+#define EF_OATH_CRED    0xBA00 // Legacy OATH Creds at 0xBA00 - 0xBAFE
 #define EF_OATH_CODE    0xBAFF
 #define EF_OTP_SLOT1    0xBB00
 #define EF_OTP_SLOT2    0xBB01
+#define EF_OATH_IMF     0xBC00 // Legacy OATH HOTP counters at 0xBC00 - 0xBCFE
+#define EF_OATH_POOL    0xB900 // OATH credential pools at 0xB900 - 0xB93F
+#define EF_OATH_POOL4   0xBD00 // Earlier OATH pools of 4 credentials at 0xBD00 - 0xBD7F
+#define EF_OATH_POOL4_IMF 0xBE00 // Their HOTP counters at 0xBE00 - 0xBE7F
+#define EF_OTP_IMF1     0xBB10 // OTP HOTP counters
+#define EF_OTP_IMF2     0xBB11
+#define EF_OTP_CTR1     0xBB20 // OTP usage counter ceilings
+#define EF_OTP_CTR2     0xBB21
 
 extern file_t *ef_keydev;
 extern file_t *ef_certdev;
@@ -44,5 +63,19 @@ extern file_t *ef_pin;
 extern file_t *ef_authtoken;
 extern file_t *ef_keydev_enc;
 extern file_t *ef_largeblob;
+extern file_t *ef_minpin;
+extern file_t *ef_opts;
+extern file_t *ef_certdev_ea;
+
+/*
+ * Dynamic files by FID through a hashed cache of search_dynamic_file(), sized for
+ * the whole dynamic file table. Files must be created and deleted through
+ * dyn_file_new() and dyn_file_delete(), which keep the cache in step with the file
+ * table. Missing files are not cached and always fall back to the table search.
+ */
+extern file_t *dyn_file_search(uint16_t fid);
+extern file_t *dyn_file_new(uint16_t fid);
+extern int dyn_file_delete(file_t *ef);
+extern void dyn_file_reset();
 
 #endif //_FILES_H_
@@ -0,0 +1,76 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "idle.h"
+#include "txn.h"
+
+// Global: the jobs work on the one flash, and a command on any interface delays them
+static idle_step_t idle_jobs[IDLE_MAX_JOBS];
+static uint8_t idle_njobs = 0;
+static uint8_t idle_next = 0;
+// Set until the job's step returns false. A flag per job, as a press on core0 may schedule
+static volatile bool idle_pending[IDLE_MAX_JOBS];
+static uint64_t idle_last_us = 0;
+
+void idle_register(idle_step_t step) {
+    if (idle_njobs < IDLE_MAX_JOBS) {
+        idle_jobs[idle_njobs++] = step;
+    }
+}
+
+// The job has work for the next idle time
+void idle_schedule(idle_step_t step) {
+    for (int i = 0; i < idle_njobs; i++) {
+        if (idle_jobs[i] == step) {
+            idle_pending[i] = true;
+        }
+    }
+}
+
+void idle_activity(uint64_t now_us) {
+    idle_last_us = now_us;
+}
+
+static bool idle_any() {
+    for (int i = 0; i < idle_njobs; i++) {
+        if (idle_pending[i] == true) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs at most one step, of the next scheduled job after the last one run. Returns true
+// while there is work left, due or not.
+bool idle_run(uint64_t now_us) {
+    if (now_us - idle_last_us < IDLE_QUIET_US || txn_active() == true) {
+        return idle_any();
+    }
+    for (int i = 0; i < idle_njobs; i++) {
+        uint8_t j = (idle_next + i) % idle_njobs;
+        if (idle_pending[j] == true) {
+            // Cleared first, so work scheduled during the step is not lost
+            idle_pending[j] = false;
+            if (idle_jobs[j]() == true) {
+                idle_pending[j] = true;
+            }
+            idle_next = (j + 1) % idle_njobs;
+            break;
+        }
+    }
+    return idle_any();
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IDLE_H_
+#define _IDLE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IDLE_MAX_JOBS       4
+#define IDLE_QUIET_US       250000  // Quiet time after a command before idle work starts
+#define IDLE_POLL_US        1000
+
+/*
+ * An idle job does one bounded piece of deferred flash work per call, a single write
+ * or delete through the transaction layer, and returns true while it has more to do.
+ */
+typedef bool (*idle_step_t)();
+
+/*
+ * Flash work deferred to idle time. Jobs are registered at start-up and run once
+ * scheduled, one step at a time from idle_run(), which the CTAPHID thread calls while
+ * it waits for the next command. A step only runs once no command has been dispatched
+ * on any interface for IDLE_QUIET_US and no transaction is open, so a command that
+ * arrives waits at most for the step in progress, and nothing runs in front of it.
+ *
+ * Erasing and reclaiming sectors is up to the flash layer of the SDK, so the jobs are
+ * the writes this tree can take off the commands: dropping a journal replayed at boot
+ * (txn.c) and saving pending wear counters (wear.c). Without an idle loop, as in the
+ * CCID thread and the emulator, the next write does the former and the inline flushes
+ * of wear_sync() the latter.
+ */
+extern void idle_register(idle_step_t step);
+extern void idle_schedule(idle_step_t step);
+extern void idle_activity(uint64_t now_us);
+extern bool idle_run(uint64_t now_us);
+
+#endif //_IDLE_H_
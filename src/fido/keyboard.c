@@ -0,0 +1,215 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENABLE_EMULATION
+#include "bsp/board.h"
+#include "tusb.h"
+#include "usb_descriptors.h"
+#endif
+#include <string.h>
+#include "keyboard.h"
+#include "hid/ctap_hid.h"
+
+#ifndef ENABLE_EMULATION
+bool kbd_pull = true;
+static void kbd_send();
+#else
+bool kbd_pull = false;
+#endif
+
+// There is one keyboard interface, so a single queue serves every slot and context
+static kbd_report_t queue[KBD_MAX_REPORTS];
+static size_t queue_head = 0, queue_len = 0;
+static uint8_t queue_pacing = 0;
+static uint32_t queue_due = 0;
+static bool queue_timed = false;
+
+static const struct {
+    char c;
+    uint8_t modifier;
+    uint8_t keycode;
+} kbd_symbols[] = {
+    { ' ', 0, 0x2c }, { '!', KBD_MOD_LSHIFT, 0x1e }, { '"', KBD_MOD_LSHIFT, 0x34 },
+    { '#', KBD_MOD_LSHIFT, 0x20 }, { '$', KBD_MOD_LSHIFT, 0x21 }, { '%', KBD_MOD_LSHIFT, 0x22 },
+    { '&', KBD_MOD_LSHIFT, 0x24 }, { '\'', 0, 0x34 }, { '(', KBD_MOD_LSHIFT, 0x26 },
+    { ')', KBD_MOD_LSHIFT, 0x27 }, { '*', KBD_MOD_LSHIFT, 0x25 }, { '+', KBD_MOD_LSHIFT, 0x2e },
+    { ',', 0, 0x36 }, { '-', 0, 0x2d }, { '.', 0, 0x37 }, { '/', 0, 0x38 },
+    { ':', KBD_MOD_LSHIFT, 0x33 }, { ';', 0, 0x33 }, { '<', KBD_MOD_LSHIFT, 0x36 },
+    { '=', 0, 0x2e }, { '>', KBD_MOD_LSHIFT, 0x37 }, { '?', KBD_MOD_LSHIFT, 0x38 },
+    { '@', KBD_MOD_LSHIFT, 0x1f }, { '[', 0, 0x2f }, { '\\', 0, 0x31 }, { ']', 0, 0x30 },
+    { '^', KBD_MOD_LSHIFT, 0x23 }, { '_', KBD_MOD_LSHIFT, 0x2d }, { '`', 0, 0x35 },
+    { '{', KBD_MOD_LSHIFT, 0x2f }, { '|', KBD_MOD_LSHIFT, 0x31 }, { '}', KBD_MOD_LSHIFT, 0x30 },
+    { '~', KBD_MOD_LSHIFT, 0x35 },
+};
+
+// ASCII if encode, otherwise a scan code with 0x80 for shift, as in static tickets
+static bool kbd_map(uint8_t c, bool encode, uint8_t *modifier, uint8_t *keycode) {
+    *modifier = 0;
+    if (encode == false) {
+        *modifier = c & 0x80 ? KBD_MOD_LSHIFT : 0;
+        *keycode = c & 0x7f;
+        return *keycode != 0;
+    }
+    if (c >= 'a' && c <= 'z') {
+        *keycode = 0x04 + (c - 'a');
+    }
+    else if (c >= 'A' && c <= 'Z') {
+        *modifier = KBD_MOD_LSHIFT;
+        *keycode = 0x04 + (c - 'A');
+    }
+    else if (c >= '1' && c <= '9') {
+        *keycode = 0x1e + (c - '1');
+    }
+    else if (c == '0') {
+        *keycode = 0x27;
+    }
+    else if (c == '\r' || c == '\n') {
+        *keycode = 0x28;
+    }
+    else if (c == '\t') {
+        *keycode = 0x2b;
+    }
+    else if (c == '\b') {
+        *keycode = 0x2a;
+    }
+    else {
+        for (size_t i = 0; i < sizeof(kbd_symbols) / sizeof(kbd_symbols[0]); i++) {
+            if (kbd_symbols[i].c == c) {
+                *modifier = kbd_symbols[i].modifier;
+                *keycode = kbd_symbols[i].keycode;
+                return true;
+            }
+        }
+        return false;
+    }
+    return true;
+}
+
+// Stores a report at reports[n] if it is below max
+static void kbd_put(kbd_report_t *reports, size_t n, size_t max, uint8_t modifier, const uint8_t *keys, uint8_t nkeys) {
+    if (n < max) {
+        memset(&reports[n], 0, sizeof(kbd_report_t));
+        reports[n].modifier = modifier;
+        if (nkeys > 0) {
+            memcpy(reports[n].keycode, keys, nkeys);
+        }
+    }
+}
+
+/*
+ * Keys are rolled: every report presses one more key and keeps up to KBD_MAX_KEYS
+ * previous ones held, so the host sees exactly one new key per report and in order.
+ * All keys are released only when the next key is already held or needs another
+ * modifier, and once at the end. Returns the reports the whole text takes, of which
+ * only the first max are stored.
+ */
+size_t kbd_plan(const uint8_t *data, size_t len, bool encode, kbd_report_t *reports, size_t max) {
+    uint8_t held[KBD_MAX_KEYS], nheld = 0, modifier = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t m = 0, k = 0;
+        if (kbd_map(data[i], encode, &m, &k) == false) {
+            continue;
+        }
+        if (nheld > 0 && (m != modifier || memchr(held, k, nheld) != NULL)) {
+            kbd_put(reports, n++, max, 0, NULL, 0);
+            nheld = 0;
+        }
+        if (nheld == KBD_MAX_KEYS) {
+            memmove(held, held + 1, KBD_MAX_KEYS - 1);
+            nheld--;
+        }
+        held[nheld++] = k;
+        modifier = m;
+        kbd_put(reports, n++, max, modifier, held, nheld);
+    }
+    if (nheld > 0) {
+        kbd_put(reports, n++, max, 0, NULL, 0);
+    }
+    return n;
+}
+
+// Text that does not fit whole in the queue is not typed at all
+bool kbd_type(const uint8_t *data, size_t len, bool encode, uint8_t pacing_ms) {
+    if (kbd_pull == false) {
+        add_keyboard_buffer(data, len, encode);
+        return true;
+    }
+    if (queue_head == queue_len) {
+        queue_head = queue_len = 0;
+        queue_timed = false;
+    }
+    size_t n = kbd_plan(data, len, encode, queue + queue_len, KBD_MAX_REPORTS - queue_len);
+    if (n > KBD_MAX_REPORTS - queue_len) {
+        return false;
+    }
+    queue_len += n;
+    queue_pacing = pacing_ms;
+#ifndef ENABLE_EMULATION
+    kbd_send();
+#endif
+    return true;
+}
+
+// Next report to send at now_ms, false if there is none or it is not due yet
+bool kbd_next_report(kbd_report_t *report, uint32_t now_ms) {
+    if (queue_head == queue_len) {
+        return false;
+    }
+    if (queue_timed == true && (int32_t) (now_ms - queue_due) < 0) {
+        return false;
+    }
+    *report = queue[queue_head++];
+    queue_due = now_ms + (report->keycode[0] != 0 && queue_pacing > KBD_POLL_MS ? queue_pacing : KBD_POLL_MS);
+    queue_timed = true;
+    return true;
+}
+
+bool kbd_pending() {
+    return queue_head != queue_len;
+}
+
+#ifndef ENABLE_EMULATION
+static kbd_report_t kbd_last;
+
+/*
+ * Sends the next report, or repeats the last one while the next is not due yet,
+ * so every completed report triggers another until the queue is empty. Runs in
+ * the USB task, from kbd_type() (the button callback) and from the completion
+ * callback below.
+ */
+static void kbd_send() {
+    if (kbd_pending() == false || tud_hid_n_ready(ITF_KEYBOARD) == false) {
+        return;
+    }
+    kbd_next_report(&kbd_last, board_millis());
+    tud_hid_n_keyboard_report(ITF_KEYBOARD, 0, kbd_last.modifier, kbd_last.keycode);
+}
+
+/*
+ * The SDK defines the TinyUSB completion callback for CTAPHID frames, so the
+ * keyboard chain is linked in front of it with --wrap (see CMakeLists.txt).
+ */
+extern void __real_tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len);
+
+void __wrap_tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len) {
+    if (instance == ITF_KEYBOARD) {
+        kbd_send();
+    }
+    __real_tud_hid_report_complete_cb(instance, report, len);
+}
+#endif
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _KEYBOARD_H_
+#define _KEYBOARD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define KBD_MAX_KEYS        6       // Keys held at once in a boot keyboard report
+#define KBD_MAX_REPORTS     160
+#define KBD_POLL_MS         1       // Interval of the keyboard IN endpoint
+
+#define KBD_MOD_LSHIFT      0x02
+
+typedef struct kbd_report {
+    uint8_t modifier;
+    uint8_t keycode[KBD_MAX_KEYS];
+} kbd_report_t;
+
+/*
+ * Set when the reports returned by kbd_next_report() are sent to the keyboard
+ * endpoint, which the firmware does from the HID report completion callback.
+ * Otherwise kbd_type() hands the text to add_keyboard_buffer(). kbd_type() returns
+ * false, typing nothing, when the reports the text takes do not fit in the queue.
+ */
+extern bool kbd_pull;
+
+extern size_t kbd_plan(const uint8_t *data, size_t len, bool encode, kbd_report_t *reports, size_t max);
+extern bool kbd_type(const uint8_t *data, size_t len, bool encode, uint8_t pacing_ms);
+extern bool kbd_next_report(kbd_report_t *report, uint32_t now_ms);
+extern bool kbd_pending();
+
+#endif //_KEYBOARD_H_
@@ -19,6 +19,7 @@
 #include "hsm.h"
 #include "apdu.h"
 #include "version.h"
+#include "dispatch.h"
 
 int man_process_apdu();
 int man_unload();
@@ -101,16 +102,21 @@ static const cmd_t cmds[] = {
     { INS_READ_CONFIG, cmd_read_config },
     { 0x00, 0x0 }
 };
+DISPATCH_CHECK_CMDS(cmds);
+
+static dispatch_table_t table = {
+    .id = DISPATCH_TABLE_MAN,
+    .ok = 0x9000,
+    .cmds = cmds,
+};
 
 int man_process_apdu() {
     if (CLA(apdu) != 0x00) {
         return SW_CLA_NOT_SUPPORTED();
     }
-    for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-        if (cmd->ins == INS(apdu)) {
-            int r = cmd->cmd_handler();
-            return r;
-        }
+    int r = dispatch_apdu(&table);
+    if (r == DISPATCH_NOT_FOUND) {
+        return SW_INS_NOT_SUPPORTED();
     }
-    return SW_INS_NOT_SUPPORTED();
+    return r;
 }
@@ -15,16 +15,22 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS    // Hash chaining values, see oath_hmac_t
+
 #include "fido.h"
+#include "context.h"
 #include "hsm.h"
 #include "apdu.h"
 #include "files.h"
 #include "random.h"
 #include "version.h"
 #include "asn1.h"
-
-#define MAX_OATH_CRED   255
-#define CHALLENGE_LEN   8
+#include "dispatch.h"
+#include "txn.h"
+#include "mbedtls/md.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/platform_util.h"
 
 #define TAG_NAME            0x71
 #define TAG_NAME_LIST       0x72
@@ -38,6 +44,7 @@
 #define TAG_IMF             0x7a
 #define TAG_ALGO            0x7b
 #define TAG_TOUCH_RESPONSE  0x7c
+#define TAG_RECORD          0x7d // Batch PUT record
 
 #define ALG_HMAC_SHA1       0x01
 #define ALG_HMAC_SHA256     0x02
@@ -51,11 +58,101 @@
 #define PROP_INC            0x01
 #define PROP_TOUCH          0x02
 
+#define INS_PUT             0x01
+#define INS_DELETE          0x02
+#define INS_SET_CODE        0x03
+#define INS_RESET           0x04
+#define INS_PUT_BATCH       0x06
+#define INS_LIST            0xa1
+#define INS_CALCULATE       0xa2
+#define INS_VALIDATE        0xa3
+#define INS_CALC_ALL        0xa4
+#define INS_SEND_REMAINING  0xa5
+
+#define MAX_OATH_RESPONSE   1024
+#define OATH_LEGACY_CREDS   255 // EF_OATH_CRED files before pools
+#define OATH_HMAC_CACHE     (MAX_OATH_CRED / 8) // Keys whose HMAC states are cached
+#define OATH_POOL_RECS      8   // Records rewritten together by a PUT, DELETE or HOTP code
+#define OATH_POOL4_RECS     4   // Records of the EF_OATH_POOL4 files before
+#define OATH_POOL4_FILES    0x80
+#define OATH_POOLS          ((MAX_OATH_CRED + OATH_POOL_RECS - 1) / OATH_POOL_RECS)
+#define OATH_INDEX_SIZE     (2 * MAX_OATH_CRED) // Name index entries, a power of two
+#define OATH_HOTP_BLOCK     8   // HOTP values reserved at once, within a validator look-ahead of 10
+
+_Static_assert(OATH_POOLS <= 0x40, "Too many OATH pools");
+_Static_assert(OATH_POOL_RECS % OATH_POOL4_RECS == 0, "Earlier OATH pools must migrate whole");
+_Static_assert((OATH_INDEX_SIZE & (OATH_INDEX_SIZE - 1)) == 0, "OATH name index size must be a power of two");
+_Static_assert(OATH_HMAC_CACHE <= 255, "OATH HMAC cache entries are indexed by a byte");
+// The pools and EF_OATH_CODE leave most of the dynamic file table to FIDO credentials and RPs
+_Static_assert(OATH_POOLS + 1 <= OATH_DYN_FILES, "OATH pools exceed their dynamic file budget");
+// A RESET deletes every file left in one transaction
+_Static_assert(4 * MAX_DYNAMIC_FILES + TXN_DIGEST_SIZE <= TXN_MAX_SIZE, "OATH reset exceeds the transaction buffer");
+
+/*
+ * Packed OATH credential. Records are grouped by OATH_POOL_RECS in EF_OATH_POOL
+ * files, which start with a table of 16-bit record offsets (0 if the slot is free).
+ * The HOTP moving factor is kept in the record.
+ */
+typedef struct oath_rec {
+    uint8_t name_len;
+    uint8_t key_len;            // Type and algorithm, digits and secret, as in TAG_KEY
+    uint8_t prop;
+    uint8_t imf[8];             // Moving factor
+    uint8_t data[];             // Key, then name
+} oath_rec_t;
+
+#define OATH_REC_KEY(r)     ((r)->data)
+#define OATH_REC_NAME(r)    ((r)->data + (r)->key_len)
+#define OATH_REC_MAX        (sizeof(oath_rec_t) + MAX_OATH_RECORD)
+#define OATH_POOL_SIZE      (OATH_POOL_RECS * (2 + OATH_REC_MAX))
+
+// A pool, with the deletes of the files migrated into it, is staged in one transaction
+_Static_assert(4 + OATH_POOL_SIZE + 4 * 2 * (OATH_POOL_RECS + OATH_POOL_RECS / OATH_POOL4_RECS) +
+               TXN_DIGEST_SIZE <= TXN_MAX_SIZE, "OATH pool exceeds the transaction buffer");
+
+/*
+ * SHA-1 or SHA-256 chaining values after the ipad and opad blocks of a key. Resuming
+ * from them saves two of the four compressions of an HMAC over a short challenge,
+ * and needs no hash context on the heap.
+ */
+typedef struct oath_hmac {
+    uint32_t inner[8];
+    uint32_t outer[8];
+} oath_hmac_t;
+
+/*
+ * Index and code caches of the stored credentials. They follow the flash rather
+ * than a session, so they are global, like the dynamic file map. All of them are
+ * sized by MAX_OATH_CRED and take about 10.4 KB of RAM for 512 credentials, within
+ * OATH_RAM_BUDGET. The pool scratch buffers add 4.2 KB.
+ */
+#define OATH_RAM_BUDGET     (12 * 1024)
+
+static bool oath_indexed = false;   // oath_used, oath_hashes and oath_index reflect EF_OATH_POOL files
+static bool oath_migrating = false; // A legacy record could not be moved into the pools
+static uint32_t oath_used[(MAX_OATH_CRED + 31) / 32];
+static uint16_t oath_hashes[MAX_OATH_CRED];         // Name hash of each used slot
+static uint16_t oath_index[OATH_INDEX_SIZE];        // Slots + 1 by name hash, open addressing, 0 if free
+static oath_hmac_t oath_hmac_cache[OATH_HMAC_CACHE];
+static uint16_t oath_hmac_owner[OATH_HMAC_CACHE];   // Slot + 1 of each entry, 0 if free
+static uint8_t oath_hmac_entry[MAX_OATH_CRED];      // Entry + 1 of each slot, 0 if not cached
+static uint8_t oath_totp_chal[64];  // Challenge of the cached CALCULATE_ALL codes
+static uint8_t oath_totp_chal_len = 0;
+static uint32_t oath_totp_valid[(MAX_OATH_CRED + 31) / 32];
+static uint8_t oath_totp_code[MAX_OATH_CRED][4];
+static uint8_t oath_hotp_left[MAX_OATH_CRED];       // HOTP values reserved in the record and not used
+static uint32_t oath_hotp_started[(MAX_OATH_CRED + 31) / 32];   // Slots that emitted a HOTP code
+
+_Static_assert(sizeof(oath_used) + sizeof(oath_hashes) + sizeof(oath_index) + sizeof(oath_hmac_cache) +
+               sizeof(oath_hmac_owner) + sizeof(oath_hmac_entry) + sizeof(oath_totp_chal) +
+               sizeof(oath_totp_valid) + sizeof(oath_totp_code) + sizeof(oath_hotp_left) +
+               sizeof(oath_hotp_started) <= OATH_RAM_BUDGET, "OATH caches exceed their RAM budget");
+
 int oath_process_apdu();
 int oath_unload();
+static void oath_index_load();
+static int oath_send_entries(uint16_t slot);
 
-static bool validated = true;
-static uint8_t challenge[CHALLENGE_LEN] = { 0 };
 
 const uint8_t oath_aid[] = {
     7,
@@ -81,13 +178,15 @@ app_t *oath_select(app_t *a, const uint8_t *aid, uint8_t aid_len) {
 #else
         memset(res_APDU + res_APDU_size, 0, 8); res_APDU_size += 8;
 #endif
-        if (file_has_data(search_dynamic_file(EF_OATH_CODE)) == true) {
-            random_gen(NULL, challenge, sizeof(challenge));
+        if (file_has_data(dyn_file_search(EF_OATH_CODE)) == true) {
+            random_gen(NULL, fido_ctx->oath.challenge, sizeof(fido_ctx->oath.challenge));
             res_APDU[res_APDU_size++] = TAG_CHALLENGE;
-            res_APDU[res_APDU_size++] = sizeof(challenge);
-            memcpy(res_APDU + res_APDU_size, challenge, sizeof(challenge));
-            res_APDU_size += sizeof(challenge);
+            res_APDU[res_APDU_size++] = sizeof(fido_ctx->oath.challenge);
+            memcpy(res_APDU + res_APDU_size, fido_ctx->oath.challenge, sizeof(fido_ctx->oath.challenge));
+            res_APDU_size += sizeof(fido_ctx->oath.challenge);
         }
+        oath_index_load();
+        fido_ctx->oath.more_ins = 0;
         apdu.ne = res_APDU_size;
         return a;
     }
@@ -102,79 +201,729 @@ int oath_unload() {
     return CCID_OK;
 }
 
-file_t *find_oath_cred(const uint8_t *name, size_t name_len) {
-    size_t ef_tag_len = 0;
-    uint8_t *ef_tag_data = NULL;
-    for (int i = 0; i < MAX_OATH_CRED; i++) {
-        file_t *ef = search_dynamic_file(EF_OATH_CRED + i);
-        if (file_has_data(ef) &&
-            asn1_find_tag(file_get_data(ef), file_get_size(ef), TAG_NAME, &ef_tag_len,
-                          &ef_tag_data) == true && ef_tag_len == name_len &&
-            memcmp(ef_tag_data, name, name_len) == 0) {
-            return ef;
+#ifdef ENABLE_EMULATION
+uint32_t oath_hmac_hits = 0, oath_hmac_misses = 0;
+#endif
+
+// Drops the cached HMAC states of a slot, or of all of them if slot < 0
+static void oath_hmac_invalidate(int slot) {
+    if (slot < 0) {
+        mbedtls_platform_zeroize(oath_hmac_cache, sizeof(oath_hmac_cache));
+        memset(oath_hmac_owner, 0, sizeof(oath_hmac_owner));
+        memset(oath_hmac_entry, 0, sizeof(oath_hmac_entry));
+        return;
+    }
+    uint8_t e = oath_hmac_entry[slot];
+    if (e != 0) {
+        mbedtls_platform_zeroize(&oath_hmac_cache[e - 1], sizeof(oath_hmac_t));
+        oath_hmac_owner[e - 1] = 0;
+        oath_hmac_entry[slot] = 0;
+    }
+}
+
+// Cache entry for a slot. Once full, entries are not replaced: CALCULATE_ALL walks every
+// slot in turn, which would evict each entry before its next use.
+static oath_hmac_t *oath_hmac_alloc(int slot) {
+    for (int i = 0; i < OATH_HMAC_CACHE; i++) {
+        if (oath_hmac_owner[i] == 0) {
+            oath_hmac_owner[i] = slot + 1;
+            oath_hmac_entry[slot] = i + 1;
+            return &oath_hmac_cache[i];
         }
     }
     return NULL;
 }
 
-int cmd_put() {
-    if (validated == false) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED();
+// Chaining value after a 64-byte block
+static int oath_sha_block(mbedtls_md_type_t type, const uint8_t *block, uint32_t *state) {
+    int r = 0;
+    if (type == MBEDTLS_MD_SHA1) {
+        mbedtls_sha1_context ctx;
+        mbedtls_sha1_init(&ctx);
+        if ((r = mbedtls_sha1_starts(&ctx)) == 0 && (r = mbedtls_sha1_update(&ctx, block, 64)) == 0) {
+            memcpy(state, ctx.MBEDTLS_PRIVATE(state), 5 * sizeof(uint32_t));
+        }
+        mbedtls_sha1_free(&ctx);
     }
-    size_t key_len = 0, imf_len = 0, name_len = 0;
-    uint8_t *key = NULL, *imf = NULL, *name = NULL;
-    if (asn1_find_tag(apdu.data, apdu.nc, TAG_KEY, &key_len, &key) == false) {
-        return SW_INCORRECT_PARAMS();
+    else {
+        mbedtls_sha256_context ctx;
+        mbedtls_sha256_init(&ctx);
+        if ((r = mbedtls_sha256_starts(&ctx, 0)) == 0 && (r = mbedtls_sha256_update(&ctx, block, 64)) == 0) {
+            memcpy(state, ctx.MBEDTLS_PRIVATE(state), 8 * sizeof(uint32_t));
+        }
+        mbedtls_sha256_free(&ctx);
     }
-    if (asn1_find_tag(apdu.data, apdu.nc, TAG_NAME, &name_len, &name) == false) {
-        return SW_INCORRECT_PARAMS();
+    return r;
+}
+
+// Digest of a 64-byte block, given by its chaining value, followed by data
+static int oath_sha_resume(mbedtls_md_type_t type,
+                           const uint32_t *state,
+                           const uint8_t *data,
+                           size_t len,
+                           uint8_t *digest) {
+    int r = 0;
+    if (type == MBEDTLS_MD_SHA1) {
+        mbedtls_sha1_context ctx;
+        mbedtls_sha1_init(&ctx);
+        if ((r = mbedtls_sha1_starts(&ctx)) == 0) {
+            memcpy(ctx.MBEDTLS_PRIVATE(state), state, 5 * sizeof(uint32_t));
+            ctx.MBEDTLS_PRIVATE(total)[0] = 64;
+            if ((r = mbedtls_sha1_update(&ctx, data, len)) == 0) {
+                r = mbedtls_sha1_finish(&ctx, digest);
+            }
+        }
+        mbedtls_sha1_free(&ctx);
     }
-    if ((key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-        if (asn1_find_tag(apdu.data, apdu.nc, TAG_IMF, &imf_len, &imf) == false) {
-            memcpy(apdu.data + apdu.nc, "\x7a\x08\x00\x00\x00\x00\x00\x00\x00\x00", 10);
-            apdu.nc += 10;
-        }
-        else { //prepend zero-valued bytes
-            if (imf_len < 8) {
-                memmove(imf + (8 - imf_len), imf, imf_len);
-                memset(imf, 0, 8 - imf_len);
-                *(imf - 1) = 8;
-                apdu.nc += (8 - imf_len);
+    else {
+        mbedtls_sha256_context ctx;
+        mbedtls_sha256_init(&ctx);
+        if ((r = mbedtls_sha256_starts(&ctx, 0)) == 0) {
+            memcpy(ctx.MBEDTLS_PRIVATE(state), state, 8 * sizeof(uint32_t));
+            ctx.MBEDTLS_PRIVATE(total)[0] = 64;
+            if ((r = mbedtls_sha256_update(&ctx, data, len)) == 0) {
+                r = mbedtls_sha256_finish(&ctx, digest);
             }
+        }
+        mbedtls_sha256_free(&ctx);
+    }
+    return r;
+}
 
+// Hash states after absorbing the ipad and opad blocks of the key, as HMAC does
+static int oath_hmac_pads(const mbedtls_md_info_t *md_info,
+                          const uint8_t *key,
+                          size_t key_len,
+                          oath_hmac_t *h) {
+    uint8_t pad[64], sum[32];
+    mbedtls_md_type_t type = mbedtls_md_get_type(md_info);
+    int r = 0;
+    if (key_len > sizeof(pad)) {
+        if ((r = mbedtls_md(md_info, key, key_len, sum)) != 0) {
+            return r;
         }
+        key = sum;
+        key_len = mbedtls_md_get_size(md_info);
     }
-    file_t *ef = find_oath_cred(name, name_len);
-    if (file_has_data(ef)) {
-        flash_write_data_to_file(ef, apdu.data, apdu.nc);
-        low_flash_available();
+    memset(pad, 0x36, sizeof(pad));
+    for (size_t i = 0; i < key_len; i++) {
+        pad[i] ^= key[i];
+    }
+    r = oath_sha_block(type, pad, h->inner);
+    for (size_t i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    if (r == 0) {
+        r = oath_sha_block(type, pad, h->outer);
+    }
+    mbedtls_platform_zeroize(pad, sizeof(pad));
+    mbedtls_platform_zeroize(sum, sizeof(sum));
+    return r;
+}
+
+// HMAC of a credential. The key states of stored ones (slot >= 0) are cached, so only the
+// challenge and the inner digest are hashed on repeated calculations. SHA-512 is not cached.
+static int oath_hmac(int slot,
+                     const mbedtls_md_info_t *md_info,
+                     const uint8_t *key,
+                     size_t key_len,
+                     const uint8_t *chal,
+                     size_t chal_len,
+                     uint8_t *hmac) {
+    mbedtls_md_type_t type = mbedtls_md_get_type(md_info);
+    if (type != MBEDTLS_MD_SHA1 && type != MBEDTLS_MD_SHA256) {
+        return mbedtls_md_hmac(md_info, key, key_len, chal, chal_len, hmac);
+    }
+    oath_hmac_t local, *h = NULL;
+    if (slot >= 0 && oath_hmac_entry[slot] != 0) {
+        h = &oath_hmac_cache[oath_hmac_entry[slot] - 1];
+    }
+#ifdef ENABLE_EMULATION
+    if (slot >= 0) {
+        *(h != NULL ? &oath_hmac_hits : &oath_hmac_misses) += 1;
+    }
+#endif
+    int r = 0;
+    if (h == NULL) {
+        if (slot < 0 || (h = oath_hmac_alloc(slot)) == NULL) {
+            h = &local;
+        }
+        if ((r = oath_hmac_pads(md_info, key, key_len, h)) != 0) {
+            if (h != &local) {
+                oath_hmac_invalidate(slot);
+            }
+            return r;
+        }
+    }
+    uint8_t inner[32];
+    r = oath_sha_resume(type, h->inner, chal, chal_len, inner);
+    if (r == 0) {
+        r = oath_sha_resume(type, h->outer, inner, mbedtls_md_get_size(md_info), hmac);
+    }
+    mbedtls_platform_zeroize(inner, sizeof(inner));
+    mbedtls_platform_zeroize(&local, sizeof(local));
+    return r;
+}
+
+// Truncated codes computed by CALCULATE_ALL for oath_totp_chal, one per slot
+static void oath_totp_invalidate(int slot) {
+    if (slot < 0) {
+        memset(oath_totp_valid, 0, sizeof(oath_totp_valid));
+    }
+    else {
+        oath_totp_valid[slot / 32] &= ~(1u << (slot % 32));
+    }
+}
+
+static const uint8_t *oath_totp_cached(int slot) {
+    return oath_totp_valid[slot / 32] & (1u << (slot % 32)) ? oath_totp_code[slot] : NULL;
+}
+
+static void oath_totp_store(int slot, const uint8_t *code) {
+    memcpy(oath_totp_code[slot], code, 4);
+    oath_totp_valid[slot / 32] |= 1u << (slot % 32);
+}
+
+// HOTP reservations of a slot, or of all of them if slot < 0, dropped when the record changes
+static void oath_hotp_invalidate(int slot) {
+    if (slot < 0) {
+        memset(oath_hotp_left, 0, sizeof(oath_hotp_left));
+        memset(oath_hotp_started, 0, sizeof(oath_hotp_started));
     }
     else {
-        for (int i = 0; i < MAX_OATH_CRED; i++) {
-            file_t *ef = search_dynamic_file(EF_OATH_CRED + i);
-            if (!file_has_data(ef)) {
-                ef = file_new(EF_OATH_CRED + i);
-                flash_write_data_to_file(ef, apdu.data, apdu.nc);
-                low_flash_available();
-                return SW_OK();
+        oath_hotp_left[slot] = 0;
+        oath_hotp_started[slot / 32] &= ~(1u << (slot % 32));
+    }
+}
+
+// FNV-1a, folded to the 16 bits kept per slot. Names are compared on a match anyway
+static uint16_t oath_name_hash(const uint8_t *name, size_t name_len) {
+    uint32_t h = 0x811c9dc5;
+    for (size_t i = 0; i < name_len; i++) {
+        h = (h ^ name[i]) * 0x01000193;
+    }
+    return (uint16_t) (h ^ (h >> 16));
+}
+
+static uint16_t oath_index_home(uint16_t h) {
+    return h & (OATH_INDEX_SIZE - 1);
+}
+
+static bool oath_slot_used(int slot) {
+    return oath_used[slot / 32] & (1u << (slot % 32));
+}
+
+static void oath_index_empty() {
+    memset(oath_used, 0, sizeof(oath_used));
+    memset(oath_index, 0, sizeof(oath_index));
+}
+
+static void oath_index_clear(int slot) {
+    if (oath_slot_used(slot) == false) {
+        return;
+    }
+    oath_used[slot / 32] &= ~(1u << (slot % 32));
+    uint16_t i = oath_index_home(oath_hashes[slot]);
+    while (oath_index[i] != slot + 1) {
+        i = (i + 1) & (OATH_INDEX_SIZE - 1);
+    }
+    // Backward-shift deletion, as in the dynamic file map
+    uint16_t j = i;
+    while (true) {
+        j = (j + 1) & (OATH_INDEX_SIZE - 1);
+        if (oath_index[j] == 0) {
+            break;
+        }
+        uint16_t h = oath_index_home(oath_hashes[oath_index[j] - 1]);
+        // Entry j stays if its home lies cyclically in (i, j]
+        if (i <= j ? (i < h && h <= j) : (i < h || h <= j)) {
+            continue;
+        }
+        oath_index[i] = oath_index[j];
+        i = j;
+    }
+    oath_index[i] = 0;
+}
+
+static void oath_index_set(int slot, const uint8_t *name, size_t name_len) {
+    oath_index_clear(slot);
+    oath_used[slot / 32] |= 1u << (slot % 32);
+    oath_hashes[slot] = oath_name_hash(name, name_len);
+    uint16_t i = oath_index_home(oath_hashes[slot]);
+    while (oath_index[i] != 0) {
+        i = (i + 1) & (OATH_INDEX_SIZE - 1);
+    }
+    oath_index[i] = slot + 1;
+}
+
+static size_t oath_rec_size(const oath_rec_t *rec) {
+    return sizeof(oath_rec_t) + rec->key_len + rec->name_len;
+}
+
+// Packs a PUT body into buf, which must hold sizeof(oath_rec_t) + MAX_OATH_RECORD bytes
+static bool oath_rec_build(const uint8_t *data, size_t len, uint8_t *buf) {
+    size_t name_len = 0, key_len = 0, imf_len = 0, prop_len = 0;
+    uint8_t *name = NULL, *key = NULL, *imf = NULL, *prop = NULL;
+    oath_rec_t *rec = (oath_rec_t *) buf;
+    if (asn1_find_tag(data, len, TAG_NAME, &name_len, &name) == false ||
+        asn1_find_tag(data, len, TAG_KEY, &key_len, &key) == false) {
+        return false;
+    }
+    if (key_len < 2 || key_len + name_len > MAX_OATH_RECORD || name_len > 0xff || key_len > 0xff) {
+        return false;
+    }
+    rec->name_len = name_len;
+    rec->key_len = key_len;
+    rec->prop = 0;
+    if (asn1_find_tag(data, len, TAG_PROPERTY, &prop_len, &prop) == true && prop_len > 0) {
+        rec->prop = prop[0];
+    }
+    memset(rec->imf, 0, sizeof(rec->imf));
+    if (asn1_find_tag(data, len, TAG_IMF, &imf_len, &imf) == true) {
+        if (imf_len > sizeof(rec->imf)) {
+            return false;
+        }
+        memcpy(rec->imf + sizeof(rec->imf) - imf_len, imf, imf_len); // zero-valued bytes prepended
+    }
+    memcpy(OATH_REC_KEY(rec), key, key_len);
+    memcpy(OATH_REC_NAME(rec), name, name_len);
+    return true;
+}
+
+// Record i of a pool file of n records, NULL if the slot is free or the record does not lie
+// within the file
+static const oath_rec_t *oath_pool_rec(file_t *ef, int i, int n) {
+    if (!file_has_data(ef) || file_get_size(ef) < 2 * n) {
+        return NULL;
+    }
+    const uint8_t *p = file_get_data(ef);
+    size_t size = file_get_size(ef);
+    uint16_t off = (p[2 * i] << 8) | p[2 * i + 1];
+    if (off < 2 * n || off + sizeof(oath_rec_t) > size) {
+        return NULL;
+    }
+    const oath_rec_t *rec = (const oath_rec_t *) (p + off);
+    if (off + oath_rec_size(rec) > size) {
+        return NULL;
+    }
+    return rec;
+}
+
+static const oath_rec_t *oath_rec_get(int slot) {
+    return oath_pool_rec(dyn_file_search(EF_OATH_POOL + slot / OATH_POOL_RECS), slot % OATH_POOL_RECS,
+                         OATH_POOL_RECS);
+}
+
+// Rewrites a pool with recs[i] as record i for every bit i of mask, NULL removing it. Flash is not
+// committed, and inside a transaction the write is staged. Returns the length written, 0 if deleted.
+static size_t oath_pool_update(int pool, const oath_rec_t *const recs[], uint8_t mask) {
+    static uint8_t buf[OATH_POOL_SIZE];
+    file_t *ef = dyn_file_search(EF_OATH_POOL + pool);
+    size_t len = 2 * OATH_POOL_RECS;
+    memset(buf, 0, 2 * OATH_POOL_RECS);
+    for (int i = 0; i < OATH_POOL_RECS; i++) {
+        const oath_rec_t *r = mask & (1u << i) ? recs[i] : oath_pool_rec(ef, i, OATH_POOL_RECS);
+        if (r != NULL) {
+            buf[2 * i] = len >> 8;
+            buf[2 * i + 1] = len & 0xff;
+            memcpy(buf + len, r, oath_rec_size(r));
+            len += oath_rec_size(r);
+        }
+    }
+    if (len == 2 * OATH_POOL_RECS) {
+        txn_delete(ef);
+        return 0;
+    }
+    txn_write_fid(EF_OATH_POOL + pool, buf, len);
+    return len;
+}
+
+// Rewrites the pool of slot with rec in it, or without it if rec is NULL
+static void oath_pool_write(int slot, const oath_rec_t *rec) {
+    const oath_rec_t *recs[OATH_POOL_RECS] = { NULL };
+    recs[slot % OATH_POOL_RECS] = rec;
+    oath_pool_update(slot / OATH_POOL_RECS, recs, 1u << (slot % OATH_POOL_RECS));
+}
+
+// Stores the moving factor of slot in its record. Flash is not committed.
+static void oath_counter_set(int slot, const oath_rec_t *rec, const uint8_t *imf) {
+    uint8_t buf[OATH_REC_MAX];
+    memcpy(buf, rec, oath_rec_size(rec));
+    memcpy(((oath_rec_t *) buf)->imf, imf, sizeof(rec->imf));
+    oath_pool_write(slot, (const oath_rec_t *) buf);
+}
+
+/*
+ * Next HOTP moving factor of slot. The record holds the first value not reserved yet.
+ * The first code after power-up reserves just its own value, so a power cycle that
+ * emits one code skips none. Later ones reserve OATH_HOTP_BLOCK values at once, so
+ * the pool is rewritten once per block and a power loss skips fewer than a block.
+ */
+static int oath_hotp_next(int slot, const oath_rec_t *rec, uint8_t *imf) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | rec->imf[i];
+    }
+    if (oath_hotp_left[slot] == 0) {
+        uint8_t n = oath_hotp_started[slot / 32] & (1u << (slot % 32)) ? OATH_HOTP_BLOCK : 1;
+        v += n;
+        for (int i = 7; i >= 0; i--) {
+            imf[i] = (uint8_t) (v >> (8 * (7 - i)));
+        }
+        txn_begin();
+        oath_counter_set(slot, rec, imf);
+        int ret = txn_commit();
+        if (ret != CCID_OK) {
+            return ret;
+        }
+        low_flash_available();
+        oath_hotp_left[slot] = n;
+        oath_hotp_started[slot / 32] |= 1u << (slot % 32);
+    }
+    v -= oath_hotp_left[slot]--;
+    for (int i = 7; i >= 0; i--) {
+        imf[i] = (uint8_t) (v >> (8 * (7 - i)));
+    }
+    return CCID_OK;
+}
+
+// Moving factor of a slot kept apart by earlier pools, NULL if it was not used since PUT
+static const uint8_t *oath_old_counter(uint16_t fid, int i, size_t size) {
+    file_t *ef = dyn_file_search(fid);
+    if (!file_has_data(ef) || file_get_size(ef) != size) {
+        return NULL;
+    }
+    const uint8_t *imf = file_get_data(ef) + 8 * i;
+    for (int j = 0; j < 8; j++) {
+        if (imf[j] != 0) {
+            return imf;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Moves credentials stored as one TLV file per slot, or in earlier pools of
+ * OATH_POOL4_RECS records with their counters apart, into the pools. Each pool is
+ * filled and its old files deleted in one transaction. A legacy record that cannot
+ * be rebuilt is kept, with its slot reserved, and the migration fails.
+ */
+static bool oath_migrate() {
+    static uint8_t buf[OATH_POOL_RECS * OATH_REC_MAX];
+    bool migrated = true;
+    for (int p = 0; p < OATH_POOLS; p++) {
+        const oath_rec_t *recs[OATH_POOL_RECS] = { NULL };
+        uint8_t mask = 0;
+        bool found = false;
+        for (int i = 0; i < OATH_POOL_RECS; i++) {
+            int slot = p * OATH_POOL_RECS + i;
+            file_t *ef_pool = dyn_file_search(EF_OATH_POOL4 + slot / OATH_POOL4_RECS);
+            file_t *ef = slot < OATH_LEGACY_CREDS ? dyn_file_search(EF_OATH_CRED + slot) : NULL;
+            const oath_rec_t *old = oath_pool_rec(ef_pool, slot % OATH_POOL4_RECS, OATH_POOL4_RECS);
+            oath_rec_t *rec = (oath_rec_t *) (buf + i * OATH_REC_MAX);
+            const uint8_t *imf = NULL;
+            if (ef_pool == NULL && ef == NULL) {
+                continue;
+            }
+            if (found == false) {
+                txn_begin();
+                found = true;
+            }
+            if (slot % OATH_POOL4_RECS == OATH_POOL4_RECS - 1) {
+                txn_delete(ef_pool);
+                txn_delete(dyn_file_search(EF_OATH_POOL4_IMF + slot / OATH_POOL4_RECS));
+            }
+            if (old != NULL) {
+                memcpy(rec, old, oath_rec_size(old));
+                imf = oath_old_counter(EF_OATH_POOL4_IMF + slot / OATH_POOL4_RECS,
+                                       slot % OATH_POOL4_RECS, 8 * OATH_POOL4_RECS);
+            }
+            else if (file_has_data(ef) && oath_rec_build(file_get_data(ef), file_get_size(ef), (uint8_t *) rec) == true) {
+                imf = oath_old_counter(EF_OATH_IMF + slot, 0, 8);
+            }
+            else if (file_has_data(ef) && oath_rec_get(slot) == NULL) {
+                oath_index_set(slot, NULL, 0);
+                migrated = false;
+                continue;
+            }
+            else {
+                rec = NULL;
+            }
+            if (rec != NULL) {
+                if (imf != NULL) {
+                    memcpy(rec->imf, imf, sizeof(rec->imf));
+                }
+                recs[i] = rec;
+                mask |= 1u << i;
+            }
+            if (ef != NULL) {
+                txn_delete(ef);
+                txn_delete(dyn_file_search(EF_OATH_IMF + slot));
             }
         }
+        if (found == true) {
+            if (mask != 0) {
+                oath_pool_update(p, recs, mask);
+            }
+            if (txn_commit() != CCID_OK) {
+                return false;
+            }
+        }
+    }
+    return migrated;
+}
+
+// Builds the slot bitmap and name index the first time they are needed
+static void oath_index_load() {
+    if (oath_indexed == true) {
+        return;
+    }
+    oath_index_empty();
+    oath_hmac_invalidate(-1);
+    oath_totp_invalidate(-1);
+    oath_hotp_invalidate(-1);
+    oath_migrating = oath_migrate() == false;
+    for (int p = 0; p < OATH_POOLS; p++) {
+        file_t *ef = dyn_file_search(EF_OATH_POOL + p);
+        for (int i = 0; i < OATH_POOL_RECS && file_has_data(ef); i++) {
+            const oath_rec_t *rec = oath_pool_rec(ef, i, OATH_POOL_RECS);
+            if (rec != NULL) {
+                oath_index_set(p * OATH_POOL_RECS + i, OATH_REC_NAME(rec), rec->name_len);
+            }
+        }
+    }
+    oath_indexed = true;
+}
+
+// A write tries an unfinished migration again, as the dynamic file table may have room by now
+static void oath_index_retry() {
+    if (oath_migrating == true) {
+        oath_indexed = false;
+    }
+    oath_index_load();
+}
+
+// The flash was formatted. The index is rebuilt and the caches dropped on next use
+void oath_index_reset() {
+    oath_indexed = false;
+}
+
+static int find_oath_slot(const uint8_t *name, size_t name_len) {
+    oath_index_load();
+    uint16_t h = oath_name_hash(name, name_len);
+    for (uint16_t i = oath_index_home(h); oath_index[i] != 0; i = (i + 1) & (OATH_INDEX_SIZE - 1)) {
+        int slot = oath_index[i] - 1;
+        if (oath_hashes[slot] == h) {
+            const oath_rec_t *rec = oath_rec_get(slot);
+            if (rec != NULL && rec->name_len == name_len &&
+                memcmp(OATH_REC_NAME(rec), name, name_len) == 0) {
+                return slot;
+            }
+        }
+    }
+    return -1;
+}
+
+// First slot clear in a used bitmap, -1 if there is none
+static int oath_bitmap_free(const uint32_t *used) {
+    for (int i = 0; i < (MAX_OATH_CRED + 31) / 32; i++) {
+        if (used[i] != 0xffffffff) {
+            int slot = i * 32 + __builtin_ctz(~used[i]);
+            return slot < MAX_OATH_CRED ? slot : -1;
+        }
+    }
+    return -1;
+}
+
+static int find_oath_free_slot() {
+    oath_index_load();
+    return oath_bitmap_free(oath_used);
+}
+
+// Writes a packed credential, with the moving factor it was given
+static int oath_put_store(const oath_rec_t *rec) {
+    int slot = find_oath_slot(OATH_REC_NAME(rec), rec->name_len);
+    if (slot < 0 && (slot = find_oath_free_slot()) < 0) {
         return SW_FILE_FULL();
     }
+    txn_begin();
+    oath_pool_write(slot, rec);
+    if (txn_commit() != CCID_OK) {
+        return SW_EXEC_ERROR();
+    }
+    rec = oath_rec_get(slot);
+    oath_index_set(slot, OATH_REC_NAME(rec), rec->name_len);
+    oath_hmac_invalidate(slot);
+    oath_totp_invalidate(slot);
+    oath_hotp_invalidate(slot);
     return SW_OK();
 }
 
+int cmd_put() {
+    if (fido_ctx->oath.validated == false) {
+        return SW_SECURITY_STATUS_NOT_SATISFIED();
+    }
+    uint8_t buf[sizeof(oath_rec_t) + MAX_OATH_RECORD];
+    if (oath_rec_build(apdu.data, apdu.nc, buf) == false) {
+        return SW_INCORRECT_PARAMS();
+    }
+    oath_index_retry();
+    return oath_put_store((const oath_rec_t *) buf);
+}
+
+// Next record of a batch PUT: TAG_RECORD with a 1, 2 or 3-byte length
+static const uint8_t *oath_next_record(const uint8_t **p, const uint8_t *end, size_t *len) {
+    const uint8_t *q = *p;
+    if (end - q < 2 || *q++ != TAG_RECORD) {
+        return NULL;
+    }
+    if (*q < 0x80) {
+        *len = *q++;
+    }
+    else if (*q == 0x81 && end - q >= 2) {
+        *len = q[1];
+        q += 2;
+    }
+    else if (*q == 0x82 && end - q >= 3) {
+        *len = (q[1] << 8) | q[2];
+        q += 3;
+    }
+    else {
+        return NULL;
+    }
+    if (*len > end - q) {
+        return NULL;
+    }
+    *p = q + *len;
+    return q;
+}
+
+// Record of a batch PUT after validation
+typedef struct oath_batch_rec {
+    const oath_rec_t *rec;
+    uint16_t slot;
+} oath_batch_rec_t;
+
+/*
+ * Stores several credentials, each one wrapped in TAG_RECORD. All of them are validated
+ * and packed first, then every pool they touch is rewritten once in a single transaction,
+ * so either the whole batch is stored or nothing is. The pools must fit in TXN_MAX_SIZE
+ * together, some 60 credentials with short keys and names; a larger batch is refused.
+ */
+int cmd_put_batch() {
+    if (fido_ctx->oath.validated == false) {
+        return SW_SECURITY_STATUS_NOT_SATISFIED();
+    }
+    const uint8_t *p = apdu.data, *end = apdu.data + apdu.nc, *tlv = NULL;
+    size_t tlv_len = 0, n = 0, max_recs = apdu.nc / 8 + 1; // A valid record takes 8 bytes at least
+    uint32_t used[(MAX_OATH_CRED + 31) / 32];
+    // A packed record is never more than twice as long as its TLV
+    uint8_t *packed = (uint8_t *) calloc(1, 2 * apdu.nc + 1), *q = packed;
+    oath_batch_rec_t *recs = (oath_batch_rec_t *) calloc(max_recs, sizeof(oath_batch_rec_t));
+    int ret = 0;
+    if (packed == NULL || recs == NULL) {
+        ret = SW_MEMORY_FAILURE();
+        goto err;
+    }
+    oath_index_retry();
+    memcpy(used, oath_used, sizeof(used));
+    while (p < end) {
+        if ((tlv = oath_next_record(&p, end, &tlv_len)) == NULL) {
+            ret = SW_WRONG_DATA();
+            goto err;
+        }
+        if (tlv_len > MAX_OATH_RECORD) {
+            ret = SW_WRONG_LENGTH();
+            goto err;
+        }
+        if (oath_rec_build(tlv, tlv_len, q) == false) {
+            ret = SW_INCORRECT_PARAMS();
+            goto err;
+        }
+        const oath_rec_t *rec = (const oath_rec_t *) q;
+        int slot = find_oath_slot(OATH_REC_NAME(rec), rec->name_len);
+        for (size_t i = 0; i < n && slot < 0; i++) { // Repeated within the batch, the last one wins
+            if (recs[i].rec->name_len == rec->name_len &&
+                memcmp(OATH_REC_NAME(recs[i].rec), OATH_REC_NAME(rec), rec->name_len) == 0) {
+                slot = recs[i].slot;
+            }
+        }
+        if (slot < 0) {
+            if ((slot = oath_bitmap_free(used)) < 0) {
+                ret = SW_FILE_FULL();
+                goto err;
+            }
+            used[slot / 32] |= 1u << (slot % 32);
+        }
+        recs[n].rec = rec;
+        recs[n++].slot = slot;
+        q += oath_rec_size(rec);
+    }
+    size_t staged = TXN_DIGEST_SIZE;
+    txn_begin();
+    for (size_t i = 0; i < n; i++) {
+        int pool = recs[i].slot / OATH_POOL_RECS;
+        const oath_rec_t *pool_recs[OATH_POOL_RECS] = { NULL };
+        uint8_t mask = 0;
+        bool written = false;
+        for (size_t j = 0; j < n && written == false; j++) {
+            if (recs[j].slot / OATH_POOL_RECS == pool) {
+                if (j < i) {
+                    written = true;
+                }
+                pool_recs[recs[j].slot % OATH_POOL_RECS] = recs[j].rec;
+                mask |= 1u << (recs[j].slot % OATH_POOL_RECS);
+            }
+        }
+        if (written == false) {
+            staged += 4 + oath_pool_update(pool, pool_recs, mask);
+        }
+    }
+    if (staged > TXN_MAX_SIZE) {
+        txn_abort();
+        ret = SW_WRONG_LENGTH();
+        goto err;
+    }
+    if (txn_commit() != CCID_OK) {
+        ret = SW_EXEC_ERROR();
+        goto err;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const oath_rec_t *rec = oath_rec_get(recs[i].slot);
+        if (rec != NULL) {
+            oath_index_set(recs[i].slot, OATH_REC_NAME(rec), rec->name_len);
+        }
+        oath_hmac_invalidate(recs[i].slot);
+        oath_totp_invalidate(recs[i].slot);
+        oath_hotp_invalidate(recs[i].slot);
+    }
+    ret = SW_OK();
+
+err:
+    free(packed);
+    free(recs);
+    return ret;
+}
 
 int cmd_delete() {
     size_t tag_len = 0;
     uint8_t *tag_data = NULL;
-    if (validated == false) {
+    if (fido_ctx->oath.validated == false) {
         return SW_SECURITY_STATUS_NOT_SATISFIED();
     }
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_NAME, &tag_len, &tag_data) == true) {
-        file_t *ef = find_oath_cred(tag_data, tag_len);
-        if (ef) {
-            delete_file(ef);
+        oath_index_retry();
+        int slot = find_oath_slot(tag_data, tag_len);
+        if (slot >= 0) {
+            txn_begin();
+            oath_pool_write(slot, NULL);
+            if (txn_commit() != CCID_OK) {
+                return SW_EXEC_ERROR();
+            }
+            oath_index_clear(slot);
+            oath_hmac_invalidate(slot);
+            oath_totp_invalidate(slot);
+            oath_hotp_invalidate(slot);
             return SW_OK();
         }
         return SW_DATA_INVALID();
@@ -196,12 +945,15 @@ const mbedtls_md_info_t *get_oath_md_info(uint8_t alg) {
 }
 
 int cmd_set_code() {
-    if (validated == false) {
+    if (fido_ctx->oath.validated == false) {
         return SW_SECURITY_STATUS_NOT_SATISFIED();
     }
+    oath_hmac_invalidate(-1);
+    oath_totp_invalidate(-1);
     if (apdu.nc == 0) {
-        delete_file(search_dynamic_file(EF_OATH_CODE));
-        validated = true;
+        txn_delete(dyn_file_search(EF_OATH_CODE));
+        low_flash_available();
+        fido_ctx->oath.validated = true;
         return SW_OK();
     }
     size_t key_len = 0, chal_len = 0, resp_len = 0;
@@ -210,8 +962,9 @@ int cmd_set_code() {
         return SW_INCORRECT_PARAMS();
     }
     if (key_len == 0) {
-        delete_file(search_dynamic_file(EF_OATH_CODE));
-        validated = true;
+        txn_delete(dyn_file_search(EF_OATH_CODE));
+        low_flash_available();
+        fido_ctx->oath.validated = true;
         return SW_OK();
     }
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_CHALLENGE, &chal_len, &chal) == false) {
@@ -233,11 +986,10 @@ int cmd_set_code() {
     if (memcmp(hmac, resp, resp_len) != 0) {
         return SW_DATA_INVALID();
     }
-    random_gen(NULL, challenge, sizeof(challenge));
-    file_t *ef = file_new(EF_OATH_CODE);
-    flash_write_data_to_file(ef, key, key_len);
+    random_gen(NULL, fido_ctx->oath.challenge, sizeof(fido_ctx->oath.challenge));
+    txn_write_fid(EF_OATH_CODE, key, key_len);
     low_flash_available();
-    validated = false;
+    fido_ctx->oath.validated = false;
     return SW_OK();
 }
 
@@ -245,54 +997,58 @@ int cmd_reset() {
     if (P1(apdu) != 0xde || P2(apdu) != 0xad) {
         return SW_INCORRECT_P1P2();
     }
-    for (int i = 0; i < MAX_OATH_CRED; i++) {
-        file_t *ef = search_dynamic_file(EF_OATH_CRED + i);
-        if (file_has_data(ef)) {
-            delete_file(ef);
-        }
+    oath_index_load();
+    // One delete per stored file, which the dynamic file table bounds well within a transaction
+    txn_begin();
+    for (int p = 0; p < OATH_POOLS; p++) {
+        txn_delete(dyn_file_search(EF_OATH_POOL + p));
+    }
+    // Records left behind by a failed migration
+    for (int p = 0; p < OATH_POOL4_FILES; p++) {
+        txn_delete(dyn_file_search(EF_OATH_POOL4 + p));
+        txn_delete(dyn_file_search(EF_OATH_POOL4_IMF + p));
+    }
+    for (int i = 0; i < OATH_LEGACY_CREDS; i++) {
+        txn_delete(dyn_file_search(EF_OATH_CRED + i));
+        txn_delete(dyn_file_search(EF_OATH_IMF + i));
+    }
+    txn_delete(dyn_file_search(EF_OATH_CODE));
+    int ret = txn_commit();
+    oath_hmac_invalidate(-1);
+    oath_totp_invalidate(-1);
+    oath_hotp_invalidate(-1);
+    if (ret != CCID_OK) {
+        oath_index_reset();
+        return SW_EXEC_ERROR();
     }
-    delete_file(search_dynamic_file(EF_OATH_CODE));
-    validated = true;
+    oath_index_empty();
+    oath_migrating = false;
+    fido_ctx->oath.validated = true;
+    fido_ctx->oath.more_ins = 0;
     return SW_OK();
 }
 
 int cmd_list() {
-    size_t name_len = 0, key_len = 0;
-    uint8_t *name = NULL, *key = NULL;
-    if (validated == false) {
+    if (fido_ctx->oath.validated == false) {
         return SW_SECURITY_STATUS_NOT_SATISFIED();
     }
-    for (int i = 0; i < MAX_OATH_CRED; i++) {
-        file_t *ef = search_dynamic_file(EF_OATH_CRED + i);
-        if (file_has_data(ef)) {
-            uint8_t *data = file_get_data(ef);
-            size_t data_len = file_get_size(ef);
-            if (asn1_find_tag(data, data_len, TAG_NAME, &name_len,
-                              &name) == true &&
-                asn1_find_tag(data, data_len, TAG_KEY, &key_len, &key) == true) {
-                res_APDU[res_APDU_size++] = TAG_NAME_LIST;
-                res_APDU[res_APDU_size++] = name_len + 1;
-                res_APDU[res_APDU_size++] = key[0];
-                memcpy(res_APDU + res_APDU_size, name, name_len); res_APDU_size += name_len;
-            }
-        }
-    }
-    apdu.ne = res_APDU_size;
-    return SW_OK();
+    fido_ctx->oath.more_ins = INS_LIST;
+    return oath_send_entries(0);
 }
 
 int cmd_validate() {
     size_t chal_len = 0, resp_len = 0, key_len = 0;
     uint8_t *chal = NULL, *resp = NULL, *key = NULL;
+    oath_totp_invalidate(-1);
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_CHALLENGE, &chal_len, &chal) == false) {
         return SW_INCORRECT_PARAMS();
     }
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_RESPONSE, &resp_len, &resp) == false) {
         return SW_INCORRECT_PARAMS();
     }
-    file_t *ef = search_dynamic_file(EF_OATH_CODE);
+    file_t *ef = dyn_file_search(EF_OATH_CODE);
     if (file_has_data(ef) == false) {
-        validated = true;
+        fido_ctx->oath.validated = true;
         return SW_DATA_INVALID();
     }
     key = file_get_data(ef);
@@ -302,7 +1058,7 @@ int cmd_validate() {
         return SW_INCORRECT_PARAMS();
     }
     uint8_t hmac[64];
-    int ret = mbedtls_md_hmac(md_info, key + 1, key_len - 1, challenge, sizeof(challenge), hmac);
+    int ret = mbedtls_md_hmac(md_info, key + 1, key_len - 1, fido_ctx->oath.challenge, sizeof(fido_ctx->oath.challenge), hmac);
     if (ret != 0) {
         return SW_EXEC_ERROR();
     }
@@ -313,7 +1069,7 @@ int cmd_validate() {
     if (ret != 0) {
         return SW_EXEC_ERROR();
     }
-    validated = true;
+    fido_ctx->oath.validated = true;
     res_APDU[res_APDU_size++] = TAG_RESPONSE;
     res_APDU[res_APDU_size++] = mbedtls_md_get_size(md_info);
     memcpy(res_APDU + res_APDU_size, hmac, mbedtls_md_get_size(md_info));
@@ -322,17 +1078,18 @@ int cmd_validate() {
     return SW_OK();
 }
 
-int calculate_oath(uint8_t truncate,
-                   const uint8_t *key,
-                   size_t key_len,
-                   const uint8_t *chal,
-                   size_t chal_len) {
+static int calculate_oath_slot(int slot,
+                               uint8_t truncate,
+                               const uint8_t *key,
+                               size_t key_len,
+                               const uint8_t *chal,
+                               size_t chal_len) {
     const mbedtls_md_info_t *md_info = get_oath_md_info(key[0]);
     if (md_info == NULL) {
         return SW_INCORRECT_PARAMS();
     }
     uint8_t hmac[64];
-    int r = mbedtls_md_hmac(md_info, key + 2, key_len - 2, chal, chal_len, hmac);
+    int r = oath_hmac(slot, md_info, key + 2, key_len - 2, chal, chal_len, hmac);
     size_t hmac_size = mbedtls_md_get_size(md_info);
     if (r != 0) {
         return CCID_EXEC_ERROR;
@@ -355,13 +1112,21 @@ int calculate_oath(uint8_t truncate,
     return CCID_OK;
 }
 
+int calculate_oath(uint8_t truncate,
+                   const uint8_t *key,
+                   size_t key_len,
+                   const uint8_t *chal,
+                   size_t chal_len) {
+    return calculate_oath_slot(-1, truncate, key, key_len, chal, chal_len);
+}
+
 int cmd_calculate() {
-    size_t chal_len = 0, name_len = 0, key_len = 0;
-    uint8_t *chal = NULL, *name = NULL, *key = NULL;
+    size_t chal_len = 0, name_len = 0;
+    uint8_t *chal = NULL, *name = NULL;
     if (P2(apdu) != 0x0 && P2(apdu) != 0x1) {
         return SW_INCORRECT_P1P2();
     }
-    if (validated == false) {
+    if (fido_ctx->oath.validated == false) {
         return SW_SECURITY_STATUS_NOT_SATISFIED();
     }
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_CHALLENGE, &chal_len, &chal) == false) {
@@ -370,127 +1135,162 @@ int cmd_calculate() {
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_NAME, &name_len, &name) == false) {
         return SW_INCORRECT_PARAMS();
     }
-    file_t *ef = find_oath_cred(name, name_len);
-    if (file_has_data(ef) == false) {
+    int slot = find_oath_slot(name, name_len);
+    const oath_rec_t *rec = slot >= 0 ? oath_rec_get(slot) : NULL;
+    if (rec == NULL) {
         return SW_DATA_INVALID();
     }
-
-    if (asn1_find_tag(file_get_data(ef), file_get_size(ef), TAG_KEY, &key_len, &key) == false) {
-        return SW_INCORRECT_PARAMS();
-    }
+    const uint8_t *key = OATH_REC_KEY(rec);
+    uint8_t imf[8];
+    size_t key_len = rec->key_len;
 
     if ((key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-        if (asn1_find_tag(file_get_data(ef), file_get_size(ef), TAG_IMF, &chal_len,
-                          &chal) == false) {
-            return SW_INCORRECT_PARAMS();
+        if (oath_hotp_next(slot, rec, imf) != CCID_OK) {
+            return SW_EXEC_ERROR();
         }
+        // The pool may have been rewritten
+        rec = oath_rec_get(slot);
+        key = OATH_REC_KEY(rec);
+        chal = imf;
+        chal_len = sizeof(imf);
     }
 
     res_APDU[res_APDU_size++] = TAG_RESPONSE + P2(apdu);
 
-    int ret = calculate_oath(P2(apdu), key, key_len, chal, chal_len);
+    int ret = calculate_oath_slot(slot, P2(apdu), key, key_len, chal, chal_len);
     if (ret != CCID_OK) {
         return SW_EXEC_ERROR();
     }
+    apdu.ne = res_APDU_size;
+    return SW_OK();
+}
+
+// Size of the LIST or CALCULATE_ALL entry of a credential
+static size_t oath_entry_size(const oath_rec_t *rec) {
+    const uint8_t *key = OATH_REC_KEY(rec);
+    if (fido_ctx->oath.more_ins == INS_LIST) {
+        return 2 + 1 + rec->name_len;
+    }
+    if ((key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP || (rec->prop & PROP_TOUCH)) {
+        return 2 + rec->name_len + 3;
+    }
+    const mbedtls_md_info_t *md_info = get_oath_md_info(key[0]);
+    if (md_info == NULL) {
+        return 2 + rec->name_len + 3;
+    }
+    return 2 + rec->name_len + 3 + (fido_ctx->oath.more_p2 == 0x01 ? 4 : mbedtls_md_get_size(md_info));
+}
+
+static void oath_write_entry(int slot, const oath_rec_t *rec) {
+    const uint8_t *key = OATH_REC_KEY(rec), *name = OATH_REC_NAME(rec);
+    if (fido_ctx->oath.more_ins == INS_LIST) {
+        res_APDU[res_APDU_size++] = TAG_NAME_LIST;
+        res_APDU[res_APDU_size++] = rec->name_len + 1;
+        res_APDU[res_APDU_size++] = key[0];
+        memcpy(res_APDU + res_APDU_size, name, rec->name_len); res_APDU_size += rec->name_len;
+        return;
+    }
+    res_APDU[res_APDU_size++] = TAG_NAME;
+    res_APDU[res_APDU_size++] = rec->name_len;
+    memcpy(res_APDU + res_APDU_size, name, rec->name_len); res_APDU_size += rec->name_len;
     if ((key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-        uint64_t v =
-            ((uint64_t) chal[0] <<
-                56) |
-            ((uint64_t) chal[1] <<
-                48) |
-            ((uint64_t) chal[2] <<
-                40) |
-            ((uint64_t) chal[3] <<
-                32) |
-            ((uint64_t) chal[4] <<
-                24) | ((uint64_t) chal[5] << 16) | ((uint64_t) chal[6] << 8) | (uint64_t) chal[7];
-        size_t ef_size = file_get_size(ef);
-        v++;
-        uint8_t *tmp = (uint8_t *) calloc(1, ef_size);
-        memcpy(tmp, file_get_data(ef), ef_size);
-        asn1_find_tag(tmp, ef_size, TAG_IMF, &chal_len, &chal);
-        chal[0] = v >> 56;
-        chal[1] = v >> 48;
-        chal[2] = v >> 40;
-        chal[3] = v >> 32;
-        chal[4] = v >> 24;
-        chal[5] = v >> 16;
-        chal[6] = v >> 8;
-        chal[7] = v & 0xff;
-        flash_write_data_to_file(ef, tmp, ef_size);
-        low_flash_available();
-        free(tmp);
+        res_APDU[res_APDU_size++] = TAG_NO_RESPONSE;
+        res_APDU[res_APDU_size++] = 1;
+        res_APDU[res_APDU_size++] = key[1];
+    }
+    else if (rec->prop & PROP_TOUCH) {
+        res_APDU[res_APDU_size++] = TAG_TOUCH_RESPONSE;
+        res_APDU[res_APDU_size++] = 1;
+        res_APDU[res_APDU_size++] = key[1];
+    }
+    else {
+        res_APDU[res_APDU_size++] = TAG_RESPONSE + fido_ctx->oath.more_p2;
+        const uint8_t *code = fido_ctx->oath.more_p2 == 0x01 ? oath_totp_cached(slot) : NULL;
+        if (code != NULL) {
+            res_APDU[res_APDU_size++] = 4 + 1;
+            res_APDU[res_APDU_size++] = key[1];
+            memcpy(res_APDU + res_APDU_size, code, 4); res_APDU_size += 4;
+            return;
+        }
+        int ret = calculate_oath_slot(slot, fido_ctx->oath.more_p2, key, rec->key_len,
+                                      fido_ctx->oath.more_chal, fido_ctx->oath.more_chal_len);
+        if (ret != CCID_OK) {
+            res_APDU[res_APDU_size++] = 1;
+            res_APDU[res_APDU_size++] = key[1];
+        }
+        else if (fido_ctx->oath.more_p2 == 0x01) {
+            oath_totp_store(slot, res_APDU + res_APDU_size - 4);
+        }
+    }
+}
+
+// Writes LIST or CALCULATE_ALL entries from slot on. When the response is full,
+// the cursor is kept and 61xx tells how many bytes SEND_REMAINING will return.
+static int oath_send_entries(uint16_t slot) {
+    size_t max = apdu.ne > 0 ? MIN(apdu.ne, MAX_OATH_RESPONSE) : 256;
+    oath_index_load();
+    for (int i = slot; i < MAX_OATH_CRED; i++) {
+        const oath_rec_t *rec = oath_slot_used(i) ? oath_rec_get(i) : NULL;
+        if (rec == NULL) {
+            continue;
+        }
+        size_t entry = oath_entry_size(rec);
+        if (res_APDU_size > 0 && res_APDU_size + entry > max) {
+            size_t remaining = 0;
+            fido_ctx->oath.more_slot = i;
+            for (; i < MAX_OATH_CRED; i++) {
+                rec = oath_slot_used(i) ? oath_rec_get(i) : NULL;
+                if (rec != NULL) {
+                    remaining += oath_entry_size(rec);
+                }
+            }
+            apdu.ne = res_APDU_size;
+            return set_res_sw(0x61, remaining > 0xff ? 0x00 : (uint8_t) remaining);
+        }
+        oath_write_entry(i, rec);
     }
+    fido_ctx->oath.more_ins = 0;
     apdu.ne = res_APDU_size;
     return SW_OK();
 }
 
 int cmd_calculate_all() {
-    size_t chal_len = 0, name_len = 0, key_len = 0, prop_len = 0;
-    uint8_t *chal = NULL, *name = NULL, *key = NULL, *prop = NULL;
+    size_t chal_len = 0;
+    uint8_t *chal = NULL;
     if (P2(apdu) != 0x0 && P2(apdu) != 0x1) {
         return SW_INCORRECT_P1P2();
     }
-    if (validated == false) {
+    if (fido_ctx->oath.validated == false) {
         return SW_SECURITY_STATUS_NOT_SATISFIED();
     }
     if (asn1_find_tag(apdu.data, apdu.nc, TAG_CHALLENGE, &chal_len, &chal) == false) {
         return SW_INCORRECT_PARAMS();
     }
-    for (int i = 0; i < MAX_OATH_CRED; i++) {
-        file_t *ef = search_dynamic_file(EF_OATH_CRED + i);
-        if (file_has_data(ef)) {
-            const uint8_t *ef_data = file_get_data(ef);
-            size_t ef_len = file_get_size(ef);
-            if (asn1_find_tag(ef_data, ef_len, TAG_NAME, &name_len,
-                              &name) == false ||
-                asn1_find_tag(ef_data, ef_len, TAG_KEY, &key_len, &key) == false) {
-                continue;
-            }
-            res_APDU[res_APDU_size++] = TAG_NAME;
-            res_APDU[res_APDU_size++] = name_len;
-            memcpy(res_APDU + res_APDU_size, name, name_len); res_APDU_size += name_len;
-            if ((key[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-                res_APDU[res_APDU_size++] = TAG_NO_RESPONSE;
-                res_APDU[res_APDU_size++] = 1;
-                res_APDU[res_APDU_size++] = key[1];
-            }
-            else if (asn1_find_tag(ef_data, ef_len, TAG_PROPERTY, &prop_len,
-                                   &prop) == true && (prop[0] & PROP_TOUCH)) {
-                res_APDU[res_APDU_size++] = TAG_TOUCH_RESPONSE;
-                res_APDU[res_APDU_size++] = 1;
-                res_APDU[res_APDU_size++] = key[1];
-            }
-            else {
-                res_APDU[res_APDU_size++] = TAG_RESPONSE + P2(apdu);
-                int ret = calculate_oath(P2(apdu), key, key_len, chal, chal_len);
-                if (ret != CCID_OK) {
-                    res_APDU[res_APDU_size++] = 1;
-                    res_APDU[res_APDU_size++] = key[1];
-                }
-            }
-        }
+    if (chal_len > sizeof(fido_ctx->oath.more_chal)) {
+        return SW_WRONG_LENGTH();
     }
-    apdu.ne = res_APDU_size;
-    return SW_OK();
+    memcpy(fido_ctx->oath.more_chal, chal, chal_len);
+    fido_ctx->oath.more_chal_len = chal_len;
+    if (chal_len != oath_totp_chal_len || memcmp(chal, oath_totp_chal, chal_len) != 0) {
+        oath_totp_invalidate(-1);
+        memcpy(oath_totp_chal, chal, chal_len);
+        oath_totp_chal_len = chal_len;
+    }
+    fido_ctx->oath.more_p2 = P2(apdu);
+    fido_ctx->oath.more_ins = INS_CALC_ALL;
+    return oath_send_entries(0);
 }
 
 int cmd_send_remaining() {
-    return SW_OK();
+    if (fido_ctx->oath.more_ins == 0) {
+        return SW_OK();
+    }
+    return oath_send_entries(fido_ctx->oath.more_slot);
 }
 
-#define INS_PUT             0x01
-#define INS_DELETE          0x02
-#define INS_SET_CODE        0x03
-#define INS_RESET           0x04
-#define INS_LIST            0xa1
-#define INS_CALCULATE       0xa2
-#define INS_VALIDATE        0xa3
-#define INS_CALC_ALL        0xa4
-#define INS_SEND_REMAINING  0xa5
-
 static const cmd_t cmds[] = {
     { INS_PUT, cmd_put },
+    { INS_PUT_BATCH, cmd_put_batch },
     { INS_DELETE, cmd_delete },
     { INS_SET_CODE, cmd_set_code },
     { INS_RESET, cmd_reset },
@@ -501,16 +1301,24 @@ static const cmd_t cmds[] = {
     { INS_SEND_REMAINING, cmd_send_remaining },
     { 0x00, 0x0 }
 };
+DISPATCH_CHECK_CMDS(cmds);
+
+static dispatch_table_t table = {
+    .id = DISPATCH_TABLE_OATH,
+    .ok = 0x9000,
+    .cmds = cmds,
+};
 
 int oath_process_apdu() {
     if (CLA(apdu) != 0x00) {
         return SW_CLA_NOT_SUPPORTED();
     }
-    for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-        if (cmd->ins == INS(apdu)) {
-            int r = cmd->cmd_handler();
-            return r;
-        }
+    if (INS(apdu) != INS_SEND_REMAINING) {
+        fido_ctx->oath.more_ins = 0;
+    }
+    int r = dispatch_apdu(&table);
+    if (r == DISPATCH_NOT_FOUND) {
+        return SW_INS_NOT_SUPPORTED();
     }
-    return SW_INS_NOT_SUPPORTED();
+    return r;
 }
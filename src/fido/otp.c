@@ -16,24 +16,24 @@
  */
 
 #include "fido.h"
+#include "context.h"
+#include "otp.h"
 #include "hsm.h"
 #include "apdu.h"
 #include "files.h"
 #include "random.h"
 #include "version.h"
 #include "asn1.h"
+#include "dispatch.h"
 #include "hid/ctap_hid.h"
+#include "keyboard.h"
+#include "txn.h"
 #ifndef ENABLE_EMULATION
 #include "bsp/board.h"
+#include "pico/mutex.h"
 #endif
 #include "mbedtls/aes.h"
 
-#define FIXED_SIZE          16
-#define KEY_SIZE            16
-#define UID_SIZE            6
-#define KEY_SIZE_OATH       20
-#define ACC_CODE_SIZE       6
-
 #define CONFIG1_VALID       0x01
 #define CONFIG2_VALID       0x02
 #define CONFIG1_TOUCH       0x04
@@ -87,23 +87,33 @@
 #define OATH_FIXED_MASK     0x50    // Mask to get out fixed flags
 #define CFGFLAG_UPDATE_MASK (PACING_10MS | PACING_20MS)
 
+#define OTP_COUNTER_MAX     0x7fff
+#define OTP_COUNTER_BLOCK   16      // Usage counters reserved at once when a session wraps
+#define OTP_HOTP_BLOCK      8       // HOTP values reserved at once, within a validator look-ahead of 10
+
 static uint8_t config_seq = { 1 };
 
-typedef struct otp_config {
-    uint8_t fixed_data[FIXED_SIZE];
-    uint8_t uid[UID_SIZE];
-    uint8_t aes_key[KEY_SIZE];
-    uint8_t acc_code[ACC_CODE_SIZE];
-    uint8_t fixed_size;
-    uint8_t ext_flags;
-    uint8_t tkt_flags;
-    uint8_t cfg_flags;
-    uint8_t rfu[2];
-    uint16_t crc;
-} __attribute__((packed)) otp_config_t;
+// Slots as parsed from flash. They follow the flash rather than a session, so they are global
+static bool otp_loaded = false;     // otp_slots reflects EF_OTP_SLOT1 and EF_OTP_SLOT2
+static otp_slot_t otp_slots[2];
+
+// A button press on core0 and OTP APDUs on core1 hold it while they use otp_slots, which
+// cmd_otp() parses again, freeing the expanded keys, after each change. Core1 may hold it
+// while it waits for the flash task on core0, so core0 only tries it and skips the press
+#ifndef ENABLE_EMULATION
+auto_init_mutex(otp_mutex);
+#define OTP_LOCK()      mutex_enter_blocking(&otp_mutex)
+#define OTP_TRY_LOCK()  mutex_try_enter(&otp_mutex, NULL)
+#define OTP_UNLOCK()    mutex_exit(&otp_mutex)
+#else
+#define OTP_LOCK()
+#define OTP_TRY_LOCK()  true
+#define OTP_UNLOCK()
+#endif
 
 static const size_t otp_config_size = sizeof(otp_config_t);
 uint16_t otp_status();
+static otp_slot_t *otp_slot(int i);
 
 int otp_process_apdu();
 int otp_unload();
@@ -118,14 +128,11 @@ app_t *otp_select(app_t *a, const uint8_t *aid, uint8_t aid_len) {
         a->aid = otp_aid;
         a->process_apdu = otp_process_apdu;
         a->unload = otp_unload;
-        if (file_has_data(search_dynamic_file(EF_OTP_SLOT1)) ||
-            file_has_data(search_dynamic_file(EF_OTP_SLOT2))) {
-            config_seq = 1;
-        }
-        else {
-            config_seq = 0;
-        }
+        OTP_LOCK();
         otp_status();
+        config_seq = otp_slot(0) || otp_slot(1) ? 1 : 0;
+        OTP_UNLOCK();
+        res_APDU[4] = config_seq;
         memmove(res_APDU, res_APDU + 1, 6);
         res_APDU_size = 6;
         apdu.ne = res_APDU_size;
@@ -144,26 +151,123 @@ int encode_modhex(const uint8_t *in, size_t len, uint8_t *out) {
 }
 static bool scanned = false;
 extern void scan_all();
+
+static uint64_t otp_get_imf(const uint8_t *p) {
+    return ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48) | ((uint64_t) p[2] << 40) |
+           ((uint64_t) p[3] << 32) | ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16) |
+           ((uint64_t) p[6] << 8) | (uint64_t) p[7];
+}
+
+// Parses both slots once, so a button press needs neither flash lookups nor key expansion
+static void otp_load() {
+    for (int i = 0; i < 2; i++) {
+        otp_slot_t *s = &otp_slots[i];
+        if (s->configured == true) {
+            mbedtls_aes_free(&s->aes);
+        }
+        memset(s, 0, sizeof(otp_slot_t));
+        file_t *ef = dyn_file_search(EF_OTP_SLOT1 + i);
+        if (!file_has_data(ef) || file_get_size(ef) < otp_config_size) {
+            continue;
+        }
+        const uint8_t *data = file_get_data(ef);
+        memcpy(&s->config, data, otp_config_size);
+        if (file_get_size(ef) >= otp_config_size + 8) {
+            s->ceiling = (data[otp_config_size] << 8) | data[otp_config_size + 1];
+            s->imf = otp_get_imf(data + otp_config_size);
+        }
+        file_t *ef_ctr = dyn_file_search(EF_OTP_CTR1 + i);
+        if (file_has_data(ef_ctr) && file_get_size(ef_ctr) == 2) {
+            s->ceiling = (file_get_data(ef_ctr)[0] << 8) | file_get_data(ef_ctr)[1];
+        }
+        // The moving factor is kept apart, so the slot is not rewritten on each press
+        file_t *ef_imf = dyn_file_search(EF_OTP_IMF1 + i);
+        if (file_has_data(ef_imf) && file_get_size(ef_imf) == 8) {
+            s->imf = otp_get_imf(file_get_data(ef_imf));
+        }
+        if (s->imf == 0) {
+            s->imf = ((s->config.uid[4] << 8) | s->config.uid[5]) << 4;
+        }
+        s->imf_ceiling = s->imf;
+        s->hotp_key[0] = 0x01;
+        memcpy(s->hotp_key + 2, s->config.aes_key, KEY_SIZE);
+        mbedtls_aes_init(&s->aes);
+        mbedtls_aes_setkey_enc(&s->aes, s->config.aes_key, 128);
+        s->configured = true;
+    }
+    otp_loaded = true;
+}
+
+static otp_slot_t *otp_slot(int i) {
+    if (otp_loaded == false) {
+        otp_load();
+    }
+    return otp_slots[i].configured ? &otp_slots[i] : NULL;
+}
+
+// The flash was formatted. The slots are parsed again on next use
+void otp_slots_reset() {
+    otp_loaded = false;
+}
+
+#ifndef ENABLE_EMULATION
+// Persists the usage counter ceiling of a slot
+static void otp_reserve(int i, uint16_t ceiling) {
+    uint8_t data[2] = { ceiling >> 8, ceiling & 0xff };
+    otp_slots[i].ceiling = ceiling;
+    txn_write_fid(EF_OTP_CTR1 + i, data, sizeof(data));
+    low_flash_available();
+}
+
+// The first OTP after power-up takes the counter past the stored ceiling and reserves
+// just that value, so a power cycle that emits nothing writes nothing.
+static void otp_counter_start(int i) {
+    otp_slot_t *s = &otp_slots[i];
+    if (s->reserved == false) {
+        s->counter = MIN(s->ceiling + 1, OTP_COUNTER_MAX);
+        if (s->counter > s->ceiling) {
+            otp_reserve(i, s->counter);
+        }
+        s->reserved = true;
+    }
+}
+
+// Called when the session counter wraps. Flash is written once per OTP_COUNTER_BLOCK values.
+static void otp_counter_advance(int i) {
+    otp_slot_t *s = &otp_slots[i];
+    if (s->counter < OTP_COUNTER_MAX) {
+        s->counter++;
+        if (s->counter > s->ceiling) {
+            otp_reserve(i, MIN(s->counter + OTP_COUNTER_BLOCK - 1, OTP_COUNTER_MAX));
+        }
+    }
+}
+
+// Reserves the HOTP moving factor of the next code. As with the usage counter, the first
+// code after power-up reserves just its own value and later ones OTP_HOTP_BLOCK at once,
+// so EF_OTP_IMF is written once per block and a power loss skips fewer than a block.
+static int otp_hotp_reserve(int i) {
+    otp_slot_t *s = &otp_slots[i];
+    if (s->imf < s->imf_ceiling) {
+        return CCID_OK;
+    }
+    uint64_t c = s->imf + (s->imf_reserved ? OTP_HOTP_BLOCK : 1);
+    uint8_t data[8] = { c >> 56, c >> 48, c >> 40, c >> 32, c >> 24, c >> 16, c >> 8, c & 0xff };
+    int ret = txn_write_fid(EF_OTP_IMF1 + i, data, sizeof(data));
+    if (ret != CCID_OK) {
+        return ret;
+    }
+    low_flash_available();
+    s->imf_ceiling = c;
+    s->imf_reserved = true;
+    return CCID_OK;
+}
+#endif
+
 void init_otp() {
     if (scanned == false) {
         scan_all();
-        for (int i = 0; i < 2; i++) {
-            file_t *ef = search_dynamic_file(EF_OTP_SLOT1 + i);
-            uint8_t *data = file_get_data(ef);
-            otp_config_t *otp_config = (otp_config_t *)data;
-            if (file_has_data(ef) && !(otp_config->tkt_flags & OATH_HOTP) && !(otp_config->cfg_flags & SHORT_TICKET || otp_config->cfg_flags & STATIC_TICKET)) {
-                uint16_t counter = (data[otp_config_size] << 8) | data[otp_config_size + 1];
-                if (++counter <= 0x7fff) {
-                    uint8_t new_data[otp_config_size + 8];
-                    memcpy(new_data, data, sizeof(new_data));
-                    new_data[otp_config_size] = counter >> 8;
-                    new_data[otp_config_size + 1] = counter & 0xff;
-                    flash_write_data_to_file(ef, new_data, sizeof(new_data));
-                }
-            }
-        }
         scanned = true;
-        low_flash_available();
     }
 }
 extern int calculate_oath(uint8_t truncate,
@@ -173,82 +277,63 @@ extern int calculate_oath(uint8_t truncate,
                           size_t chal_len);
 #ifndef ENABLE_EMULATION
 static uint8_t session_counter[2] = {0};
+
+// Intra-key pacing requested by the slot, in ms
+static uint8_t otp_pacing(const otp_config_t *otp_config) {
+    return (otp_config->cfg_flags & PACING_10MS ? 10 : 0) + (otp_config->cfg_flags & PACING_20MS ? 20 : 0);
+}
 #endif
-int otp_button_pressed(uint8_t slot) {
-    init_otp();
+static int otp_press(uint8_t slot) {
 #ifndef ENABLE_EMULATION
-    file_t *ef = search_dynamic_file(slot == 1 ? EF_OTP_SLOT1 : EF_OTP_SLOT2);
-    const uint8_t *data = file_get_data(ef);
-    otp_config_t *otp_config = (otp_config_t *)data;
-    if (file_has_data(ef) == false) {
+    otp_slot_t *s = otp_slot(slot - 1);
+    if (s == NULL) {
         return 1;
     }
+    const otp_config_t *otp_config = &s->config;
     if (otp_config->cfg_flags & CHAL_YUBICO && otp_config->tkt_flags & CHAL_RESP) {
         return 2;
     }
     if (otp_config->tkt_flags & OATH_HOTP) {
-        uint8_t tmp_key[KEY_SIZE + 2];
-        tmp_key[0] = 0x01;
-        memcpy(tmp_key + 2, otp_config->aes_key, KEY_SIZE);
-        uint64_t imf = 0;
-        const uint8_t *p = data + otp_config_size;
-        imf |= (uint64_t)*p++ << 56;
-        imf |= (uint64_t)*p++ << 48;
-        imf |= (uint64_t)*p++ << 40;
-        imf |= (uint64_t)*p++ << 32;
-        imf |= *p++ << 24;
-        imf |= *p++ << 16;
-        imf |= *p++ << 8;
-        imf |= *p++;
-        if (imf == 0) {
-            imf = ((otp_config->uid[4] << 8) | otp_config->uid[5]) << 4;
+        if (otp_hotp_reserve(slot - 1) != CCID_OK) {
+            return 1;
         }
+        uint64_t imf = s->imf++;
         uint8_t chal[8] = {imf >> 56, imf >> 48, imf >> 40, imf >> 32, imf >> 24, imf >> 16, imf >> 8, imf & 0xff};
         res_APDU_size = 0;
-        int ret = calculate_oath(1, tmp_key, sizeof(tmp_key), chal, sizeof(chal));
+        int ret = calculate_oath(1, s->hotp_key, sizeof(s->hotp_key), chal, sizeof(chal));
         if (ret == CCID_OK) {
             uint32_t base = otp_config->cfg_flags & OATH_HOTP8 ? 1e8 : 1e6;
             uint32_t number = (res_APDU[2] << 24) | (res_APDU[3] << 16) | (res_APDU[4] << 8) | res_APDU[5];
             number %= base;
-            char number_str[9];
-            if (otp_config->cfg_flags & OATH_HOTP8) {
-                sprintf(number_str, "%08lu", (long unsigned int)number);
-                add_keyboard_buffer((const uint8_t *)number_str, 8, true);
+            char number_str[10];
+            size_t digits = otp_config->cfg_flags & OATH_HOTP8 ? 8 : 6;
+            sprintf(number_str, "%0*lu", (int)digits, (long unsigned int)number);
+            if (otp_config->tkt_flags & APPEND_CR) {
+                number_str[digits++] = '\r';
             }
-            else {
-                sprintf(number_str, "%06lu", (long unsigned int)number);
-                add_keyboard_buffer((const uint8_t *)number_str, 6, true);
+            if (kbd_type((const uint8_t *)number_str, digits, true, otp_pacing(otp_config)) == false) {
+                return 1;
             }
-            imf++;
-            uint8_t new_chal[8] = {imf >> 56, imf >> 48, imf >> 40, imf >> 32, imf >> 24, imf >> 16, imf >> 8, imf & 0xff};
-            uint8_t new_otp_config[otp_config_size + sizeof(new_chal)];
-            memcpy(new_otp_config, otp_config, otp_config_size);
-            memcpy(new_otp_config + otp_config_size, new_chal, sizeof(new_chal));
-            flash_write_data_to_file(ef, new_otp_config, sizeof(new_otp_config));
-            low_flash_available();
-        }
-        if (otp_config->tkt_flags & APPEND_CR) {
-            append_keyboard_buffer((const uint8_t *)"\r", 1);
         }
     }
     else if (otp_config->cfg_flags & SHORT_TICKET || otp_config->cfg_flags & STATIC_TICKET) {
+        uint8_t ticket[FIXED_SIZE + 1], fixed_size = MIN(otp_config->fixed_size, FIXED_SIZE);
         if (otp_config->cfg_flags & SHORT_TICKET) {
-            otp_config->fixed_size /= 2;
+            fixed_size /= 2;
         }
-        add_keyboard_buffer(otp_config->fixed_data, otp_config->fixed_size, false);
+        memcpy(ticket, otp_config->fixed_data, fixed_size);
         if (otp_config->tkt_flags & APPEND_CR) {
-            append_keyboard_buffer((const uint8_t *)"\x28", 1);
+            ticket[fixed_size++] = 0x28;
+        }
+        if (kbd_type(ticket, fixed_size, false, otp_pacing(otp_config)) == false) {
+            return 1;
         }
     }
     else {
         uint8_t otpk[22], *po = otpk;
-        bool update_counter = false;
-        uint16_t counter = (data[otp_config_size] << 8) | data[otp_config_size + 1], crc = 0;
+        otp_counter_start(slot - 1);
+        uint16_t counter = s->counter, crc = 0;
         uint32_t ts = board_millis() / 1000;
-        if (counter == 0) {
-            update_counter = true;
-            counter = 1;
-        }
         memcpy(po, otp_config->fixed_data, 6);
         po += 6;
         memcpy(po, otp_config->uid, UID_SIZE);
@@ -265,36 +350,42 @@ int otp_button_pressed(uint8_t slot) {
         crc = calculate_crc(otpk + 6, 14);
         *po++ = ~crc & 0xff;
         *po++ = ~crc >> 8;
-        mbedtls_aes_context ctx;
-        mbedtls_aes_init(&ctx);
-        mbedtls_aes_setkey_enc(&ctx, otp_config->aes_key, 128);
-        mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, otpk + 6, otpk + 6);
-        mbedtls_aes_free(&ctx);
-        uint8_t otp_out[44];
+        mbedtls_aes_crypt_ecb(&s->aes, MBEDTLS_AES_ENCRYPT, otpk + 6, otpk + 6);
+        uint8_t otp_out[44 + 1];
+        size_t otp_len = 44;
         encode_modhex(otpk, sizeof(otpk), otp_out);
-        add_keyboard_buffer((const uint8_t *)otp_out, sizeof(otp_out), true);
         if (otp_config->tkt_flags & APPEND_CR) {
-            append_keyboard_buffer((const uint8_t *)"\r", 1);
+            otp_out[otp_len++] = '\r';
+        }
+        // Still typing an earlier output. Nothing was typed, so the session counter stays
+        if (kbd_type(otp_out, otp_len, true, otp_pacing(otp_config)) == false) {
+            return 1;
         }
 
         if (++session_counter[slot - 1] == 0) {
-            if (++counter <= 0x7fff) {
-                update_counter = true;
-            }
-        }
-        if (update_counter == true) {
-            uint8_t new_data[otp_config_size + 8];
-            memcpy(new_data, data, sizeof(new_data));
-            new_data[otp_config_size] = counter >> 8;
-            new_data[otp_config_size + 1] = counter & 0xff;
-            flash_write_data_to_file(ef, new_data, sizeof(new_data));
-            low_flash_available();
+            otp_counter_advance(slot - 1);
         }
     }
 #endif
     return 0;
 }
 
+int otp_button_pressed(uint8_t slot) {
+    init_otp();
+    if (OTP_TRY_LOCK() == false) {
+        return 1;
+    }
+    // Counters are reserved before a code is typed, so a press that cannot write is skipped
+    if (txn_try_lock() == false) {
+        OTP_UNLOCK();
+        return 1;
+    }
+    int ret = otp_press(slot);
+    txn_unlock();
+    OTP_UNLOCK();
+    return ret;
+}
+
 void __attribute__((constructor)) otp_ctor() {
     register_app(otp_select);
     button_pressed_cb = otp_button_pressed;
@@ -315,10 +406,8 @@ uint16_t otp_status() {
     res_APDU[3] = 0;
     res_APDU[4] = config_seq;
     res_APDU[5] = (CONFIG2_TOUCH | CONFIG1_TOUCH) |
-                                (file_has_data(search_dynamic_file(EF_OTP_SLOT1)) ? CONFIG1_VALID :
-                                 0x00) |
-                                (file_has_data(search_dynamic_file(EF_OTP_SLOT2)) ? CONFIG2_VALID :
-                                 0x00);
+                                (otp_slot(0) ? CONFIG1_VALID : 0x00) |
+                                (otp_slot(1) ? CONFIG2_VALID : 0x00);
     res_APDU[6] = 0;
     return SW_OK();
 }
@@ -330,6 +419,30 @@ bool check_crc(const otp_config_t *data) {
 
 extern int man_get_config();
 
+// Stages the exchange of two files. Both are looked up by FID, as deleting a file moves the others
+static void otp_swap_files(uint16_t fid1, uint16_t fid2) {
+    uint8_t tmp[sizeof(otp_config_t) + 8];
+    size_t tmp_len = 0;
+    file_t *ef = dyn_file_search(fid1);
+    if (file_has_data(ef)) {
+        tmp_len = MIN(file_get_size(ef), sizeof(tmp));
+        memcpy(tmp, file_get_data(ef), tmp_len);
+    }
+    ef = dyn_file_search(fid2);
+    if (file_has_data(ef)) {
+        txn_write_fid(fid1, file_get_data(ef), file_get_size(ef));
+    }
+    else {
+        txn_delete(dyn_file_search(fid1));
+    }
+    if (tmp_len > 0) {
+        txn_write_fid(fid2, tmp, tmp_len);
+    }
+    else {
+        txn_delete(dyn_file_search(fid2));
+    }
+}
+
 int cmd_otp() {
     uint8_t p1 = P1(apdu), p2 = P2(apdu);
     if (p2 != 0x00) {
@@ -340,7 +453,8 @@ int cmd_otp() {
         if (odata->rfu[0] != 0 || odata->rfu[1] != 0 || check_crc(odata) == false) {
             return SW_WRONG_DATA();
         }
-        file_t *ef = file_new(p1 == 0x01 ? EF_OTP_SLOT1 : EF_OTP_SLOT2);
+        uint16_t fid = p1 == 0x01 ? EF_OTP_SLOT1 : EF_OTP_SLOT2;
+        file_t *ef = dyn_file_search(fid);
         if (file_has_data(ef)) {
             otp_config_t *otpc = (otp_config_t *) file_get_data(ef);
             if (memcmp(otpc->acc_code, apdu.data + otp_config_size, ACC_CODE_SIZE) != 0) {
@@ -350,16 +464,31 @@ int cmd_otp() {
         for (int c = 0; c < otp_config_size; c++) {
             if (apdu.data[c] != 0) {
                 memset(apdu.data + otp_config_size, 0, 8); // Add 8 bytes extra
-                flash_write_data_to_file(ef, apdu.data, otp_config_size + 8);
-                low_flash_available();
+                // The counters of the old configuration go with it
+                txn_begin();
+                txn_write_fid(fid, apdu.data, otp_config_size + 8);
+                txn_delete(dyn_file_search(p1 == 0x01 ? EF_OTP_IMF1 : EF_OTP_IMF2));
+                txn_delete(dyn_file_search(p1 == 0x01 ? EF_OTP_CTR1 : EF_OTP_CTR2));
+                if (txn_commit() != CCID_OK) {
+                    otp_load();
+                    return SW_EXEC_ERROR();
+                }
+                otp_load();
                 config_seq++;
                 return otp_status();
             }
         }
         // Delete slot
-        delete_file(ef);
-        if (!file_has_data(search_dynamic_file(EF_OTP_SLOT1)) &&
-            !file_has_data(search_dynamic_file(EF_OTP_SLOT2))) {
+        txn_begin();
+        txn_delete(ef);
+        txn_delete(dyn_file_search(p1 == 0x01 ? EF_OTP_IMF1 : EF_OTP_IMF2));
+        txn_delete(dyn_file_search(p1 == 0x01 ? EF_OTP_CTR1 : EF_OTP_CTR2));
+        if (txn_commit() != CCID_OK) {
+            otp_load();
+            return SW_EXEC_ERROR();
+        }
+        otp_load();
+        if (!otp_slot(0) && !otp_slot(1)) {
             config_seq = 0;
         }
         return otp_status();
@@ -369,7 +498,7 @@ int cmd_otp() {
         if (odata->rfu[0] != 0 || odata->rfu[1] != 0 || check_crc(odata) == false) {
             return SW_WRONG_DATA();
         }
-        file_t *ef = search_dynamic_file(p1 == 0x04 ? EF_OTP_SLOT1 : EF_OTP_SLOT2);
+        file_t *ef = dyn_file_search(p1 == 0x04 ? EF_OTP_SLOT1 : EF_OTP_SLOT2);
         if (file_has_data(ef)) {
             otp_config_t *otpc = (otp_config_t *) file_get_data(ef);
             if (memcmp(otpc->acc_code, apdu.data + otp_config_size, ACC_CODE_SIZE) != 0) {
@@ -380,32 +509,21 @@ int cmd_otp() {
             odata->ext_flags = (otpc->ext_flags & ~EXTFLAG_UPDATE_MASK) | (odata->ext_flags & EXTFLAG_UPDATE_MASK);
             odata->tkt_flags = (otpc->tkt_flags & ~TKTFLAG_UPDATE_MASK) | (odata->tkt_flags & TKTFLAG_UPDATE_MASK);
             odata->cfg_flags = (otpc->cfg_flags & ~CFGFLAG_UPDATE_MASK) | (odata->cfg_flags & CFGFLAG_UPDATE_MASK);
-            flash_write_data_to_file(ef, apdu.data, otp_config_size);
+            txn_write(ef, apdu.data, otp_config_size);
             low_flash_available();
+            otp_load();
         }
     }
     else if (p1 == 0x06) {
-        uint8_t tmp[otp_config_size + 8];
-        bool ef1_data = false;
-        file_t *ef1 = file_new(EF_OTP_SLOT1);
-        file_t *ef2 = file_new(EF_OTP_SLOT2);
-        if (file_has_data(ef1)) {
-            memcpy(tmp, file_get_data(ef1), file_get_size(ef1));
-            ef1_data = true;
-        }
-        if (file_has_data(ef2)) {
-            flash_write_data_to_file(ef1, file_get_data(ef2), file_get_size(ef2));
-        }
-        else {
-            delete_file(ef1);
-        }
-        if (ef1_data) {
-            flash_write_data_to_file(ef2, tmp, sizeof(tmp));
+        txn_begin();
+        otp_swap_files(EF_OTP_SLOT1, EF_OTP_SLOT2);
+        otp_swap_files(EF_OTP_IMF1, EF_OTP_IMF2);
+        otp_swap_files(EF_OTP_CTR1, EF_OTP_CTR2);
+        if (txn_commit() != CCID_OK) {
+            otp_load();
+            return SW_EXEC_ERROR();
         }
-        else {
-            delete_file(ef2);
-        }
-        low_flash_available();
+        otp_load();
     }
     else if (p1 == 0x10) {
 #ifndef ENABLE_EMULATION
@@ -417,9 +535,9 @@ int cmd_otp() {
         man_get_config();
     }
     else if (p1 == 0x30 || p1 == 0x38 || p1 == 0x20 || p1 == 0x28) {
-        file_t *ef = search_dynamic_file(p1 == 0x30 || p1 == 0x20 ? EF_OTP_SLOT1 : EF_OTP_SLOT2);
-        if (file_has_data(ef)) {
-            otp_config_t *otp_config = (otp_config_t *)file_get_data(ef);
+        otp_slot_t *s = otp_slot(p1 == 0x30 || p1 == 0x20 ? 0 : 1);
+        if (s != NULL) {
+            const otp_config_t *otp_config = &s->config;
             if (!(otp_config->cfg_flags & CHAL_YUBICO && otp_config->tkt_flags & CHAL_RESP)) {
                 return SW_WRONG_DATA();
             }
@@ -436,11 +554,7 @@ int cmd_otp() {
 #ifndef ENABLE_EMULATION
                 pico_get_unique_board_id_string((char *) challenge + 6, 10);
 #endif
-                mbedtls_aes_context ctx;
-                mbedtls_aes_init(&ctx);
-                mbedtls_aes_setkey_enc(&ctx, otp_config->aes_key, 128);
-                ret = mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, challenge, res_APDU);
-                mbedtls_aes_free(&ctx);
+                ret = mbedtls_aes_crypt_ecb(&s->aes, MBEDTLS_AES_ENCRYPT, challenge, res_APDU);
                 if (ret == 0) {
                     res_APDU_size = 16;
                 }
@@ -456,16 +570,23 @@ static const cmd_t cmds[] = {
     { INS_OTP, cmd_otp },
     { 0x00, 0x0 }
 };
+DISPATCH_CHECK_CMDS(cmds);
+
+static dispatch_table_t table = {
+    .id = DISPATCH_TABLE_OTP,
+    .ok = 0x9000,
+    .cmds = cmds,
+};
 
 int otp_process_apdu() {
     if (CLA(apdu) != 0x00) {
         return SW_CLA_NOT_SUPPORTED();
     }
-    for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
-        if (cmd->ins == INS(apdu)) {
-            int r = cmd->cmd_handler();
-            return r;
-        }
+    OTP_LOCK();
+    int r = dispatch_apdu(&table);
+    OTP_UNLOCK();
+    if (r == DISPATCH_NOT_FOUND) {
+        return SW_INS_NOT_SUPPORTED();
     }
-    return SW_INS_NOT_SUPPORTED();
+    return r;
 }
@@ -0,0 +1,58 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OTP_H_
+#define _OTP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mbedtls/aes.h"
+
+#define FIXED_SIZE          16
+#define KEY_SIZE            16
+#define UID_SIZE            6
+#define KEY_SIZE_OATH       20
+#define ACC_CODE_SIZE       6
+
+typedef struct otp_config {
+    uint8_t fixed_data[FIXED_SIZE];
+    uint8_t uid[UID_SIZE];
+    uint8_t aes_key[KEY_SIZE];
+    uint8_t acc_code[ACC_CODE_SIZE];
+    uint8_t fixed_size;
+    uint8_t ext_flags;
+    uint8_t tkt_flags;
+    uint8_t cfg_flags;
+    uint8_t rfu[2];
+    uint16_t crc;
+} __attribute__((packed)) otp_config_t;
+
+// Slot configuration as used on a button press, parsed from EF_OTP_SLOT1 or EF_OTP_SLOT2
+typedef struct otp_slot {
+    bool configured;
+    otp_config_t config;
+    uint16_t counter;               // Yubico OTP usage counter
+    uint16_t ceiling;               // Highest usage counter that may have been emitted
+    bool reserved;                  // counter is reserved for this power cycle
+    uint64_t imf;                   // HOTP moving factor
+    uint64_t imf_ceiling;           // First HOTP moving factor not reserved in EF_OTP_IMF
+    bool imf_reserved;              // A HOTP value was reserved in this power cycle
+    uint8_t hotp_key[KEY_SIZE + 2]; // aes_key as an OATH HMAC-SHA1 key
+    mbedtls_aes_context aes;        // Expanded aes_key
+} otp_slot_t;
+
+#endif //_OTP_H_
@@ -0,0 +1,102 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#if ENABLE_CBOR_TRACE
+
+#include <string.h>
+#include <stdbool.h>
+#ifdef ENABLE_EMULATION
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
+/*
+ * Single producer ring: entries are only recorded from the thread running the
+ * commands. head is published after the entry is written, so a reader only
+ * sees complete entries. There is one ring per device, not per context.
+ */
+static trace_entry_t ring[TRACE_MAX_ENTRIES];
+static volatile uint32_t head = 0, tail = 0;
+
+void trace_record(const char *file, uint16_t line, int32_t error) {
+    uint32_t h = head;
+    trace_entry_t *e = &ring[h & (TRACE_MAX_ENTRIES - 1)];
+    e->file = file;
+    e->line = line;
+    e->error = error;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t trace_read(trace_entry_t *entries, uint8_t max) {
+    uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE), t = tail;
+    if (h - t > TRACE_MAX_ENTRIES) {
+        t = h - TRACE_MAX_ENTRIES;
+    }
+    if (h - t > max) {
+        t = h - max;
+    }
+    uint8_t n = 0;
+    for (; t != h; t++) {
+        entries[n++] = ring[t & (TRACE_MAX_ENTRIES - 1)];
+    }
+    return n;
+}
+
+uint32_t trace_total() {
+    return head - tail;
+}
+
+void trace_clear() {
+    tail = head;
+}
+
+const char *trace_basename(const char *file) {
+    const char *s = strrchr(file, '/');
+    return s ? s + 1 : file;
+}
+
+#ifdef ENABLE_EMULATION
+void trace_flush() {
+    static FILE *fp = NULL;
+    static uint32_t flushed = 0;
+    static bool opened = false;
+    if (opened == false) {
+        const char *path = getenv("PICO_FIDO_TRACE_FILE");
+        if (path) {
+            fp = fopen(path, "a");
+        }
+        opened = true;
+    }
+    uint32_t h = head;
+    if (fp == NULL || flushed == h) {
+        return;
+    }
+    if (h - flushed > TRACE_MAX_ENTRIES) {
+        fprintf(fp, "# %u entries lost\n", h - flushed - TRACE_MAX_ENTRIES);
+        flushed = h - TRACE_MAX_ENTRIES;
+    }
+    for (; flushed != h; flushed++) {
+        const trace_entry_t *e = &ring[flushed & (TRACE_MAX_ENTRIES - 1)];
+        fprintf(fp, "%s:%u %d\n", trace_basename(e->file), e->line, e->error);
+    }
+    fflush(fp);
+}
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#ifndef ENABLE_CBOR_TRACE
+#define ENABLE_CBOR_TRACE 0
+#endif
+
+#define TRACE_MAX_ENTRIES   32      // Must be a power of 2
+
+typedef struct trace_entry {
+    const char *file;               // __FILE__, lives in flash
+    uint16_t line;
+    int32_t error;
+} trace_entry_t;
+
+#if ENABLE_CBOR_TRACE
+
+#define TRACE_ERROR(e) trace_record(__FILE__, __LINE__, (e))
+
+extern void trace_record(const char *file, uint16_t line, int32_t error);
+/* Copies up to max entries, oldest first. Returns the number of entries copied. */
+extern uint8_t trace_read(trace_entry_t *entries, uint8_t max);
+/* Total number of entries recorded since boot or last clear, including overwritten ones. */
+extern uint32_t trace_total();
+extern void trace_clear();
+/* Returns the file name without path. */
+extern const char *trace_basename(const char *file);
+#ifdef ENABLE_EMULATION
+/* Appends new entries to the file set in PICO_FIDO_TRACE_FILE, if any. */
+extern void trace_flush();
+#endif
+
+#else
+
+#define TRACE_ERROR(e) do { } while (0)
+
+#endif
+
+#endif //_TRACE_H_
@@ -0,0 +1,357 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fido.h"
+#include "hsm.h"
+#include "files.h"
+#include "txn.h"
+#include "wear.h"
+#include "idle.h"
+#include "mbedtls/sha256.h"
+
+#define TXN_DELETE          0xffff  // Record length of a delete
+
+// Journal records are fid (2) | length (2) | data, followed by a truncated SHA-256 of them
+
+#ifndef ENABLE_EMULATION
+#include "pico/mutex.h"
+extern void wait_flash_finish();
+#endif
+
+/*
+ * State of the EF_TXN journal in flash. It is global on purpose, as the journal
+ * is: a pending one must be settled before any context writes. A journal is
+ * only dropped once the writes it describes are known to be in flash.
+ */
+#define TXN_JOURNAL_NONE    0
+#define TXN_JOURNAL_APPLIED 1   // Replayed at boot, not yet known to be programmed
+#define TXN_JOURNAL_PENDING 2   // Its records could not all be applied
+
+static uint8_t txn_journal = TXN_JOURNAL_NONE;
+
+// Staged transaction. Global as well: all writers share one flash and one journal
+static struct {
+    uint8_t depth;
+    bool failed;                // A record did not fit or an inner transaction aborted, the commit is refused
+    uint16_t records;
+    size_t len;
+    uint8_t buf[TXN_MAX_SIZE];
+} txn;
+
+/*
+ * Owned by the core that writes, from the outermost txn_begin() to its commit or abort
+ * and around each write-through, so a button press on core0 cannot write into an open
+ * transaction of core1. It is recursive, as commits and write-throughs nest writes of
+ * their own. Core1 holds it while it waits for the flash task on core0, so core0 only
+ * takes it with txn_try_lock().
+ */
+#ifndef ENABLE_EMULATION
+auto_init_recursive_mutex(txn_mutex);
+#define TXN_LOCK()      recursive_mutex_enter_blocking(&txn_mutex)
+#define TXN_TRY_LOCK()  recursive_mutex_try_enter(&txn_mutex, NULL)
+#define TXN_UNLOCK()    recursive_mutex_exit(&txn_mutex)
+#else
+#define TXN_LOCK()
+#define TXN_TRY_LOCK()  true
+#define TXN_UNLOCK()
+#endif
+
+/*
+ * Hands the pending pages to the flash task and waits until they are programmed.
+ * In emulation low_flash_available() writes them through by itself.
+ */
+static void txn_flush() {
+    low_flash_available();
+#ifndef ENABLE_EMULATION
+    wait_flash_finish();
+#endif
+}
+
+static file_t *txn_file(uint16_t fid, bool create) {
+    file_t *ef = search_by_fid(fid, NULL, SPECIFY_EF);
+    if (ef == NULL) {
+        ef = dyn_file_search(fid);
+    }
+    if (ef == NULL && create == true) {
+        ef = dyn_file_new(fid);
+    }
+    return ef;
+}
+
+// Stops at the first record that cannot be applied
+static int txn_apply(const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len;
+    while (end - p >= 4) {
+        uint16_t fid = (p[0] << 8) | p[1], n = (p[2] << 8) | p[3];
+        p += 4;
+        if (n == TXN_DELETE) {
+            file_t *ef = txn_file(fid, false);
+            if (ef != NULL && dyn_file_delete(ef) != CCID_OK) {
+                return CCID_ERR_FILE_NOT_FOUND;
+            }
+            continue;
+        }
+        if (n > end - p) {
+            return CCID_ERR_MEMORY_FATAL;
+        }
+        file_t *ef = txn_file(fid, true);
+        if (ef == NULL || flash_write_data_to_file(ef, n > 0 ? p : NULL, n) != CCID_OK) {
+            return CCID_ERR_NO_MEMORY;
+        }
+        wear_write(fid, n);
+        p += n;
+    }
+    return CCID_OK;
+}
+
+static void txn_journal_drop() {
+    file_t *ef = dyn_file_search(EF_TXN);
+    if (ef != NULL) {
+        dyn_file_delete(ef);
+    }
+    low_flash_available();
+    txn_journal = TXN_JOURNAL_NONE;
+}
+
+/*
+ * Finishes a journal left by an interrupted or failed commit before anything else
+ * is written, so it cannot later replay over newer data. Uses the staging buffer,
+ * which must be empty.
+ */
+static int txn_settle() {
+    if (txn_journal == TXN_JOURNAL_PENDING) {
+        file_t *ef = dyn_file_search(EF_TXN);
+        size_t len = ef != NULL ? file_get_size(ef) : 0;
+        if (len <= TXN_DIGEST_SIZE || len > sizeof(txn.buf)) {
+            txn_journal_drop();
+            return CCID_OK;
+        }
+        memcpy(txn.buf, file_get_data(ef), len);
+        int ret = txn_apply(txn.buf, len - TXN_DIGEST_SIZE);
+        if (ret != CCID_OK) {
+            return ret;
+        }
+    }
+    else if (txn_journal == TXN_JOURNAL_NONE) {
+        return CCID_OK;
+    }
+    txn_flush();
+    txn_journal_drop();
+    return CCID_OK;
+}
+
+static int txn_stage(uint16_t fid, const uint8_t *data, uint16_t len) {
+    size_t n = len == TXN_DELETE ? 0 : len;
+    if (txn.len + 4 + n + TXN_DIGEST_SIZE > sizeof(txn.buf)) {
+        txn.failed = true;
+        return CCID_ERR_NO_MEMORY;
+    }
+    uint8_t *p = txn.buf + txn.len;
+    *p++ = fid >> 8;
+    *p++ = fid & 0xff;
+    *p++ = len >> 8;
+    *p++ = len & 0xff;
+    if (n > 0) {
+        memcpy(p, data, n);
+    }
+    txn.len += 4 + n;
+    txn.records++;
+    return CCID_OK;
+}
+
+static void txn_reset() {
+    txn.len = 0;
+    txn.records = 0;
+    txn.failed = false;
+}
+
+void txn_begin() {
+    TXN_LOCK();
+    if (txn.depth++ == 0) {
+        txn_reset();
+        txn.failed = txn_settle() != CCID_OK;
+    }
+}
+
+static int txn_write_through(uint16_t fid, const uint8_t *data, uint16_t len) {
+    int ret = txn_settle();
+    if (ret != CCID_OK) {
+        return ret;
+    }
+    file_t *ef = txn_file(fid, true);
+    if (ef == NULL) {
+        return CCID_ERR_NO_MEMORY;
+    }
+    wear_write(fid, len);
+    ret = flash_write_data_to_file(ef, data, len);
+    wear_sync();
+    return ret;
+}
+
+int txn_write_fid(uint16_t fid, const uint8_t *data, uint16_t len) {
+    TXN_LOCK();
+    int ret = txn.depth == 0 ? txn_write_through(fid, data, len) : txn_stage(fid, data, len);
+    TXN_UNLOCK();
+    return ret;
+}
+
+int txn_write(file_t *ef, const uint8_t *data, uint16_t len) {
+    if (ef == NULL) {
+        return CCID_ERR_FILE_NOT_FOUND;
+    }
+    return txn_write_fid(ef->fid, data, len);
+}
+
+int txn_delete(file_t *ef) {
+    if (ef == NULL) {
+        return CCID_OK;
+    }
+    TXN_LOCK();
+    int ret = txn.depth == 0 ? txn_settle() : txn_stage(ef->fid, NULL, TXN_DELETE);
+    if (txn.depth == 0 && ret == CCID_OK) {
+        ret = dyn_file_delete(ef);
+        wear_sync();
+    }
+    TXN_UNLOCK();
+    return ret;
+}
+
+bool txn_active() {
+    return txn.depth > 0;
+}
+
+bool txn_try_lock() {
+    if (TXN_TRY_LOCK() == false) {
+        return false;
+    }
+    // Settling a journal waits for the flash task, which may run on the calling core
+    if (txn.depth > 0 || txn_journal != TXN_JOURNAL_NONE) {
+        TXN_UNLOCK();
+        return false;
+    }
+    return true;
+}
+
+void txn_unlock() {
+    TXN_UNLOCK();
+}
+
+// Idle-time job: settles a journal replayed at boot or left by a failed commit
+static bool txn_idle() {
+    TXN_LOCK();
+    if (txn.depth == 0) {
+        txn_settle();
+    }
+    TXN_UNLOCK();
+    return false;
+}
+
+void __attribute__((constructor)) txn_ctor() {
+    idle_register(txn_idle);
+}
+
+// An inner abort fails the outer transaction, whose writes stay staged until its end
+void txn_abort() {
+    if (txn.depth == 0) {
+        return;
+    }
+    if (--txn.depth > 0) {
+        txn.failed = true;
+    }
+    else {
+        txn_reset();
+    }
+    TXN_UNLOCK();
+}
+
+static int txn_finish() {
+    if (txn.failed == true) {
+        txn_reset();
+        return CCID_ERR_NO_MEMORY;
+    }
+    uint8_t *buf = txn.buf;
+    size_t len = txn.len;
+    bool journal = txn.records > 1;
+    if (journal == true) {
+        uint8_t digest[32];
+        mbedtls_sha256(buf, len, digest, 0);
+        memcpy(buf + len, digest, TXN_DIGEST_SIZE);
+        file_t *ef_txn = dyn_file_new(EF_TXN);
+        if (ef_txn == NULL || flash_write_data_to_file(ef_txn, buf, len + TXN_DIGEST_SIZE) != CCID_OK) {
+            txn_reset();
+            return CCID_ERR_NO_MEMORY;
+        }
+        wear_write(EF_TXN, len + TXN_DIGEST_SIZE);
+        txn_flush();
+    }
+    int ret = txn_apply(buf, len);
+    if (ret != CCID_OK) {
+        // The journal stays and is applied again before the next write
+        if (journal == true) {
+            txn_journal = TXN_JOURNAL_PENDING;
+            idle_schedule(txn_idle);
+        }
+        low_flash_available();
+        txn_reset();
+        return ret;
+    }
+    if (journal == true) {
+        txn_flush();
+        txn_journal_drop();
+    }
+    else {
+        low_flash_available();
+    }
+    txn_reset();
+    wear_sync();
+    return CCID_OK;
+}
+
+int txn_commit() {
+    if (txn.depth == 0) {
+        return CCID_OK;
+    }
+    int ret = --txn.depth > 0 ? CCID_OK : txn_finish();
+    TXN_UNLOCK();
+    return ret;
+}
+
+/*
+ * Replays a complete journal left by an interrupted commit. The flash task is not
+ * running yet at boot, so the journal is dropped once idle or by the first write
+ * afterwards, whichever comes first.
+ */
+void txn_recover() {
+    file_t *ef = dyn_file_search(EF_TXN);
+    if (ef == NULL) {
+        return;
+    }
+    if (file_has_data(ef) && file_get_size(ef) > TXN_DIGEST_SIZE) {
+        const uint8_t *data = file_get_data(ef);
+        size_t len = file_get_size(ef) - TXN_DIGEST_SIZE;
+        uint8_t digest[32];
+        mbedtls_sha256(data, len, digest, 0);
+        if (memcmp(digest, data + len, TXN_DIGEST_SIZE) == 0) {
+            txn_journal = txn_apply(data, len) == CCID_OK ? TXN_JOURNAL_APPLIED : TXN_JOURNAL_PENDING;
+            low_flash_available();
+            idle_schedule(txn_idle);
+            return;
+        }
+    }
+    // A journal cut short was never applied
+    txn_journal_drop();
+}
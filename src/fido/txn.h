@@ -0,0 +1,63 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TXN_H_
+#define _TXN_H_
+
+#include "file.h"
+
+#define TXN_MAX_SIZE        3072    // Staged records and digest
+#define TXN_DIGEST_SIZE     8
+
+/*
+ * Multi-file flash updates that survive power loss as a whole.
+ *
+ * Writes and deletes between txn_begin() and txn_commit() are staged in RAM. With
+ * more than one of them, the commit first stores the staged records in the EF_TXN
+ * journal and waits for it to reach flash, then applies them, waits again and
+ * drops the journal. If a record cannot be applied the commit stops there and
+ * fails, keeping the journal, which is applied again before the next write.
+ * scan_files() replays a complete journal left by an interrupted commit. Nested
+ * transactions are merged into the outermost one. Aborting a nested one keeps the
+ * outer one open, so later writes are still staged, and makes its commit fail.
+ * txn_abort() outside a transaction does nothing. Outside a transaction,
+ * txn_write() and txn_delete() write through. txn_write_fid() creates the file
+ * when the write is applied, so an aborted transaction leaves no empty file.
+ *
+ * Transactions and write-throughs of either core are serialized. A caller on core0,
+ * which runs the flash task, must not wait for core1 and brackets its writes with
+ * txn_try_lock() and txn_unlock() instead. It fails while core1 holds the lock or a
+ * journal is left to settle, so the writes it covers never wait for the flash task.
+ *
+ * Only commits of two or more records are journaled. On top of their own writes they
+ * pay one journal write, two waits for the flash task and one journal delete: two more
+ * sector rewrites, each a 4 KB erase of about 45 ms typical on the flash of a Pico, so
+ * some 100 ms per commit. A single record is written through without any of them, which
+ * is how OATH pools and the signature counter are written.
+ */
+extern void txn_begin();
+extern int txn_write(file_t *ef, const uint8_t *data, uint16_t len);
+extern int txn_write_fid(uint16_t fid, const uint8_t *data, uint16_t len);
+extern int txn_delete(file_t *ef);
+extern int txn_commit();
+extern void txn_abort();
+extern bool txn_active();
+extern bool txn_try_lock();
+extern void txn_unlock();
+extern void txn_recover();
+
+#endif //_TXN_H_
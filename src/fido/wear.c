@@ -0,0 +1,157 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fido.h"
+#include "files.h"
+#include "wear.h"
+#include "txn.h"
+#include "idle.h"
+
+// Global: they count writes to the one flash, whichever context issued them
+static wear_stats_t wear[WEAR_CLASSES];
+static uint16_t wear_dirty = 0;     // Writes accounted since the last flush
+static bool wear_saved = false;     // EF_WEAR was written since power-up
+
+static uint8_t wear_class(uint16_t fid) {
+    if (fid == EF_COUNTER) {
+        return WEAR_CLASS_SIGN_COUNTER;
+    }
+    if (fid == EF_PIN || fid == EF_MINPINLEN || fid == EF_AUTHTOKEN) {
+        return WEAR_CLASS_PIN;
+    }
+    if ((fid & 0xff00) == EF_CRED || (fid & 0xff00) == EF_RP) {
+        return WEAR_CLASS_CRED;
+    }
+    if (fid == EF_LARGEBLOB) {
+        return WEAR_CLASS_LARGEBLOB;
+    }
+    if ((fid & 0xff00) == EF_OATH_CRED || (fid & 0xffc0) == EF_OATH_POOL || (fid & 0xff80) == EF_OATH_POOL4) {
+        return WEAR_CLASS_OATH;         // EF_OATH_CODE and HOTP moving factors included
+    }
+    if ((fid & 0xff00) == EF_OATH_IMF || (fid & 0xff80) == EF_OATH_POOL4_IMF) {
+        return WEAR_CLASS_OATH_IMF;
+    }
+    if (fid == EF_OTP_SLOT1 || fid == EF_OTP_SLOT2) {
+        return WEAR_CLASS_OTP;
+    }
+    if (fid == EF_OTP_IMF1 || fid == EF_OTP_IMF2 || fid == EF_OTP_CTR1 || fid == EF_OTP_CTR2) {
+        return WEAR_CLASS_OTP_CTR;
+    }
+    if (fid == EF_KEY_DEV || fid == EF_KEY_DEV_ENC || fid == EF_EE_DEV || fid == EF_EE_DEV_EA ||
+        fid == EF_OPTS) {
+        return WEAR_CLASS_DEVICE;
+    }
+    if (fid == EF_TXN) {
+        return WEAR_CLASS_TXN;
+    }
+    if (fid == EF_WEAR) {
+        return WEAR_CLASS_WEAR;
+    }
+    return WEAR_CLASS_OTHER;
+}
+
+// Keeps the counters in RAM if EF_WEAR is gone, as after a reset, so they are stored again
+void wear_load() {
+    file_t *ef = dyn_file_search(EF_WEAR);
+    if (file_has_data(ef) && file_get_size(ef) == sizeof(wear)) {
+        memcpy(wear, file_get_data(ef), sizeof(wear));
+        wear_dirty = 0;
+    }
+    // Stored with a relocation count per class, which was never set
+    else if (file_has_data(ef) && file_get_size(ef) == WEAR_CLASSES * (sizeof(wear_stats_t) + 4)) {
+        for (int i = 0; i < WEAR_CLASSES; i++) {
+            memcpy(&wear[i], file_get_data(ef) + i * (sizeof(wear_stats_t) + 4), sizeof(wear_stats_t));
+        }
+        wear_dirty = 0;
+    }
+}
+
+// Goes through the transaction layer, which also accounts this write
+void wear_flush() {
+    wear_dirty = 0;
+    wear_saved = true;
+    txn_write_fid(EF_WEAR, (const uint8_t *) wear, sizeof(wear));
+    low_flash_available();
+}
+
+// Most power cycles of a key see far fewer than WEAR_FLUSH_WRITES writes, so the first one is saved at once
+void wear_sync() {
+    if (wear_dirty >= WEAR_FLUSH_WRITES || (wear_dirty > 0 && wear_saved == false)) {
+        wear_flush();
+    }
+}
+
+void wear_save() {
+    if (wear_dirty > 0) {
+        wear_flush();
+    }
+}
+
+// Idle-time job: saves the pending counters off the command path
+static bool wear_idle() {
+    wear_save();
+    return false;
+}
+
+void __attribute__((constructor)) wear_ctor() {
+    idle_register(wear_idle);
+}
+
+static void wear_account(uint16_t fid) {
+    if (fid != EF_WEAR) {
+        wear_dirty++;
+        idle_schedule(wear_idle);
+    }
+}
+
+void wear_write(uint16_t fid, size_t len) {
+    wear_stats_t *w = &wear[wear_class(fid)];
+    w->writes++;
+    w->bytes += len;
+    w->erases += (len + WEAR_FILE_OVERHEAD + WEAR_SECTOR_SIZE - 1) / WEAR_SECTOR_SIZE;
+    wear_account(fid);
+}
+
+void wear_delete(uint16_t fid) {
+    wear_stats_t *w = &wear[wear_class(fid)];
+    w->deletes++;
+    w->erases++;
+    wear_account(fid);
+}
+
+// The whole data area is erased, as by a reset
+void wear_format() {
+    wear[WEAR_CLASS_DEVICE].erases += WEAR_DATA_SECTORS;
+    wear_account(EF_KEY_DEV);
+}
+
+const wear_stats_t *wear_stats(uint8_t cls) {
+    return cls < WEAR_CLASSES ? &wear[cls] : NULL;
+}
+
+uint64_t wear_erases() {
+    uint64_t total = 0;
+    for (int i = 0; i < WEAR_CLASSES; i++) {
+        total += wear[i].erases;
+    }
+    return total;
+}
+
+// Sector erases the data area is rated for, assuming even wear
+uint64_t wear_budget() {
+    return (uint64_t) WEAR_DATA_SECTORS * WEAR_CYCLES;
+}
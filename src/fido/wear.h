@@ -0,0 +1,75 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WEAR_H_
+#define _WEAR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define WEAR_CLASS_SIGN_COUNTER 0x00
+#define WEAR_CLASS_PIN          0x01    // PIN and retries, minimum PIN length, auth token
+#define WEAR_CLASS_CRED         0x02    // Resident credentials and RPs
+#define WEAR_CLASS_LARGEBLOB    0x03
+#define WEAR_CLASS_OATH         0x04    // OATH credentials and access code
+#define WEAR_CLASS_OATH_IMF     0x05    // OATH HOTP counters kept apart before pools
+#define WEAR_CLASS_OTP          0x06    // OTP slot configurations
+#define WEAR_CLASS_OTP_CTR      0x07    // OTP HOTP counters and usage counter ceilings
+#define WEAR_CLASS_DEVICE       0x08    // Device keys, certificates, options, resets
+#define WEAR_CLASS_TXN          0x09    // Transaction journal
+#define WEAR_CLASS_WEAR         0x0A    // These counters
+#define WEAR_CLASS_OTHER        0x0B
+#define WEAR_CLASSES            12
+
+#define WEAR_SECTOR_SIZE        4096
+#define WEAR_FILE_OVERHEAD      8       // Flash header of each stored file
+#define WEAR_DATA_SECTORS       256     // Sectors of the flash data area
+#define WEAR_CYCLES             100000  // Rated erase cycles of a sector
+#define WEAR_FLUSH_WRITES       256     // Logical writes accounted before EF_WEAR is rewritten
+
+typedef struct wear_stats {
+    uint32_t writes;            // Logical file writes
+    uint32_t bytes;             // Bytes written
+    uint32_t deletes;
+    uint32_t erases;            // Estimated sector erases, one per sector a write or delete touches
+} wear_stats_t;
+
+/*
+ * Flash wear accounting per file class. Counters are kept in RAM and persisted in
+ * EF_WEAR at idle time (idle.h) once the device is quiet. As a fallback, wear_sync()
+ * persists them after the first write since power-up and once WEAR_FLUSH_WRITES
+ * writes are pending, so fewer than that many writes may be lost on power off. The
+ * transaction layer calls it after each completed write or commit, so such a flush
+ * is one more write of the command that triggered it.
+ * wear_save() persists whatever is pending, as when the counters are read, so the
+ * ones reported survive a power cycle. Erases are estimated from the writes, not
+ * counted by the flash layer, and are an upper bound: writes flushed together by
+ * one flash commit may share a sector erase.
+ */
+extern void wear_load();
+extern void wear_flush();
+extern void wear_sync();
+extern void wear_save();
+extern void wear_write(uint16_t fid, size_t len);
+extern void wear_delete(uint16_t fid);
+extern void wear_format();
+extern const wear_stats_t *wear_stats(uint8_t cls);
+extern uint64_t wear_erases();
+extern uint64_t wear_budget();
+
+#endif //_WEAR_H_
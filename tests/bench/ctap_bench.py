@@ -0,0 +1,198 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+# End-to-end CTAP2/U2F latency benchmark. It replays workloads against the
+# first CTAP HID device found, normally the emulator when the emulation
+# backend is installed in fido2.hid (see tests/start-up-and-bench.sh).
+
+import argparse
+import json
+import os
+import sys
+import time
+from fido2.hid import CtapHidDevice
+from fido2.ctap import CtapError
+from fido2.ctap1 import Ctap1
+from fido2.ctap2 import Ctap2
+from fido2.ctap2.pin import ClientPin, PinProtocolV2
+from fido2.ctap2.credman import CredentialManagement
+from fido2.ctap2.blob import LargeBlobs
+from fido2.utils import sha256
+
+PIN = '12345678'
+RP_ID = 'example.com'
+FILLER_RP_ID = 'filler.example.com'
+DISCOVERABLE_RP_ID = 'discoverable.example.com'
+ES256 = [{'type': 'public-key', 'alg': -7}]
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    k = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[k]
+
+class Bench:
+    def __init__(self, dev, iterations):
+        self.ctap = Ctap2(dev)
+        self.ctap1 = Ctap1(dev)
+        self.iterations = iterations
+        self.client_pin = ClientPin(self.ctap, PinProtocolV2())
+        self.protocol = self.client_pin.protocol
+        if not self.ctap.info.options.get('clientPin'):
+            self.client_pin.set_pin(PIN)
+        self.__token = (None, None)
+        self.__uid = 0
+        self.results = []
+
+    def token(self, permissions, rp_id=None):
+        # Only the last token is valid, so it is fetched again when permissions change
+        key = (permissions, rp_id)
+        if self.__token[0] != key:
+            self.__token = (key, self.client_pin.get_pin_token(PIN, permissions=permissions, permissions_rpid=rp_id))
+        return self.__token[1]
+
+    def pin_auth(self, cdh, rp_id):
+        t = self.token(ClientPin.PERMISSION.MAKE_CREDENTIAL | ClientPin.PERMISSION.GET_ASSERTION, rp_id)
+        return self.protocol.authenticate(t, cdh)
+
+    def user(self):
+        self.__uid += 1
+        return {'id': self.__uid.to_bytes(8, 'big'), 'name': f'user{self.__uid}', 'displayName': f'User {self.__uid}'}
+
+    def make_credential(self, rp_id, rk=False, extensions=None, user=None):
+        cdh = os.urandom(32)
+        return self.ctap.make_credential(cdh, {'id': rp_id, 'name': rp_id}, user or self.user(), ES256,
+                                         extensions=extensions, options={'rk': rk} if rk else None,
+                                         pin_uv_param=self.pin_auth(cdh, rp_id),
+                                         pin_uv_protocol=self.protocol.VERSION)
+
+    def get_assertion(self, rp_id, allow_list=None, extensions=None, uv=True):
+        cdh = os.urandom(32)
+        return self.ctap.get_assertion(rp_id, cdh, allow_list=allow_list, extensions=extensions,
+                                       pin_uv_param=self.pin_auth(cdh, rp_id) if uv else None,
+                                       pin_uv_protocol=self.protocol.VERSION if uv else None)
+
+    def remaining_rks(self):
+        cm = CredentialManagement(self.ctap, self.protocol, self.token(ClientPin.PERMISSION.CREDENTIAL_MGMT))
+        return cm.get_metadata()[CredentialManagement.RESULT.MAX_REMAINING_COUNT]
+
+    def fill(self, rp_id, count):
+        for _ in range(count):
+            self.make_credential(rp_id, rk=True)
+
+    def run(self, name, fn, label=None):
+        lat = []
+        fn() # Warm-up
+        t0 = time.perf_counter()
+        for _ in range(self.iterations):
+            t = time.perf_counter_ns()
+            fn()
+            lat.append((time.perf_counter_ns() - t) / 1000.0)
+        total = time.perf_counter() - t0
+        lat.sort()
+        r = {
+            'name': name,
+            'stored': label,
+            'iterations': self.iterations,
+            'p50_us': percentile(lat, 50),
+            'p95_us': percentile(lat, 95),
+            'p99_us': percentile(lat, 99),
+            'ops_s': self.iterations / total if total > 0 else 0,
+        }
+        self.results.append(r)
+        print(f"{name:<32}{label if label is not None else '':>8}{r['p50_us']:>12.0f}{r['p95_us']:>12.0f}{r['p99_us']:>12.0f}{r['ops_s']:>10.1f}")
+        return r
+
+def workloads(b, stored):
+    # Fixture: 16 non-resident credentials for example.com
+    if not hasattr(b, 'creds'):
+        b.creds = [{'type': 'public-key', 'id': b.make_credential(RP_ID).auth_data.credential_data.credential_id} for _ in range(16)]
+        b.hmac_cred = {'type': 'public-key', 'id': b.make_credential(RP_ID, extensions={'hmac-secret': True}).auth_data.credential_data.credential_id}
+        b.u2f_app = sha256(b'https://' + RP_ID.encode())
+        b.u2f_kh = b.ctap1.register(os.urandom(32), b.u2f_app).key_handle
+
+    b.run('make_credential', lambda: b.make_credential(RP_ID), stored)
+    # Same user every time, so the resident credential is overwritten and does not grow the store
+    rk_user = b.user()
+    b.run('make_credential_rk', lambda: b.make_credential(RP_ID, rk=True, user=rk_user), stored)
+    for n in (1, 8, 16):
+        # Worst case: the matching credential is the last of the list
+        allow = [{'type': 'public-key', 'id': os.urandom(len(b.creds[0]['id']))} for _ in range(n - 1)] + [b.creds[n - 1]]
+        b.run(f'get_assertion_allow_{n}', lambda: b.get_assertion(RP_ID, allow_list=allow), stored)
+
+    b.token(ClientPin.PERMISSION.MAKE_CREDENTIAL | ClientPin.PERMISSION.GET_ASSERTION, RP_ID)
+    key_agreement, shared_secret = b.client_pin._get_shared_secret()
+    salt_enc = b.protocol.encrypt(shared_secret, os.urandom(32))
+    hmac_ext = {'hmac-secret': {1: key_agreement, 2: salt_enc, 3: b.protocol.authenticate(shared_secret, salt_enc), 4: b.protocol.VERSION}}
+    b.run('get_assertion_hmac_secret', lambda: b.get_assertion(RP_ID, allow_list=[b.hmac_cred], extensions=hmac_ext), stored)
+
+    cm = CredentialManagement(b.ctap, b.protocol, b.token(ClientPin.PERMISSION.CREDENTIAL_MGMT))
+    rp_hash = sha256(RP_ID.encode())
+    b.run('cred_mgmt_enumerate_rps', lambda: cm.enumerate_rps(), stored)
+    b.run('cred_mgmt_enumerate_creds', lambda: cm.enumerate_creds(rp_hash), stored)
+
+    lb = LargeBlobs(b.ctap, b.protocol, b.token(ClientPin.PERMISSION.LARGE_BLOB_WRITE))
+    blob = [{1: os.urandom(1024), 2: 0, 3: 1024}]
+    b.run('large_blob_write', lambda: lb.write_blob_array(blob), stored)
+    b.run('large_blob_read', lambda: lb.read_blob_array(), stored)
+
+    b.run('u2f_register', lambda: b.ctap1.register(os.urandom(32), b.u2f_app), stored)
+    b.run('u2f_authenticate', lambda: b.ctap1.authenticate(os.urandom(32), b.u2f_app, b.u2f_kh), stored)
+
+def discoverable(b, counts):
+    have = 0
+    for n in counts:
+        n = min(n, have + b.remaining_rks())
+        if n <= have:
+            print(f'Not enough room for {n} resident credentials, skipping', file=sys.stderr)
+            continue
+        b.fill(DISCOVERABLE_RP_ID, n - have)
+        have = n
+        b.run(f'get_assertion_discoverable_{n}', lambda: b.get_assertion(DISCOVERABLE_RP_ID), have)
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='End-to-end CTAP benchmark against the emulator or a device.')
+    parser.add_argument('-n', '--iterations', type=int, default=50, help='Timed iterations per workload.')
+    parser.add_argument('--sweep', default='0', help='Comma separated number of stored resident credentials at which all workloads are run, e.g. 0,50,100.')
+    parser.add_argument('--discoverable', default='10,100,250', help='Comma separated resident credential counts for the discoverable lookup.')
+    parser.add_argument('--json', help='Writes the results to a JSON file.')
+    return parser.parse_args()
+
+def main(args):
+    dev = next(CtapHidDevice.list_devices(), None)
+    if dev is None:
+        print('No device found', file=sys.stderr)
+        sys.exit(1)
+    b = Bench(dev, args.iterations)
+    print(f"{'WORKLOAD':<32}{'STORED':>8}{'P50(us)':>12}{'P95(us)':>12}{'P99(us)':>12}{'OPS/S':>10}")
+    stored = 0
+    for level in sorted(int(x) for x in args.sweep.split(',')):
+        level = min(level, stored + b.remaining_rks())
+        if level > stored:
+            b.fill(FILLER_RP_ID, level - stored)
+            stored = level
+        workloads(b, stored)
+    discoverable(b, [int(x) for x in args.discoverable.split(',')])
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump({'results': b.results}, f, indent=2)
+
+if __name__ == '__main__':
+    main(parse_args())
@@ -19,14 +19,26 @@ from __future__ import annotations
 
 from .base import HidDescriptor, CtapHidConnection
 
+import os
 import socket
 from typing import Set
 
 import logging
 import sys
 
-HOST = '127.0.0.1'
-PORT = 35962
+from .shmring import ShmRing
+
+# PICO_FIDO_EMULATION selects the endpoint:
+#   host:port       TCP (default 127.0.0.1:35962)
+#   unix:/path      AF_UNIX stream socket
+#   shm:/path       shared-memory rings, see shmring.py
+# unix: and shm: are served by tests/emulation/ctaphid_mux.py, which still
+# forwards every frame to the emulator over TCP
+ENDPOINT = os.environ.get('PICO_FIDO_EMULATION', '127.0.0.1:35962')
+# PICO_FIDO_EMULATION_MODE=message exchanges whole CTAPHID messages instead of
+# HID reports with stream endpoints that support it (tests/emulation/ctaphid_mux.py)
+MESSAGE_MODE = os.environ.get('PICO_FIDO_EMULATION_MODE') == 'message'
+MSG_HELLO = b'PFMSG\x01'
 
 # Don't typecheck this file on Windows
 assert sys.platform != "win32"  # nosec
@@ -36,38 +48,93 @@ logger = logging.getLogger(__name__)
 class EmulationCtapHidConnection(CtapHidConnection):
     def __init__(self, descriptor):
         self.descriptor = descriptor
-        self.handle = descriptor.path
-        self.handle.connect((HOST, PORT))
+        if descriptor.path.startswith('unix:'):
+            self.handle = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.handle.connect(descriptor.path[5:])
+        else:
+            host, port = descriptor.path.rsplit(':', 1)
+            self.handle = socket.create_connection((host, int(port)))
+            self.handle.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.rbuf = bytearray()
+        self.msg_mode = False
+        if MESSAGE_MODE:
+            self._write_frame(MSG_HELLO)
+            if self._read_frame() != MSG_HELLO:
+                raise OSError("Endpoint does not support message mode")
+            self.msg_mode = True
+            self.out_msg = None
+            self.in_pkts = []
+
+    def _write_frame(self, frame):
+        self.handle.sendall(len(frame).to_bytes(2, 'big') + frame)
 
     def write_packet(self, packet):
-        if (self.handle.send(len(packet).to_bytes(2, 'big')) != 2):
-            raise OSError("write_packet sending size failed")
-        if (self.handle.send(packet) != len(packet)):
-            raise OSError("write_packet sending packet failed")
+        if not self.msg_mode:
+            return self._write_frame(packet)
+        # Packets are gathered into a message, sent once complete
+        if packet[4] & 0x80:
+            self.out_msg = [packet[:5], int.from_bytes(packet[5:7], 'big'), bytearray(packet[7:])]
+        elif self.out_msg:
+            self.out_msg[2] += packet[5:]
+        if self.out_msg and len(self.out_msg[2]) >= self.out_msg[1]:
+            self._write_frame(self.out_msg[0] + bytes(self.out_msg[2][:self.out_msg[1]]))
+            self.out_msg = None
+
+    def _fill(self, n):
+        while len(self.rbuf) < n:
+            data = self.handle.recv(4096)
+            if not data:
+                raise OSError("read_packet connection closed")
+            self.rbuf += data
+
+    def _read_frame(self):
+        self._fill(2)
+        size = int.from_bytes(self.rbuf[:2], 'big')
+        self._fill(2 + size)
+        data = bytes(self.rbuf[2:2 + size])
+        del self.rbuf[:2 + size]
+        return data
 
     def read_packet(self):
-        bts = self.handle.recv(2)
-        if (len(bts) != 2):
-            raise OSError("read_packet failed reading size")
-        size = int.from_bytes(bts, 'big')
-        data = self.handle.recv(size)
-        if (len(data) != size):
-            raise OSError("read_packet failed reading packet")
-        return data
+        if not self.msg_mode:
+            return self._read_frame()
+        if not self.in_pkts:
+            # Fragments the message back into reports for CtapHidDevice
+            msg = self._read_frame()
+            head, payload = msg[:5], msg[5:]
+            size = self.descriptor.report_size_in
+            self.in_pkts.append((head + len(payload).to_bytes(2, 'big') + payload[:size - 7]).ljust(size, b'\x00'))
+            for seq, off in enumerate(range(size - 7, len(payload), size - 5)):
+                self.in_pkts.append((head[:4] + bytes([seq]) + payload[off:off + size - 5]).ljust(size, b'\x00'))
+        return self.in_pkts.pop(0)
+
+    def close(self) -> None:
+        return self.handle.close()
+
+
+class EmulationShmCtapHidConnection(CtapHidConnection):
+    def __init__(self, descriptor):
+        self.descriptor = descriptor
+        self.handle = ShmRing(descriptor.path[4:])
+
+    def write_packet(self, packet):
+        self.handle.write(packet)
+
+    def read_packet(self):
+        return self.handle.read()
 
     def close(self) -> None:
         return self.handle.close()
 
 
 def open_connection(descriptor):
+    if descriptor.path.startswith('shm:'):
+        return EmulationShmCtapHidConnection(descriptor)
     return EmulationCtapHidConnection(descriptor)
 
 
 def get_descriptor(_):
-    HOST = 'localhost'    # The remote host
-    PORT = 35962              # The same port as used by the server
-    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-    return HidDescriptor(s, 0x00, 0x00, 64, 64, "Pico-Fido", "AAAAAA")
+    return HidDescriptor(ENDPOINT, 0x00, 0x00, 64, 64, "Pico-Fido", "AAAAAA")
 
 def list_descriptors():
     devices = []
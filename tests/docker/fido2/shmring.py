@@ -0,0 +1,114 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+# Shared-memory transport for the emulator: two single-producer/single-consumer
+# rings of length-prefixed frames in a file mapped by both ends (usually in
+# /dev/shm). The server creates the file, the client attaches to it.
+#
+# Header (little endian u32):
+#   0 magic 'PFSR', 4 version, 8 slots, 12 slot size,
+#   16 c2s head, 20 c2s tail, 24 s2c head, 28 s2c tail
+# Rings start at offset 64: client to server, then server to client.
+
+import mmap
+import os
+import struct
+import time
+
+MAGIC = b'PFSR'
+VERSION = 1
+HEADER_SIZE = 64
+SLOTS = 256
+SLOT_SIZE = 2 + 64
+
+C2S_HEAD, C2S_TAIL, S2C_HEAD, S2C_TAIL = 16, 20, 24, 28
+
+class ShmRing:
+    def __init__(self, path, create=False, slots=SLOTS, slot_size=SLOT_SIZE):
+        if create:
+            size = HEADER_SIZE + 2 * slots * slot_size
+            fd = os.open(path, os.O_RDWR | os.O_CREAT | os.O_TRUNC, 0o600)
+            os.ftruncate(fd, size)
+        else:
+            fd = os.open(path, os.O_RDWR)
+            size = os.fstat(fd).st_size
+        self.mm = mmap.mmap(fd, size)
+        os.close(fd)
+        if create:
+            struct.pack_into('<4sIII', self.mm, 0, MAGIC, VERSION, slots, slot_size)
+        magic, version, self.slots, self.slot_size = struct.unpack_from('<4sIII', self.mm, 0)
+        if magic != MAGIC or version != VERSION:
+            raise OSError(f'{path} is not a Pico Fido shared-memory ring')
+        c2s = HEADER_SIZE
+        s2c = HEADER_SIZE + self.slots * self.slot_size
+        # Server writes s2c and reads c2s, client the opposite
+        if create:
+            self.tx, self.tx_head, self.tx_tail = s2c, S2C_HEAD, S2C_TAIL
+            self.rx, self.rx_head, self.rx_tail = c2s, C2S_HEAD, C2S_TAIL
+        else:
+            self.tx, self.tx_head, self.tx_tail = c2s, C2S_HEAD, C2S_TAIL
+            self.rx, self.rx_head, self.rx_tail = s2c, S2C_HEAD, S2C_TAIL
+
+    def _u32(self, off):
+        return struct.unpack_from('<I', self.mm, off)[0]
+
+    # True once the frame is queued, None if the ring is full
+    def try_write(self, frame):
+        if len(frame) > self.slot_size - 2:
+            raise ValueError(f'frame of {len(frame)} bytes does not fit a {self.slot_size - 2} byte slot')
+        head = self._u32(self.tx_head)
+        if (head - self._u32(self.tx_tail)) & 0xFFFFFFFF >= self.slots:
+            return None
+        off = self.tx + (head % self.slots) * self.slot_size
+        self.mm[off:off + 2 + len(frame)] = len(frame).to_bytes(2, 'big') + frame
+        # The frame is published by the head update
+        struct.pack_into('<I', self.mm, self.tx_head, (head + 1) & 0xFFFFFFFF)
+        return True
+
+    def try_read(self):
+        tail = self._u32(self.rx_tail)
+        if tail == self._u32(self.rx_head):
+            return None
+        off = self.rx + (tail % self.slots) * self.slot_size
+        size = int.from_bytes(self.mm[off:off + 2], 'big')
+        frame = self.mm[off + 2:off + 2 + size]
+        struct.pack_into('<I', self.mm, self.rx_tail, (tail + 1) & 0xFFFFFFFF)
+        return frame
+
+    @staticmethod
+    def _wait(fn, *args):
+        spins = 0
+        while True:
+            r = fn(*args)
+            if r is not None:
+                return r
+            spins += 1
+            if spins > 1000:
+                time.sleep(0.00005)
+            elif spins > 100:
+                time.sleep(0)
+
+    def write(self, frame):
+        self._wait(self.try_write, frame)
+
+    def read(self):
+        return self._wait(self.try_read)
+
+    def close(self):
+        self.mm.close()
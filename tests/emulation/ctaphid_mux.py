@@ -0,0 +1,308 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+# CTAPHID multiplexer for the emulator.
+#
+# The emulator serves a single client on 127.0.0.1:35962. This server accepts
+# any number of clients (same length-prefixed framing) with an epoll loop and
+# multiplexes them onto the emulator connection:
+#  - INIT on the broadcast channel is forwarded and the allocated CID is bound
+#    to the client that sent the nonce.
+#  - Responses are routed back by CID.
+#  - While a transaction is in flight, requests from any other channel are
+#    answered with CTAPHID_ERROR(ERR_CHANNEL_BUSY), as a single card would do.
+#    If its client disconnects, the transaction is cancelled on the device.
+#
+# Clients may connect over TCP, AF_UNIX (--unix) or shared-memory rings
+# (--shm, see tests/docker/fido2/shmring.py). These client transports end at
+# the mux: the emulator itself only serves TCP (its transport lives in the SDK),
+# so every frame still crosses the loopback TCP connection to it. AF_UNIX and
+# shm are placeholders for an emulator-side transport and do not remove that hop.
+#
+# Stream clients may switch to whole-message mode by sending MSG_HELLO as
+# their first frame. The mux echoes it and, from then on, every frame in both
+# directions is a complete CTAPHID message: cid (4) | cmd (1) | payload.
+# The mux fragments requests into HID reports and reassembles responses.
+
+import argparse
+import logging
+import os
+import selectors
+import socket
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'docker', 'fido2'))
+from shmring import ShmRing
+
+HID_RPT_SIZE = 64
+BROADCAST_CID = 0xFFFFFFFF
+
+CTAPHID_INIT = 0x86
+CTAPHID_CANCEL = 0x91
+CTAPHID_KEEPALIVE = 0xBB
+CTAPHID_ERROR = 0xBF
+ERR_CHANNEL_BUSY = 0x06
+
+MSG_HELLO = b'PFMSG\x01'
+
+logger = logging.getLogger('ctaphid_mux')
+
+def error_packet(cid, code):
+    return struct.pack('>IBHB', cid, CTAPHID_ERROR, 1, code).ljust(HID_RPT_SIZE, b'\x00')
+
+def fragment(msg):
+    cid, cmd, payload = msg[:4], msg[4], msg[5:]
+    pkts = [(cid + bytes([cmd]) + len(payload).to_bytes(2, 'big') + payload[:57]).ljust(HID_RPT_SIZE, b'\x00')]
+    for seq, off in enumerate(range(57, len(payload), 59)):
+        pkts.append((cid + bytes([seq]) + payload[off:off + 59]).ljust(HID_RPT_SIZE, b'\x00'))
+    return pkts
+
+class Conn:
+    def __init__(self, sock):
+        self.sock = sock
+        self.rbuf = bytearray()
+        self.wbuf = bytearray()
+        self.msg_mode = False
+        self.partial = {}       # CID -> [cmd, bcnt, payload] being reassembled in message mode
+
+    def frames(self):
+        while len(self.rbuf) >= 2:
+            size = int.from_bytes(self.rbuf[:2], 'big')
+            if len(self.rbuf) < 2 + size:
+                break
+            frame = bytes(self.rbuf[2:2 + size])
+            del self.rbuf[:2 + size]
+            yield frame
+
+    def send(self, frame):
+        self.wbuf += len(frame).to_bytes(2, 'big') + frame
+
+    def alive(self):
+        return self.sock.fileno() >= 0
+
+class ShmConn:
+    def __init__(self, path):
+        self.ring = ShmRing(path, create=True)
+        self.pending = []
+        self.msg_mode = False   # Slots only fit HID reports
+
+    def frames(self):
+        while (frame := self.ring.try_read()) is not None:
+            yield frame
+
+    def send(self, frame):
+        self.pending.append(frame)
+
+    def flush(self):
+        while self.pending and self.ring.try_write(self.pending[0]):
+            self.pending.pop(0)
+
+    def alive(self):
+        return True
+
+class Mux:
+    def __init__(self, upstream, listeners, shms=[]):
+        self.sel = selectors.DefaultSelector() # epoll on Linux
+        self.up = Conn(socket.create_connection(upstream))
+        self.up.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.up.sock.setblocking(False)
+        self.sel.register(self.up.sock, selectors.EVENT_READ, self.up)
+        for lsock in listeners:
+            lsock.setblocking(False)
+            self.sel.register(lsock, selectors.EVENT_READ, None)
+        self.shms = [ShmConn(path) for path in shms]
+        self.owners = {}        # CID -> client
+        self.nonces = {}        # INIT nonce -> client
+        self.active = None      # (client, cid) of the transaction in flight
+        self.resp_left = 0      # Response bytes still to come for the active transaction
+
+    def accept(self, lsock):
+        sock, _ = lsock.accept()
+        if sock.family != socket.AF_UNIX:
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sock.setblocking(False)
+        self.sel.register(sock, selectors.EVENT_READ, Conn(sock))
+        logger.info('Client connected (%d)', sock.fileno())
+
+    def drop(self, c):
+        logger.info('Client disconnected (%d)', c.sock.fileno())
+        self.sel.unregister(c.sock)
+        c.sock.close()
+        self.owners = {k: v for k, v in self.owners.items() if v is not c}
+        self.nonces = {k: v for k, v in self.nonces.items() if v is not c}
+        if self.active and self.active[0] is c:
+            # The request may never be completed, so the device is told to drop it and
+            # whatever it still sends on that channel is discarded
+            cid = self.active[1]
+            self.up.send(struct.pack('>IBH', cid, CTAPHID_CANCEL, 0).ljust(HID_RPT_SIZE, b'\x00'))
+            self.active = None
+
+    def to_client(self, c, pkt):
+        if not c.msg_mode:
+            c.send(pkt)
+            return
+        cid, cmd = int.from_bytes(pkt[:4], 'big'), pkt[4]
+        if cmd & 0x80:
+            bcnt = int.from_bytes(pkt[5:7], 'big')
+            if cmd == CTAPHID_KEEPALIVE:
+                c.send(pkt[:5] + pkt[7:7 + bcnt])
+                return
+            c.partial[cid] = [cmd, bcnt, bytearray(pkt[7:7 + bcnt])]
+        elif cid in c.partial:
+            m = c.partial[cid]
+            m[2] += pkt[5:5 + m[1] - len(m[2])]
+        else:
+            return
+        m = c.partial[cid]
+        if len(m[2]) >= m[1]:
+            del c.partial[cid]
+            c.send(pkt[:4] + bytes([m[0]]) + bytes(m[2]))
+
+    def from_client(self, c, frame):
+        if c.msg_mode:
+            if len(frame) < 5:
+                return
+            pkts = fragment(frame)
+            if self.from_client_packet(c, pkts[0]):
+                for pkt in pkts[1:]:
+                    self.up.send(pkt)
+        elif frame == MSG_HELLO and isinstance(c, Conn):
+            c.msg_mode = True
+            c.send(MSG_HELLO)
+        else:
+            self.from_client_packet(c, frame)
+
+    def from_client_packet(self, c, pkt):
+        if len(pkt) < 5:
+            return False
+        cid = int.from_bytes(pkt[:4], 'big')
+        cmd = pkt[4]
+        if self.active and self.active[1] != cid:
+            if cmd & 0x80:
+                self.to_client(c, error_packet(cid, ERR_CHANNEL_BUSY))
+            return False
+        if cmd & 0x80 and cmd != CTAPHID_CANCEL:
+            if cid == BROADCAST_CID and cmd == CTAPHID_INIT:
+                self.nonces[pkt[7:15]] = c
+            elif self.owners.get(cid, c) is not c:
+                self.to_client(c, error_packet(cid, ERR_CHANNEL_BUSY))
+                return False
+            else:
+                self.owners[cid] = c
+            self.active = (c, cid)
+            self.resp_left = -1
+        self.up.send(pkt)
+        return True
+
+    def from_device(self, pkt):
+        if len(pkt) < 7:
+            return
+        cid = int.from_bytes(pkt[:4], 'big')
+        cmd = pkt[4]
+        if cid == BROADCAST_CID and cmd == CTAPHID_INIT:
+            c = self.nonces.pop(pkt[7:15], None)
+            if c and len(pkt) >= 19:
+                self.owners[int.from_bytes(pkt[15:19], 'big')] = c
+        else:
+            c = self.owners.get(cid)
+        if self.active and self.active[1] == cid:
+            if c is None:
+                c = self.active[0]
+            if cmd & 0x80:
+                if cmd != CTAPHID_KEEPALIVE:
+                    self.resp_left = int.from_bytes(pkt[5:7], 'big') - (len(pkt) - 7)
+            else:
+                self.resp_left -= len(pkt) - 5
+            if cmd != CTAPHID_KEEPALIVE and self.resp_left <= 0:
+                self.active = None
+        if c is not None and c.alive():
+            self.to_client(c, pkt)
+
+    def flush(self, c):
+        if c.wbuf:
+            try:
+                n = c.sock.send(c.wbuf)
+                del c.wbuf[:n]
+            except BlockingIOError:
+                pass
+        events = selectors.EVENT_READ | (selectors.EVENT_WRITE if c.wbuf else 0)
+        self.sel.modify(c.sock, events, c)
+
+    def run(self):
+        # Shared-memory rings have no file descriptor, so they are polled
+        timeout = 0.0002 if self.shms else None
+        while True:
+            for s in self.shms:
+                for frame in s.frames():
+                    self.from_client(s, frame)
+                s.flush()
+            if self.up.wbuf:
+                self.flush(self.up)
+            for key, mask in self.sel.select(timeout):
+                c = key.data
+                if c is None:
+                    self.accept(key.fileobj)
+                    continue
+                if mask & selectors.EVENT_READ:
+                    try:
+                        data = c.sock.recv(65536)
+                    except ConnectionError:
+                        data = b''
+                    if not data:
+                        if c is self.up:
+                            logger.error('Emulator closed the connection')
+                            return
+                        self.drop(c)
+                        continue
+                    c.rbuf += data
+                    for frame in c.frames():
+                        if c is self.up:
+                            self.from_device(frame)
+                        else:
+                            self.from_client(c, frame)
+                for k in list(self.sel.get_map().values()):
+                    if k.data is not None and (k.data.wbuf or k.data is c):
+                        self.flush(k.data)
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Multiplexes many CTAPHID clients onto the Pico Fido emulator.')
+    parser.add_argument('--upstream', default='127.0.0.1:35962', help='Emulator address.')
+    parser.add_argument('--listen', default='127.0.0.1:35963', help='TCP address to listen on.')
+    parser.add_argument('--unix', help='Also listen on this AF_UNIX socket path. Frames are still forwarded to the emulator over TCP.')
+    parser.add_argument('--shm', action='append', default=[], help='Creates a shared-memory ring at this path for one client. Can be repeated. Frames are still forwarded to the emulator over TCP.')
+    parser.add_argument('-v', '--verbose', action='store_true')
+    return parser.parse_args()
+
+def main(args):
+    logging.basicConfig(level=logging.INFO if args.verbose else logging.WARNING)
+    host, port = args.upstream.rsplit(':', 1)
+    lhost, lport = args.listen.rsplit(':', 1)
+    listeners = [socket.create_server((lhost, int(lport)))]
+    if args.unix:
+        if os.path.exists(args.unix):
+            os.unlink(args.unix)
+        usock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        usock.bind(args.unix)
+        usock.listen()
+        listeners.append(usock)
+    Mux((host, int(port)), listeners, args.shm).run()
+
+if __name__ == '__main__':
+    main(parse_args())
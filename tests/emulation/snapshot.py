@@ -0,0 +1,142 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+# Flash-only snapshots of the emulator.
+#
+# A snapshot is only a copy of the flash image (memory.flash in the working
+# directory), taken while the emulator is stopped. RAM state is not captured:
+# restoring restarts the emulator as if it had been power cycled with that
+# flash, so PIN tokens, key agreement, assertion sessions, OATH and OTP caches
+# and any open transaction are lost, as on a real key.
+#
+# Usage:
+#   snapshot.py save <image>       stops the emulator, saves its flash and restarts it
+#   snapshot.py restore <image>    restarts the emulator from a saved flash
+#   snapshot.py run [<image>]      starts the emulator, optionally from a saved flash
+
+import argparse
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import time
+
+FLASH_FILE = 'memory.flash'
+DEFAULT_BINARY = './build_in_docker/pico_fido'
+DEFAULT_ENDPOINT = ('127.0.0.1', 35962)
+PID_FILE = 'pico_fido.pid'
+
+class Emulator:
+    def __init__(self, binary=DEFAULT_BINARY, workdir='.', endpoint=DEFAULT_ENDPOINT):
+        self.binary = os.path.abspath(binary)
+        self.workdir = workdir
+        self.endpoint = endpoint
+
+    @property
+    def flash(self):
+        return os.path.join(self.workdir, FLASH_FILE)
+
+    @property
+    def pid_file(self):
+        return os.path.join(self.workdir, PID_FILE)
+
+    def pid(self):
+        try:
+            with open(self.pid_file) as f:
+                pid = int(f.read())
+            os.kill(pid, 0)
+            return pid
+        except (OSError, ValueError):
+            return None
+
+    def wait_ready(self, timeout=10):
+        end = time.monotonic() + timeout
+        while time.monotonic() < end:
+            try:
+                socket.create_connection(self.endpoint, timeout=0.2).close()
+                return
+            except OSError:
+                time.sleep(0.05)
+        raise TimeoutError(f'Emulator not listening on {self.endpoint[0]}:{self.endpoint[1]}')
+
+    def start(self, image=None):
+        if self.pid():
+            raise RuntimeError('Emulator already running')
+        os.makedirs(self.workdir, exist_ok=True)
+        if image:
+            shutil.copyfile(image, self.flash)
+        proc = subprocess.Popen([self.binary], cwd=self.workdir, stdout=subprocess.DEVNULL, start_new_session=True)
+        with open(self.pid_file, 'w') as f:
+            f.write(str(proc.pid))
+        self.wait_ready()
+
+    def stop(self, timeout=5):
+        pid = self.pid()
+        if pid:
+            os.kill(pid, signal.SIGTERM)
+            end = time.monotonic() + timeout
+            while self.pid() and time.monotonic() < end:
+                time.sleep(0.02)
+            if self.pid():
+                os.kill(pid, signal.SIGKILL)
+        if os.path.exists(self.pid_file):
+            os.unlink(self.pid_file)
+
+    def save(self, image):
+        # The flash is only consistent while the emulator is not writing it
+        running = self.pid() is not None
+        self.stop()
+        shutil.copyfile(self.flash, image)
+        if running:
+            self.start()
+
+    def restore(self, image):
+        self.stop()
+        self.start(image)
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Saves and restores flash-only snapshots of the Pico Fido emulator. RAM state (PIN tokens, sessions, caches) is not captured; restoring is a power cycle with the saved flash.')
+    parser.add_argument('--binary', default=DEFAULT_BINARY, help='Emulator binary.')
+    parser.add_argument('--workdir', default='.', help='Working directory of the emulator, where its flash lives.')
+    sub = parser.add_subparsers(dest='command', required=True)
+    sub.add_parser('save', help='Stops the emulator and saves its flash to an image (no RAM state).').add_argument('image')
+    sub.add_parser('restore', help='Restarts the emulator from a flash image, as after a power cycle.').add_argument('image')
+    sub.add_parser('run', help='Starts the emulator.').add_argument('image', nargs='?')
+    sub.add_parser('stop', help='Stops the emulator.')
+    return parser.parse_args()
+
+def main(args):
+    emu = Emulator(args.binary, args.workdir)
+    if args.command == 'save':
+        emu.save(args.image)
+    elif args.command == 'restore':
+        emu.restore(args.image)
+    elif args.command == 'run':
+        emu.start(args.image)
+    elif args.command == 'stop':
+        emu.stop()
+
+if __name__ == '__main__':
+    try:
+        main(parse_args())
+    except (RuntimeError, TimeoutError, OSError) as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
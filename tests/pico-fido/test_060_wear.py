@@ -0,0 +1,102 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+
+import os
+import struct
+import sys
+import pytest
+from fido2 import cbor
+from fido2.hid import CTAPHID
+from fido2.ctap2.pin import ClientPin
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', 'emulation'))
+from snapshot import Emulator
+
+PIN = "12345678"
+
+CTAP_VENDOR_CBOR = CTAPHID.VENDOR_FIRST + 1
+CTAP_VENDOR_WEAR = 0x07
+WEAR_GET = 0x01
+
+WEAR_CLASS_SIGN_COUNTER = 0x00
+WEAR_CLASS_WEAR = 0x0A
+WEAR_FLUSH_WRITES = 256
+
+def vendor_wear(device, client_pin, token):
+    msg = b"\xff" * 32 + struct.pack("<BB", CTAP_VENDOR_WEAR, WEAR_GET)
+    param = client_pin.protocol.authenticate(token, msg)
+    req = struct.pack(">B", CTAP_VENDOR_WEAR) + cbor.encode({1: WEAR_GET, 3: client_pin.protocol.VERSION, 4: param})
+    resp = device.send_data(CTAP_VENDOR_CBOR, req)
+    assert(resp[0] == 0x00)
+    return cbor.decode(resp[1:])
+
+def class_writes(wear, cls):
+    return sum(c[2] for c in wear[1] if c[1] == cls)
+
+def test_wear_flush(device, client_pin):
+    device.reset()
+    client_pin.set_pin(PIN)
+    token = client_pin.get_pin_token(PIN, permissions=ClientPin.PERMISSION.AUTHENTICATOR_CFG)
+    res = device.doMC(ctap1=True)
+    allow_list = [{"id": res['res'].attestation_object.auth_data.credential_data.credential_id, "type": "public-key"}]
+
+    before = vendor_wear(device, client_pin, token)
+    # Every U2F authentication writes the signature counter
+    for _ in range(WEAR_FLUSH_WRITES):
+        device.doGA(ctap1=True, allow_list=allow_list)
+    # The write that takes the pending count to WEAR_FLUSH_WRITES flushes the counters with it
+    after = vendor_wear(device, client_pin, token)
+    assert(class_writes(after, WEAR_CLASS_SIGN_COUNTER) >= class_writes(before, WEAR_CLASS_SIGN_COUNTER) + WEAR_FLUSH_WRITES)
+    assert(class_writes(after, WEAR_CLASS_WEAR) == class_writes(before, WEAR_CLASS_WEAR) + 1)
+    assert(after[3] > 0 and 0 < after[4] <= 1000)
+
+def power_cycle(device, emu):
+    emu.stop()
+    emu.start()
+    device.reboot()
+    return ClientPin(device.client()._backend.ctap2)
+
+def test_wear_reboot(device, client_pin):
+    emu = Emulator()
+    if emu.pid() is None:
+        pytest.skip("The emulator was not started by snapshot.py")
+    device.reset()
+    client_pin.set_pin(PIN)
+    res = device.doMC(ctap1=True)
+    allow_list = [{"id": res['res'].attestation_object.auth_data.credential_data.credential_id, "type": "public-key"}]
+    # Reading the counters saves the pending ones
+    token = client_pin.get_pin_token(PIN, permissions=ClientPin.PERMISSION.AUTHENTICATOR_CFG)
+    before = vendor_wear(device, client_pin, token)
+
+    # Far fewer writes than WEAR_FLUSH_WRITES in a power cycle, which ends without reading them
+    client_pin = power_cycle(device, emu)
+    for _ in range(3):
+        device.doGA(ctap1=True, allow_list=allow_list)
+    client_pin = power_cycle(device, emu)
+
+    token = client_pin.get_pin_token(PIN, permissions=ClientPin.PERMISSION.AUTHENTICATOR_CFG)
+    after = vendor_wear(device, client_pin, token)
+    assert(class_writes(after, WEAR_CLASS_SIGN_COUNTER) > class_writes(before, WEAR_CLASS_SIGN_COUNTER))
+    assert(class_writes(after, WEAR_CLASS_WEAR) > class_writes(before, WEAR_CLASS_WEAR))
+
+def test_wear_no_token(device):
+    req = struct.pack(">B", CTAP_VENDOR_WEAR) + cbor.encode({1: WEAR_GET})
+    resp = device.send_data(CTAP_VENDOR_CBOR, req)
+    assert(resp[0] != 0x00)
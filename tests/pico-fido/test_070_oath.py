@@ -25,6 +25,7 @@ INS_PUT = 0x01
 INS_DELETE = 0x02
 INS_SET_CODE = 0x03
 INS_RESET = 0x04
+INS_PUT_BATCH = 0x06
 INS_LIST = 0xa1
 INS_CALCULATE = 0xa2
 INS_VALIDATE = 0xa3
@@ -45,6 +46,7 @@ TAG_VERSION = 0x79
 TAG_IMF = 0x7a
 TAG_ALGO = 0x7b
 TAG_TOUCH_RESPONSE = 0x7c
+TAG_RECORD = 0x7d
 
 TYPE_MASK = 0xf0
 TYPE_HOTP = 0x10
@@ -256,3 +258,108 @@ def test_noauth(reset_oath):
         resp = send_apdu(reset_oath, INS_RESET, p1=0, p2=0, data=None)
     assert([e.value.sw1, e.value.sw2] == [0x6A, 0x86])
     resp = send_apdu(reset_oath, INS_RESET, p1=0xde, p2=0xad, data=None)
+
+def transmit_chained(card, ins, p2=0, data=[], ne=64):
+    lc = [0x00] + list(len(data).to_bytes(2, 'big')) if data else [0x00]
+    resp, sw1, sw2 = card.connection.transmit([0x00, ins, 0x00, p2] + lc + data + list(ne.to_bytes(2, 'big')))
+    chunks = 1
+    while sw1 == RESP_MORE_DATA:
+        more, sw1, sw2 = card.connection.transmit([0x00, INS_SEND_REMAINING, 0x00, 0x00, 0x00] + list(ne.to_bytes(2, 'big')))
+        resp += more
+        chunks += 1
+    assert([sw1, sw2] == [0x90, 0x00])
+    return resp, chunks
+
+def test_send_remaining(reset_oath):
+    names = [list(f'cred{i:02d}'.encode()) for i in range(20)]
+    for name in names:
+        data = [TAG_NAME, len(name)] + name + data_key
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+
+    resp, chunks = transmit_chained(reset_oath, INS_LIST)
+    assert(chunks > 1)
+    exp = []
+    for name in names:
+        exp += [TAG_NAME_LIST, len(name) + 1, 0x21] + name
+    assert(sorted(resp[i:i + 9] for i in range(0, len(resp), 9)) == sorted(exp[i:i + 9] for i in range(0, len(exp), 9)))
+
+    full = send_apdu(reset_oath, INS_CALC_ALL, p1=0, p2=1, data=data_chal)
+    resp, chunks = transmit_chained(reset_oath, INS_CALC_ALL, p2=1, data=data_chal)
+    assert(chunks > 1)
+    assert(resp == full)
+
+def test_send_remaining_after_select(reset_oath):
+    resp, sw1, sw2 = reset_oath.connection.transmit([0x00, INS_LIST, 0x00, 0x00, 0x00, 0x00, 64])
+    assert(sw1 == RESP_MORE_DATA)
+    aid = [0xa0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01, 0x01]
+    send_apdu(reset_oath, 0xA4, 0x04, 0x00, aid)
+    resp, sw1, sw2 = reset_oath.connection.transmit([0x00, INS_SEND_REMAINING, 0x00, 0x00, 0x00, 0x00, 64])
+    assert([sw1, sw2] == [0x90, 0x00])
+    assert(resp == [])
+
+def test_put_batch(reset_oath):
+    names = [list(f'batch{i:02d}'.encode()) for i in range(10)]
+    data = []
+    for name in names:
+        rec = [TAG_NAME, len(name)] + name + data_key
+        data += [TAG_RECORD, len(rec)] + rec
+    resp = send_apdu(reset_oath, INS_PUT_BATCH, p1=0, p2=0, data=data)
+    assert(len(resp) == 0)
+    resp = list_apdu(reset_oath)
+    exp = []
+    for name in names:
+        exp += [TAG_NAME_LIST, len(name) + 1, 0x21] + name
+    assert(sorted(resp[i:i + 10] for i in range(0, len(resp), 10)) == sorted(exp[i:i + 10] for i in range(0, len(exp), 10)))
+
+    # A bad record rejects the whole batch
+    rec = [TAG_NAME, len(name_kaka)] + name_kaka
+    with pytest.raises(APDUResponse) as e:
+        send_apdu(reset_oath, INS_PUT_BATCH, p1=0, p2=0, data=data[:len(data) // 10] + [TAG_RECORD, len(rec)] + rec)
+    assert([e.value.sw1, e.value.sw2] == [0x6A, 0x80])
+    resp = list_apdu(reset_oath)
+    assert(len(resp) == len(exp))
+
+def test_put_batch_existing(reset_oath):
+    single = [list(f'one{i}'.encode()) for i in range(3)]
+    for name in single:
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=[TAG_NAME, len(name)] + name + data_key)
+    send_apdu(reset_oath, INS_DELETE, p1=0, p2=0, data=[TAG_NAME, len(single[1])] + single[1])
+
+    # Fills the freed slot and the rest of the pools next to the stored credentials
+    names = [list(f'batch{i:02d}'.encode()) for i in range(24)] + [single[2]]
+    data = []
+    for name in names:
+        rec = [TAG_NAME, len(name)] + name + data_key
+        data += [TAG_RECORD, len(rec)] + rec
+    send_apdu(reset_oath, INS_PUT_BATCH, p1=0, p2=0, data=data)
+    resp, chunks = transmit_chained(reset_oath, INS_LIST)
+    listed = []
+    while resp:
+        listed.append(bytes(resp[3:2 + resp[1]]))
+        resp = resp[2 + resp[1]:]
+    assert(sorted(listed) == sorted(bytes(n) for n in [single[0]] + names))
+
+    for name in [single[0], single[2], names[0], names[-2]]:
+        resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=1, data=[TAG_NAME, len(name)] + name + data_chal)
+        assert(resp[0] == TAG_T_RESPONSE)
+
+def test_capacity(reset_oath):
+    names = [list(f'cap{i:03d}'.encode()) for i in range(300)]
+    for b in range(0, len(names), 20):
+        data = []
+        for name in names[b:b + 20]:
+            rec = [TAG_NAME, len(name)] + name + data_key
+            data += [TAG_RECORD, len(rec)] + rec
+        send_apdu(reset_oath, INS_PUT_BATCH, p1=0, p2=0, data=data)
+
+    resp, chunks = transmit_chained(reset_oath, INS_LIST)
+    assert(len(resp) == len(names) * (2 + 1 + 6))
+
+    data = [TAG_NAME, len(names[-1])] + names[-1] + data_chal
+    resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=1, data=data)
+    assert(resp[0] == TAG_T_RESPONSE)
+
+    data = [TAG_NAME, len(names[0])] + names[0]
+    send_apdu(reset_oath, INS_DELETE, p1=0, p2=0, data=data)
+    resp, chunks = transmit_chained(reset_oath, INS_LIST)
+    assert(len(resp) == (len(names) - 1) * (2 + 1 + 6))
@@ -0,0 +1,4 @@
+#!/bin/bash -eu
+
+source tests/docker_env.sh
+run_in_docker ./tests/start-up-and-bench.sh "$@"
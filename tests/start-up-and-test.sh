@@ -4,5 +4,6 @@
 sleep 2
 rm -f memory.flash
 cp -R tests/docker/fido2/* /usr/local/lib/python3.9/dist-packages/fido2/hid
-./build_in_docker/pico_fido > /dev/null &
+# Started through snapshot.py, so tests can power cycle it
+python3 tests/emulation/snapshot.py run
 pytest tests
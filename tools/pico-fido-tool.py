@@ -27,6 +27,7 @@ from words import words
 from threading import Event
 from typing import Mapping, Any, Optional, Callable
 import struct
+from getpass import getpass
 import urllib.request
 import json
 from enum import IntEnum, unique
@@ -38,7 +39,7 @@ try:
     from fido2.utils import bytes2int, int2bytes
     from fido2 import cbor
     from fido2.ctap import CtapDevice, CtapError
-    from fido2.ctap2.pin import PinProtocol, _PinUv
+    from fido2.ctap2.pin import PinProtocol, _PinUv, ClientPin
     from fido2.ctap2.base import args
 except:
     print('ERROR: fido2 module not found! Install fido2 package.\nTry with `pip install fido2`')
@@ -198,6 +199,9 @@ class Vendor:
         VENDOR_MSE       = 0x02
         VENDOR_UNLOCK    = 0x03
         VENDOR_EA        = 0x04
+        VENDOR_STATS     = 0x05
+        VENDOR_TRACE     = 0x06
+        VENDOR_WEAR      = 0x07
 
     @unique
     class PARAM(IntEnum):
@@ -210,6 +214,11 @@ class Vendor:
         KEY_AGREEMENT       = 0x01
         EA_CSR              = 0x01
         EA_UPLOAD           = 0x02
+        STATS_GET           = 0x01
+        STATS_RESET         = 0x02
+        TRACE_GET           = 0x01
+        TRACE_CLEAR         = 0x02
+        WEAR_GET            = 0x01
 
     class RESP(IntEnum):
         PARAM       = 0x01
@@ -240,8 +249,7 @@ class Vendor:
         if self.pin_uv:
             msg = (
                 b"\xff" * 32
-                + b"\x0d"
-                + struct.pack("<b", sub_cmd)
+                + struct.pack("<BB", cmd, sub_cmd)
                 + (cbor.encode(params) if params else b"")
             )
             pin_uv_protocol = self.pin_uv.protocol.VERSION
@@ -378,8 +386,41 @@ class Vendor:
             }
         )
 
+    def stats(self):
+        return self._call(
+            Vendor.CMD.VENDOR_STATS,
+            Vendor.SUBCMD.STATS_GET,
+        )[Vendor.RESP.PARAM]
+
+    def stats_reset(self):
+        self._call(
+            Vendor.CMD.VENDOR_STATS,
+            Vendor.SUBCMD.STATS_RESET,
+        )
+
+    def trace(self):
+        ret = self._call(
+            Vendor.CMD.VENDOR_TRACE,
+            Vendor.SUBCMD.TRACE_GET,
+        )
+        return [(ret[2][f], line, err) for f, line, err in ret[1]], ret[3]
+
+    def trace_clear(self):
+        self._call(
+            Vendor.CMD.VENDOR_TRACE,
+            Vendor.SUBCMD.TRACE_CLEAR,
+        )
+
+    def wear(self):
+        ret = self._call(
+            Vendor.CMD.VENDOR_WEAR,
+            Vendor.SUBCMD.WEAR_GET,
+        )
+        return ret[1], ret[2], ret[3], ret[4]
+
 def parse_args():
     parser = argparse.ArgumentParser()
+    parser.add_argument('--pin', help='PIN of the device, asked for if needed and not given.')
     subparser = parser.add_subparsers(title="commands", dest="command")
     parser_secure = subparser.add_parser('secure', help='Manages security of Pico Fido.')
     parser_secure.add_argument('subcommand', choices=['enable', 'disable', 'unlock'], help='Enables, disables or unlocks the security.')
@@ -392,6 +433,15 @@ def parse_args():
     parser_attestation.add_argument('subcommand', choices=['csr'])
     parser_attestation.add_argument('--filename', help='Uploads the certificate filename to the device as enterprise attestation certificate. If not provided, it will generate an enterprise attestation certificate automatically.')
 
+    parser_stats = subparser.add_parser('stats', help='Shows per-command dispatch statistics.')
+    parser_stats.add_argument('subcommand', choices=['show', 'reset'], help='Shows or resets the statistics.')
+
+    parser_trace = subparser.add_parser('trace', help='Shows the last CBOR errors recorded by the device.')
+    parser_trace.add_argument('subcommand', choices=['show', 'clear'], help='Shows or clears the error trace.')
+
+    parser_wear = subparser.add_parser('wear', help='Shows flash wear per file class. Erases are estimated from the writes.')
+    parser_wear.add_argument('subcommand', choices=['show'], help='Shows the flash wear counters.')
+
     args = parser.parse_args()
     return args
 
@@ -425,6 +475,43 @@ def attestation(vdr, args):
                     cert = x509.load_pem_x509_certificate(dataf)
         vdr.upload_ea(cert.public_bytes(Encoding.DER))
 
+STATS_TABLES = { 1: 'CTAP2', 2: 'VENDOR', 3: 'U2F', 4: 'OATH', 5: 'MAN', 6: 'OTP' }
+
+def stats(vdr, args):
+    if (args.subcommand == 'show'):
+        stats = vdr.stats()
+        mem = any(8 in st for st in stats)
+        print(f'{"TABLE":<8}{"CMD":>6}{"COUNT":>10}{"AVG(us)":>10}{"MAX(us)":>10}' + (f'{"HEAP":>10}{"ALLOCS":>10}{"STACK":>10}' if mem else '') + '  ERRORS')
+        for st in stats:
+            count = st[3]
+            errs = ', '.join(f'0x{k:02X}:{v}' for k, v in st[6].items())
+            if (st.get(7, 0) > 0):
+                errs += f'{", " if errs else ""}other:{st[7]}'
+            memstr = f'{st[8]:>10}{st[9] // count:>10}{st[10]:>10}' if 8 in st else ''
+            print(f'{STATS_TABLES.get(st[1], st[1]):<8}{f"0x{st[2]:02X}":>6}{count:>10}{st[4] // count:>10}{st[5]:>10}{memstr}  {errs}')
+    elif (args.subcommand == 'reset'):
+        vdr.stats_reset()
+
+def trace(vdr, args):
+    if (args.subcommand == 'show'):
+        entries, total = vdr.trace()
+        for file, line, err in entries:
+            print(f'{file}:{line}\t{err} (0x{err & 0xFFFFFFFF:02X})')
+        if (total > len(entries)):
+            print(f'{total - len(entries)} older entries were overwritten')
+    elif (args.subcommand == 'clear'):
+        vdr.trace_clear()
+
+WEAR_CLASSES = { 0: 'COUNTER', 1: 'PIN', 2: 'CRED', 3: 'BLOB', 4: 'OATH', 5: 'OATHIMF', 6: 'OTP', 7: 'OTPCTR', 8: 'DEVICE', 9: 'TXN', 10: 'WEAR', 11: 'OTHER' }
+
+def wear(vdr, args):
+    if (args.subcommand == 'show'):
+        classes, erases, budget, remaining = vdr.wear()
+        print(f'{"CLASS":<8}{"WRITES":>10}{"BYTES":>12}{"DELETES":>10}{"EST.ERASES":>12}')
+        for w in classes:
+            print(f'{WEAR_CLASSES.get(w[1], w[1]):<8}{w[2]:>10}{w[3]:>12}{w[4]:>10}{w[5]:>12}')
+        print(f'Sector erases (estimated, at most): {erases} of {budget}, {remaining / 10:.1f}% endurance left')
+
 def main(args):
     print('Pico Fido Tool v1.4')
     print('Author: Pol Henarejos')
@@ -434,7 +521,15 @@ def main(args):
 
     dev = next(CtapHidDevice.list_devices(), None)
 
-    vdr = Vendor(Ctap2Vendor(dev))
+    ctap = Ctap2Vendor(dev)
+    if (args.command in ['stats', 'trace', 'wear']):
+        # Telemetry requires a token with the authenticator configuration permission
+        client_pin = ClientPin(ctap)
+        pin = args.pin if args.pin is not None else getpass('PIN: ')
+        token = client_pin.get_pin_token(pin, ClientPin.PERMISSION.AUTHENTICATOR_CFG)
+        vdr = Vendor(ctap, client_pin.protocol, token)
+    else:
+        vdr = Vendor(ctap)
 
     if (args.command == 'secure'):
         secure(vdr, args)
@@ -442,6 +537,12 @@ def main(args):
         backup(vdr, args)
     elif (args.command == 'attestation'):
         attestation(vdr, args)
+    elif (args.command == 'stats'):
+        stats(vdr, args)
+    elif (args.command == 'trace'):
+        trace(vdr, args)
+    elif (args.command == 'wear'):
+        wear(vdr, args)
 
 def run():
     args = parse_args()